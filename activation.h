@@ -0,0 +1,306 @@
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+/*
+  Activation functions that a layer can use. Every entry
+  of the registry has a kernel that activates a run of
+  sums in place and a kernel for the derivative, which
+  backProp uses for the layers with that activation.
+
+  ACT_SIGMOID = 1/(1 + e^-z). The accuracy is set by
+    SigmoidMode.
+  ACT_RELU = max(0, z)
+  ACT_TANH = 2*sigmoid(2z) - 1, so it has the same
+    accuracy as the sigmoid of SigmoidMode.
+  ACT_LEAKY_RELU = z if z > 0, else LEAKY_RELU_SLOPE*z
+
+  The ReLU family doesn't call expf at all.
+*/
+typedef enum {
+  ACT_SIGMOID = 0,
+  ACT_RELU,
+  ACT_TANH,
+  ACT_LEAKY_RELU,
+  ACT_COUNT
+} ActivationType;
+
+#define LEAKY_RELU_SLOPE 0.01f
+
+typedef struct {
+  const char *name;
+  //f of 'count' sums in place
+  void (*forward)(nnacc *x, size_t count, SigmoidMode mode);
+  //f of one sum
+  nnacc (*one)(nnacc z, SigmoidMode mode);
+  //d[i] *= f'(z) where a[i] = f(z). Every derivative here
+  //can be found from the output, so backProp doesn't need
+  //the sums.
+  void (*derivative)(const nnacc *a, nnacc *d, size_t count);
+} Activation;
+
+//Entry of the registry. 'type' must be below ACT_COUNT.
+const Activation *getActivation(ActivationType type);
+//Type with the given name or ACT_COUNT if there is none
+ActivationType activationByName(const char *name);
+
+//Every element of 'matrix' in place
+void applyActivation(Matrix matrix, ActivationType type, SigmoidMode mode);
+
+/*
+  dst = f(input * weights + biases)
+
+  denseForward for any activation. The GEMM kernels only
+  fuse the sigmoid, so for the other activations the sums
+  are made with the bias and then activated row by row.
+*/
+void activationDense(
+  Matrix dst, Matrix input, Matrix weights, Matrix biases,
+  ActivationType type, SigmoidMode mode
+);
+
+#endif
+
+#ifdef ACTIVATION_IMPL
+
+#include <string.h>
+
+/*
+  The vector kernels return the number of elements they
+  did, a multiple of 8. The scalar loops do the rest.
+  ReLU is leaky ReLU with a slope of 0: max(z, slope*z)
+  is both of them for slopes from 0 to 1.
+*/
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+
+__attribute__((target("avx2")))
+static size_t actReluAvx2(float *x, size_t count, float slope) {
+  __m256 s = _mm256_set1_ps(slope);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 v = _mm256_loadu_ps(&x[i]);
+    _mm256_storeu_ps(&x[i], _mm256_max_ps(v, _mm256_mul_ps(s, v)));
+  }
+  return i;
+}
+
+//2*x and 2*x - 1, the steps of tanh around the sigmoid
+__attribute__((target("avx2,fma")))
+static size_t actAffineAvx2(float *x, size_t count, float mul, float add) {
+  __m256 m = _mm256_set1_ps(mul);
+  __m256 b = _mm256_set1_ps(add);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(&x[i], _mm256_fmadd_ps(m, _mm256_loadu_ps(&x[i]), b));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t actSigmoidDerivAvx2(const float *a, float *d, size_t count) {
+  __m256 one = _mm256_set1_ps(1);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 av = _mm256_loadu_ps(&a[i]);
+    __m256 f = _mm256_mul_ps(av, _mm256_sub_ps(one, av));
+    _mm256_storeu_ps(&d[i], _mm256_mul_ps(_mm256_loadu_ps(&d[i]), f));
+  }
+  return i;
+}
+
+__attribute__((target("avx2,fma")))
+static size_t actTanhDerivAvx2(const float *a, float *d, size_t count) {
+  __m256 one = _mm256_set1_ps(1);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 av = _mm256_loadu_ps(&a[i]);
+    __m256 f = _mm256_fnmadd_ps(av, av, one);
+    _mm256_storeu_ps(&d[i], _mm256_mul_ps(_mm256_loadu_ps(&d[i]), f));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t actReluDerivAvx2(const float *a, float *d, size_t count, float slope) {
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1);
+  __m256 s = _mm256_set1_ps(slope);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 positive = _mm256_cmp_ps(_mm256_loadu_ps(&a[i]), zero, _CMP_GT_OQ);
+    __m256 f = _mm256_blendv_ps(s, one, positive);
+    _mm256_storeu_ps(&d[i], _mm256_mul_ps(_mm256_loadu_ps(&d[i]), f));
+  }
+  return i;
+}
+
+#define ACT_AVX2 (simdIsa() >= SIMD_AVX2)
+
+#endif
+
+static void actRelu(nnacc *x, size_t count, nnacc slope) {
+  size_t i = 0;
+#ifdef ACT_AVX2
+  if(ACT_AVX2) i = actReluAvx2(x, count, slope);
+#endif
+  for(; i < count; i++) {
+    if(x[i] < 0) x[i] *= slope;
+  }
+}
+
+static void actAffine(nnacc *x, size_t count, nnacc mul, nnacc add) {
+  size_t i = 0;
+#ifdef ACT_AVX2
+  if(ACT_AVX2) i = actAffineAvx2(x, count, mul, add);
+#endif
+  for(; i < count; i++) {
+    x[i] = mul*x[i] + add;
+  }
+}
+
+static void actReluDeriv(const nnacc *a, nnacc *d, size_t count, nnacc slope) {
+  size_t i = 0;
+#ifdef ACT_AVX2
+  if(ACT_AVX2) i = actReluDerivAvx2(a, d, count, slope);
+#endif
+  for(; i < count; i++) {
+    if(!(a[i] > 0)) d[i] *= slope;
+  }
+}
+
+static void sigmoidForward(nnacc *x, size_t count, SigmoidMode mode) {
+  sigmoidRun(x, count, mode);
+}
+
+static void sigmoidDerivative(const nnacc *a, nnacc *d, size_t count) {
+  size_t i = 0;
+#ifdef ACT_AVX2
+  if(ACT_AVX2) i = actSigmoidDerivAvx2(a, d, count);
+#endif
+  for(; i < count; i++) {
+    d[i] *= a[i]*(1 - a[i]);
+  }
+}
+
+static void reluForward(nnacc *x, size_t count, SigmoidMode mode) {
+  (void)mode;
+  actRelu(x, count, 0);
+}
+
+static nnacc reluOne(nnacc z, SigmoidMode mode) {
+  (void)mode;
+  return z > 0 ? z : 0;
+}
+
+static void reluDerivative(const nnacc *a, nnacc *d, size_t count) {
+  actReluDeriv(a, d, count, 0);
+}
+
+static void tanhForward(nnacc *x, size_t count, SigmoidMode mode) {
+  actAffine(x, count, 2, 0);
+  sigmoidRun(x, count, mode);
+  actAffine(x, count, 2, -1);
+}
+
+static nnacc tanhOne(nnacc z, SigmoidMode mode) {
+  return 2*sigmoidOne(2*z, mode) - 1;
+}
+
+static void tanhDerivative(const nnacc *a, nnacc *d, size_t count) {
+  size_t i = 0;
+#ifdef ACT_AVX2
+  if(ACT_AVX2) i = actTanhDerivAvx2(a, d, count);
+#endif
+  for(; i < count; i++) {
+    d[i] *= 1 - a[i]*a[i];
+  }
+}
+
+static void leakyReluForward(nnacc *x, size_t count, SigmoidMode mode) {
+  (void)mode;
+  actRelu(x, count, LEAKY_RELU_SLOPE);
+}
+
+static nnacc leakyReluOne(nnacc z, SigmoidMode mode) {
+  (void)mode;
+  return z > 0 ? z : LEAKY_RELU_SLOPE*z;
+}
+
+static void leakyReluDerivative(const nnacc *a, nnacc *d, size_t count) {
+  actReluDeriv(a, d, count, LEAKY_RELU_SLOPE);
+}
+
+//In the order of ActivationType
+static const Activation activationRegistry[ACT_COUNT] = {
+  {"sigmoid", sigmoidForward, sigmoidOne, sigmoidDerivative},
+  {"relu", reluForward, reluOne, reluDerivative},
+  {"tanh", tanhForward, tanhOne, tanhDerivative},
+  {"leaky_relu", leakyReluForward, leakyReluOne, leakyReluDerivative},
+};
+
+const Activation *getActivation(ActivationType type) {
+  ASSERT_NN(type < ACT_COUNT);
+  return &activationRegistry[type];
+}
+
+ActivationType activationByName(const char *name) {
+  for(int i = 0; i < ACT_COUNT; i++) {
+    if(strcmp(activationRegistry[i].name, name) == 0) return (ActivationType)i;
+  }
+  return ACT_COUNT;
+}
+
+void applyActivation(Matrix matrix, ActivationType type, SigmoidMode mode) {
+  if(type == ACT_SIGMOID) {
+    applySigmoidMode(matrix, mode);
+    return;
+  }
+
+  const Activation *act = getActivation(type);
+#ifdef NN_HALF
+  //The kernels work on sums, so each row goes through
+  //a float copy
+  nnacc row[matrix.cols];
+  for(size_t i = 0; i < matrix.rows; i++) {
+    nnfloat *start = &matrix.start[getCell(matrix, i, 0)];
+    loadFloats(row, start, matrix.cols);
+    act->forward(row, matrix.cols, mode);
+    storeFloats(start, row, matrix.cols);
+  }
+#else
+  for(size_t i = 0; i < matrix.rows; i++) {
+    act->forward(&matrix.start[getCell(matrix, i, 0)], matrix.cols, mode);
+  }
+#endif
+}
+
+void activationDense(
+  Matrix dst, Matrix input, Matrix weights, Matrix biases,
+  ActivationType type, SigmoidMode mode
+) {
+  if(type == ACT_SIGMOID) {
+    denseForward(dst, input, weights, biases, mode);
+    return;
+  }
+
+#ifdef NN_FLOAT32
+  ASSERT_NN(input.cols == weights.rows);
+  ASSERT_NN(dst.rows == input.rows);
+  ASSERT_NN(dst.cols == weights.cols);
+  ASSERT_NN(biases.rows == 1);
+  ASSERT_NN(biases.cols == dst.cols);
+  if(!simdGemmBias(
+    dst.rows, dst.cols, input.cols,
+    input.start, input.stride,
+    weights.start, weights.stride,
+    biases.start,
+    dst.start, dst.stride
+  ))
+#endif
+  {
+    matrixDot(dst, input, weights);
+    matrixSumRow(dst, biases);
+  }
+  applyActivation(dst, type, mode);
+}
+
+#endif
@@ -1,19 +1,67 @@
+#define SIMD_IMPL
+#define RANDOM_IMPL
 #define MATRIX_IMPL
+#define ACTIVATION_IMPL
 #define NEURAL_NET_IMPL
 #define COMPUTE_IMPL
+#define PARALLEL_IMPL
+#define MODEL_IMPL
+#define PROFILE_IMPL
+#define DATASET_IMPL
+#define QUANT_IMPL
+#define OPTIMIZER_IMPL
+#define SPARSE_IMPL
+#define LOGIC_IMPL
 
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 
+#include "profile.h"
+#include "simd.h"
+#include "random.h"
 #include "matrix.h"
+#include "activation.h"
 #include "neuralnet.h"
 #include "compute.h"
+#include "parallel.h"
+#include "model.h"
+#include "dataset.h"
+#include "quant.h"
+#include "optimizer.h"
+#include "sparse.h"
+#include "logic.h"
+
+//Cost of the training steps of main
+typedef struct {
+  //The cost is printed every 'reportEvery' steps
+  size_t reportEvery;
+  float targetCost;
+  //First step whose cost is below 'targetCost', -1 until
+  //there is one
+  int targetStep;
+} TrainProgress;
+
+//TrainReport of trainSteps. The other modes call it after
+//every step.
+static void reportProgress(void *ctx, size_t step, float cost) {
+  TrainProgress *p = ctx;
+  if(p->targetStep < 0 && cost < p->targetCost) p->targetStep = (int)step;
+
+  if(step % p->reportEvery == 0) {
+    printf("%zu: Cost(Training): %f\n", step, cost);
+  }
+}
 
 int main(int argc, char *argv[]) {
   //Number of bits allowed. If sum of bits 
   //of adder is more this bit, it means that
   //the sum overflows. 
   const size_t BITS = 2;
+  //Rows that are made or activated at once. Training on
+  //random rows, the costs and the verification only need
+  //this many rows of memory for any number of bits.
+  const size_t BATCH = 256;
 
   //left shift to number of bits.
   //This is just like multiplying number by 2
@@ -23,85 +71,48 @@ int main(int argc, char *argv[]) {
   //1<<3 = 1 0 0 = (1+1)*2*2 = 8 
   size_t n = (1<<BITS);
   size_t rows = n*n;
+  size_t batchRows = rows < BATCH ? rows : BATCH;
+  //When the whole training set fits in one batch it's kept
+  //in memory, so every mode can train on it and the
+  //quantized, pruned and truth table reports can run.
+  //That's up to 4 bits.
+  bool small = rows <= BATCH;
 
   size_t inputCols = 2*BITS;
   size_t outputCols = BITS+1;
 
+  //Makes the rows of the adder when they're needed. See
+  //adderFill in dataset.h for how the bits are arranged.
+  //With more bits the rows don't fit in memory so they
+  //are only made one batch at a time.
+  DataSource adder = createAdderSource(BITS);
+
   //This holds two pairs of bits that will
   //be added
-  Matrix ti = matrixAlloc(rows, inputCols);
+  Matrix ti = {0};
   
   //This holds the sum of pairs of bits
   //and the last column is for the carry
-  Matrix to = matrixAlloc(rows, outputCols);
-
-  //Loop rows
-  for(size_t i = 0; i < ti.rows; i++) {
-    //if n = 4
-    //i = 1-3; x = 0 
-    //i = 4-16; x = greater than 0
-    //first bit set
-    size_t x = i/n;
-    //if n = 4
-    //i = 1-3; y = 1-3
-    //i = 4-16; y = remainder
-    //second bit set
-    size_t y = i%n;
-
-    //sum of both bit set
-    size_t z = x + y;
-
-    //loop columns and fill up the matrix
-    for(int j = 0; j < BITS; j++) {
-      //Note: use &1 to ignore all bits except
-      //for the rightmost bit. For example:
-      //1011 & 0001 = 0001
-      
-      //Note: bit arrangement in each row of
-      //'ti' doesn't matter because we're just 
-      //doing binary addition. For example, 2 = 1 0
-      //but in this loop it will be arranged
-      //'0 1' because we extract the first rightmost
-      //bit of a number and this loop arrange bits
-      //from left to right. Adding '1 0' or '0 1'
-      //will have equal answer.
-
-      //Extract rightmost bit
-      //Example:
-      //x = 1 0 1
-      //x>>0 = 1 0 1
-      //(x>>0)&1 = 1 0 1 & 0 0 1 = 0 0 1 = [1]
-      //x>>1 = 1 0
-      //(x>>1)&1 = 1 0 & 0 1 = 0 0 = [0]
-      //x>>2 = 1
-      //(x>>2)&1 = 1 & 1 = [1]
-
-      ti.start[getCell(ti, i, j)] = (x>>j)&1;
-      //Transfer y's rightmost bit to the next sub-array
-      ti.start[getCell(ti, i, j + BITS)] = (y>>j)&1;
-      
-      to.start[getCell(to, i, j)] = (z>>j)&1;
-    }
-
-    //Put the carry value in the last column of 'to'.
-    //If the sum is greater than the number limit,
-    //the sum overflows. Thus, the condition returns
-    //0. Else returns 1. For example, if the max bits
-    //of adder is 2, value 3(binary = 1 1) is the 
-    //max number that we can store. Values greater than
-    //3 makes the sum overflows. For example, 
-    //4(binary = 1 0 0) has 3 bits. The '1' leftmost bit
-    //is the carry.
-    to.start[getCell(to, i, BITS)] = z >= n;
-  }
+  Matrix to = {0};
 
-  float learnRate = 1;
-  size_t nModel[] = {BITS*2, BITS*2+1, BITS+1};
-  NeuralNetwork neuralNet = createNetwork(nModel, ARRAY_LENGTH(nModel));
-  NeuralNetwork gradient = createNetwork(nModel, ARRAY_LENGTH(nModel));
-  randNetwork(neuralNet, 0, 1);
+  //A few bits only have a few rows so all of them are kept
+  //for the modes that train on the whole set. Mode 's' only
+  //uses the source.
+  if(small) {
+    ti = matrixAlloc(rows, inputCols);
+    to = matrixAlloc(rows, outputCols);
+    dataFillRows(adder, 0, ti, to);
+  }
 
   char reduceType = 'b';
+  //Mode 'a' updates the weights with an optimizer of
+  //optimizer.h. It's Adam for "a", or the optimizer whose
+  //name is given in place of the mode, like "nesterov".
+  OptimizerType optimizerType = OPT_ADAM;
+  //Mode 'r' trains with another activation in the hidden
+  //layer. It's ReLU for "r", or the activation whose name
+  //is given in place of the mode, like "tanh".
+  ActivationType hiddenActivation = ACT_RELU;
   if(argv[1] != NULL) {
     if(strcmp(argv[1], "b") == 0) {
       reduceType = 'b';
@@ -109,32 +120,162 @@ int main(int argc, char *argv[]) {
     else if(strcmp(argv[1], "f") == 0) {
       reduceType = 'f';
     }
-    else reduceType = 'b'; //default
+    else if(strcmp(argv[1], "p") == 0) {
+      reduceType = 'p';
+    }
+    else if(strcmp(argv[1], "m") == 0) {
+      reduceType = 'm';
+    }
+    else if(strcmp(argv[1], "s") == 0) {
+      reduceType = 's';
+    }
+    else if(strcmp(argv[1], "a") == 0) {
+      reduceType = 'a';
+    }
+    else if(strcmp(argv[1], "r") == 0) {
+      reduceType = 'r';
+    }
+    else {
+      reduceType = 'b'; //default
+      for(OptimizerType t = OPT_SGD; t <= OPT_ADAM; t++) {
+        if(strcmp(argv[1], optimizerName(t)) == 0) {
+          reduceType = 'a';
+          optimizerType = t;
+        }
+      }
+      //The sigmoid is the activation of mode 'b'
+      ActivationType act = activationByName(argv[1]);
+      if(act != ACT_COUNT && act != ACT_SIGMOID) {
+        reduceType = 'r';
+        hiddenActivation = act;
+      }
+    }
   } else reduceType = 'b'; //default
 
+  //Without the whole training set only random rows of
+  //the source can be trained on
+  if(!small && reduceType != 's') {
+    printf("%zu bits don't fit in memory, training on random rows\n", BITS);
+    reduceType = 's';
+  }
+
+  float learnRate = 1;
+  //Mode 'r' has a wider hidden layer whose weights start
+  //around 0. With 5 nodes and weights from 0 to 1 the ReLU
+  //nodes die and the cost gets stuck with a row wrong. 32
+  //nodes from -1 to 1 trained every activation below 0.01
+  //in a few hundred steps for all the seeds that were tried.
+  size_t hidden = reduceType == 'r' ? 32 : BITS*2+1;
+  size_t nModel[] = {BITS*2, hidden, BITS+1};
+  //The layers hold up to BATCH training rows so each
+  //forward pass activates that many rows at once
+  NeuralNetwork neuralNet = createBatchNetwork(nModel, ARRAY_LENGTH(nModel), batchRows);
+  NeuralNetwork gradient = createNetwork(nModel, ARRAY_LENGTH(nModel));
+  if(reduceType == 'r') {
+    randNetwork(neuralNet, -1, 1);
+  } else randNetwork(neuralNet, 0, 1);
+  //Outputs only need to be on the right side of 0.5 so
+  //the polynomial sigmoid is accurate enough
+  neuralNet.sigmoidMode = SIGMOID_FAST;
+
+  //The output layer stays a sigmoid so the outputs are
+  //from 0 to 1
+  if(reduceType == 'r') {
+    neuralNet.activations[0] = hiddenActivation;
+  }
+
+  //Parallel back propagation splits the training rows
+  //between one thread per CPU
+  ThreadPool *pool = NULL;
+  BackPropWorkers workers;
+  if(reduceType == 'p') {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool = createThreadPool(cpus > 0 ? (size_t)cpus : 1);
+    workers = createBackPropWorkers(pool, neuralNet, batchRows);
+  }
+
+  //Mini-batch gradient descent updates the weights after
+  //every 'miniBatch' shuffled rows
+  size_t miniBatch = 4;
+  size_t *order = NULL;
+  if(reduceType == 'm') {
+    order = createRowOrder(rows);
+  }
+
+  //Rate of each OptimizerType. SGD has learnRate like mode
+  //'b'. RMSProp and Adam keep a step size for every
+  //parameter so they need a much smaller rate. The others
+  //were picked from rates 0.003 to 4 on this adder. How
+  //fast it trains jumps a lot between close rates because
+  //it can get stuck for a while.
+  const float optimizerRates[] = {
+    [OPT_SGD] = 1, [OPT_MOMENTUM] = 1, [OPT_NESTEROV] = 1,
+    [OPT_RMSPROP] = 0.1f, [OPT_ADAM] = 0.05f
+  };
+  Optimizer optimizer;
+  if(reduceType == 'a') {
+    optimizer = createOptimizer(
+      optimizerType, neuralNet, optimizerRates[optimizerType]
+    );
+  }
+
+  //Rows that are made by the source at once
+  DataBatch sample = createDataBatch(adder, batchRows);
 
-  printf("Cost Before Training: %f\n", computeCost(neuralNet, ti, to));
-  for(int i = 0; i < 10*1000; i++) {
+  //The cost is printed every 1000 steps. It's the cost
+  //before the step, which the gradient functions give back
+  //without another pass over the training rows. The first
+  //step below 0.01 is also printed, so the modes can be
+  //compared by how fast they get there.
+  TrainProgress progress = {.reportEvery = 1000, .targetCost = 0.01f, .targetStep = -1};
+  size_t steps = 10*1000;
+
+  printf(
+    "Cost Before Training: %f\n",
+    computeCostSource(neuralNet, adder, sample, 0, adder.rows)
+  );
+  //Plain back propagation is the step loop of trainSteps.
+  //It reports every step so the first step below the target
+  //is found.
+  if(reduceType == 'b' || reduceType == 'r') {
+    trainSteps(neuralNet, gradient, ti, to, learnRate, steps, 1, reportProgress, &progress);
+  }
+  else for(size_t i = 0; i < steps; i++) {
+    float cost;
     //Try comparing the performance of finite diff and
     //back propagation by using one of them at a time.
-    if(argv[1] != NULL) {
-      if(strcmp(argv[1], "b") == 0) {
-        backProp(neuralNet, gradient, ti, to);
-      }
-      else if(strcmp(argv[1], "f") == 0) {
-        computeFiniteDiff(neuralNet, gradient, 1e-1, ti, to);
-      }
-      else backProp(neuralNet, gradient, ti, to); //default
+    if(reduceType == 'f') {
+      cost = computeFiniteDiff(neuralNet, gradient, 1e-1, ti, to);
+      trainNetwork(neuralNet, gradient, learnRate);
+    }
+    else if(reduceType == 'p') {
+      cost = backPropParallel(workers, gradient, ti, to);
+      trainNetwork(neuralNet, gradient, learnRate);
+    }
+    else if(reduceType == 'm') {
+      //trainMiniBatch updates the weights by itself
+      cost = trainMiniBatch(neuralNet, gradient, ti, to, miniBatch, learnRate, order);
+    }
+    else if(reduceType == 's') {
+      //Random rows of the source instead of the whole set.
+      //The cost is the cost of those rows.
+      cost = trainSourceRandom(neuralNet, gradient, adder, sample, learnRate);
     }
     else {
-      //default
-      backProp(neuralNet, gradient, ti, to);
+      //reduceType == 'a'
+      cost = backProp(neuralNet, gradient, ti, to);
+      optimizerStep(&optimizer, neuralNet, gradient);
     }
 
-    trainNetwork(neuralNet, gradient, learnRate);
-    printf("%d: Cost(Training): %f\n", i, computeCost(neuralNet, ti, to));
+    reportProgress(&progress, i, cost);
   }
-  printf("Cost After Training: %f\n", computeCost(neuralNet, ti, to));
+  printf(
+    "Cost After Training: %f\n",
+    computeCostSource(neuralNet, adder, sample, 0, adder.rows)
+  );
+  if(progress.targetStep >= 0) {
+    printf("Cost went below %g at step %d\n", progress.targetCost, progress.targetStep);
+  } else printf("Cost didn't go below %g\n", progress.targetCost);
 
   if(reduceType == 'b') {
     printf("\nCost Reduction used: Back Propagation\n\n");
@@ -142,47 +283,78 @@ int main(int argc, char *argv[]) {
   else if(reduceType == 'f') {
     printf("\nCost Reduction used: Finite Difference\n\n");
   }
+  else if(reduceType == 'p') {
+    printf(
+      "\nCost Reduction used: Parallel Back Propagation (%zu threads)\n\n",
+      poolThreads(pool)
+    );
+    destroyBackPropWorkers(workers);
+    destroyThreadPool(pool);
+  }
+  else if(reduceType == 'm') {
+    printf(
+      "\nCost Reduction used: Mini-batch Back Propagation (%zu rows)\n\n", 
+      miniBatch
+    );
+    NN_FREE(order);
+  }
+  else if(reduceType == 's') {
+    printf(
+      "\nCost Reduction used: Back Propagation on random rows (%zu rows)\n\n", 
+      batchRows
+    );
+  }
+  else if(reduceType == 'a') {
+    printf(
+      "\nCost Reduction used: Back Propagation with %s (rate %g)\n\n",
+      optimizerName(optimizerType), optimizer.rate
+    );
+    destroyOptimizer(optimizer);
+  }
+  else if(reduceType == 'r') {
+    printf(
+      "\nCost Reduction used: Back Propagation with a %s hidden layer (%zu nodes)\n\n",
+      getActivation(hiddenActivation)->name, hidden
+    );
+  }
 
-  size_t fails = 0;
-  size_t total = 0;
-  for(size_t x = 0; x < n; x++) {
-    for(size_t y = 0; y < n; y++) {
-      size_t sum = x + y;
-
-      printf("%zu + %zu = ", x, y);
-
-      for(int j = 0; j < BITS; j++) {
-
-        INPUT_LAYER_NN(neuralNet).
-          start[getCell(INPUT_LAYER_NN(neuralNet), 0, j)] = (x>>j)&1;
-        INPUT_LAYER_NN(neuralNet).
-          start[getCell(INPUT_LAYER_NN(neuralNet), 0, j + BITS)] = (y>>j)&1;
-        
-      }
-      forwardNetwork(neuralNet);
-      total++;
+  //Every row is printed when there are few of them
+  if(small) {
+    //Row x*n + y of the source holds the bits of x and y.
+    //They are activated one batch of the network at a time.
+    for(uint64_t first = 0; first < adder.rows; first += batchRows) {
+      size_t len = adder.rows - first < batchRows ? adder.rows - first : batchRows;
+      dataFillRows(
+        adder, first,
+        getMatrixRows(INPUT_LAYER_NN(neuralNet), 0, len),
+        getMatrixRows(sample.output, 0, len)
+      );
+      forwardLanes(
+        neuralNet,
+        getMatrixRows(INPUT_LAYER_NN(neuralNet), 0, len),
+        getMatrixRows(OUTPUT_LAYER_NN(neuralNet), 0, len)
+      );
 
-      if(OUTPUT_LAYER_NN(neuralNet).
-          start[getCell(OUTPUT_LAYER_NN(neuralNet), 0, BITS)] > 0.5f) {
+      for(size_t s = 0; s < len; s++) {
+        size_t x = (first + s) / n;
+        size_t y = (first + s) % n;
+        size_t sum = x + y;
+        Matrix output = getMatrixRow(OUTPUT_LAYER_NN(neuralNet), s);
 
-        if(sum < n) {
-          printf("%zu + %zu = %zu %s", 
-            x, y, sum, "| Expected: overflow | Actual: no overflow");
-          fails++;
-        } else printf("overflow\n");
+        printf("%zu + %zu = ", x, y);
 
-      } else {
+        //The carry is bit BITS of the sum, so an overflow row
+        //is only right when its sum bits are right too. The
+        //counts below use the same rule.
         size_t z = 0;
-        for(int j = 0; j < BITS; j++) {
+        for(int j = 0; j <= BITS; j++) {
           //Neural network output an approximation between 0 to 1.
           //In this model's equation, if output leans toward 1, 
           //the model predicts that the output is 1. Otherwise, 
           //output is 0. The model's output gets closer to 1 or 0
           //if the model gets more training. Thus, we use 0.5f to decide if
           //a bit should be 1 or 0.
-          size_t bit = 
-              OUTPUT_LAYER_NN(neuralNet).
-                start[getCell(OUTPUT_LAYER_NN(neuralNet), 0, j)] > 0.5f;
+          size_t bit = output.start[getCell(output, 0, j)] > 0.5f;
 
           //extract bits to get the sum of the adder.
           //Example:
@@ -198,15 +370,110 @@ int main(int argc, char *argv[]) {
 
         if(z != sum) {
           printf("Actual Sum: %zu | Expected Sum: %zu (wrong answer)\n", z, sum);
-          fails++;
         }
+        else if(sum >= n) printf("%zu (overflow)\n", z);
         else printf("%zu\n", z);
-      }   
 
+      }
+    }
+  }
+
+  //Rows with an output on the wrong side of 0.5. The rows
+  //are made one batch at a time for any number of bits.
+  uint64_t fails = verifySource(neuralNet, adder, sample, 0, adder.rows);
+  printf("\nfails/total = error rate (rows with any output bit wrong)\n");
+  printf(
+    "%llu / %llu = %.2f%s\n",
+    (unsigned long long)fails, (unsigned long long)adder.rows,
+    ((double)fails/(double)adder.rows)*100, "%"
+  );
+
+  //The reports below need the whole training set
+  if(small) {
+    //Same check with int8 weights and an integer forward pass.
+    //The int8 network only has the sigmoid.
+    if(reduceType != 'r') {
+      printf("\n");
+      QuantNetwork quantNet = quantizeNetwork(neuralNet);
+      printQuantReport(quantCompare(neuralNet, quantNet, ti, to));
+      destroyQuantNetwork(quantNet);
+    }
+
+    //30% of the weights are pruned from a copy, which is
+    //trained some more with them held at 0 and then
+    //activated with only the weights that are left
+    NeuralNetwork prunedNet = cloneNetwork(neuralNet);
+    PruneMask mask = pruneNetwork(prunedNet, pruneThreshold(prunedNet, 0.3f));
+    for(int i = 0; i < 2000; i++) {
+      trainPruned(prunedNet, gradient, mask, ti, to, learnRate);
+    }
+    SparseNetwork sparseNet = sparseNetwork(prunedNet);
+    forwardSparse(sparseNet, ti, OUTPUT_LAYER_NN(prunedNet));
+
+    size_t sparseFails = 0;
+    for(size_t r = 0; r < rows; r++) {
+      int fail = 0;
+      for(size_t j = 0; j < outputCols; j++) {
+        int bit = OUTPUT_LAYER_NN(prunedNet).start[getCell(OUTPUT_LAYER_NN(prunedNet), r, j)] > 0.5f;
+        fail |= bit != (to.start[getCell(to, r, j)] > 0.5f);
+      }
+      sparseFails += fail;
+    }
+    printf(
+      "\nPruned %zu of %zu weights, cost after fine-tuning: %f\n",
+      mask.pruned, sparseNet.weightCount, computeCost(prunedNet, ti, to)
+    );
+    printf("wrong rows: %zu sparse (%zu weights left)\n", sparseFails, sparseNet.nonZeros);
+    destroySparseNetwork(sparseNet);
+    destroyPruneMask(mask);
+    destroyNetwork(prunedNet);
+
+    //Every input combination of the trained network is
+    //activated once and kept as bits. Entry x | y << BITS
+    //holds the sum bits and the carry, which is x + y.
+    TruthTable table = compileTable(neuralNet);
+    SlicedLogic sliced = compileSliced(table);
+    size_t tableFails = 0;
+    size_t slicedFails = 0;
+    uint64_t queries[64], in[2*BITS], out[BITS+1], answers[64];
+    for(size_t first = 0; first < rows; first += 64) {
+      size_t count = rows - first < 64 ? rows - first : 64;
+      for(size_t q = 0; q < count; q++) queries[q] = first + q;
+      sliceQueries(queries, count, table.inputs, in);
+      evalSliced(sliced, in, out);
+      unsliceOutputs(out, table.outputs, count, answers);
+
+      for(size_t q = 0; q < count; q++) {
+        uint64_t x = queries[q] & (n - 1);
+        uint64_t y = queries[q] >> BITS;
+        tableFails += tableLookup(table, queries[q]) != x + y;
+        slicedFails += answers[q] != x + y;
+      }
     }
+    printf(
+      "\nwrong rows: %zu table (%zu bits), %zu bit-sliced (%zu nodes)\n",
+      tableFails, table.words * 64 * table.outputs, slicedFails, sliced.count - 2
+    );
+    destroySlicedLogic(sliced);
+    destroyTruthTable(table);
   }
 
-  printf("\nfails/total = error rate\n");
-  printf("%zu / %zu = %.2f%s\n", fails, total, ((float)fails/(float)total)*100, "%");
+#ifdef NN_PROFILE
+  printf("\n");
+  profileReport(stdout);
+#endif
+
+  //The second argument is a file where the trained
+  //network is saved
+  if(argc > 2) {
+    if(saveNetwork(neuralNet, argv[2]) == 0) {
+      printf("Saved network to %s\n", argv[2]);
+    } else printf("Couldn't save network to %s\n", argv[2]);
+  }
 
+  destroyNetwork(neuralNet);
+  destroyNetwork(gradient);
+  destroyDataBatch(sample);
+  matrixFree(ti);
+  matrixFree(to);
 }
\ No newline at end of file
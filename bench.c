@@ -0,0 +1,287 @@
+#define SIMD_IMPL
+#define RANDOM_IMPL
+#define MATRIX_IMPL
+#define ACTIVATION_IMPL
+#define NEURAL_NET_IMPL
+#define COMPUTE_IMPL
+#define PARALLEL_IMPL
+#define SPARSE_IMPL
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simd.h"
+#include "random.h"
+#include "matrix.h"
+#include "activation.h"
+#include "neuralnet.h"
+#include "compute.h"
+#include "parallel.h"
+#include "sparse.h"
+
+/*
+  Times the main operations over a grid of layer widths,
+  hidden layer counts and sample counts. The results are
+  printed to stdout as JSON so two runs can be compared by
+  a script. Progress goes to stderr.
+
+  Usage: ./bench [repeats]
+
+  computeFiniteDiffParallel uses one thread per CPU.
+*/
+
+//Calls before the timed samples start
+#define BENCH_WARMUP 3
+//A timed sample repeats the call until it takes at least
+//this long so the clock resolution doesn't matter
+#define BENCH_MIN_SAMPLE_NS 200000
+//Fraction of the weights pruned for forwardSparse
+#define BENCH_PRUNE 0.9f
+//computeFiniteDiff costs paramCount * computeCost so it's
+//skipped for bigger networks
+#define BENCH_FINITE_DIFF_MAX_PARAMS 2048
+
+typedef struct {
+  NeuralNetwork n;
+  NeuralNetwork g;
+  SparseNetwork s;
+  FiniteDiffWorkers fw;
+  ActivationType act;
+  Matrix a;
+  Matrix b;
+  Matrix c;
+  //one row of biases for activationDense
+  Matrix bias;
+  Matrix ti;
+  Matrix to;
+} BenchData;
+
+typedef void (*BenchFunc)(BenchData *d);
+
+static void benchMatrixDot(BenchData *d) {
+  matrixDot(d->c, d->a, d->b);
+}
+
+static void benchApplySigmoid(BenchData *d) {
+  //'c' is overwritten in place. The values stay between
+  //0.5 and 0.74 after a few calls which doesn't change
+  //the cost of the sigmoid.
+  applySigmoid(d->c);
+}
+
+static void benchActivationDense(BenchData *d) {
+  activationDense(d->c, d->a, d->b, d->bias, d->act, SIGMOID_EXACT);
+}
+
+static void benchForwardNetwork(BenchData *d) {
+  forwardNetwork(d->n);
+}
+
+static void benchForwardLanes(BenchData *d) {
+  forwardLanes(d->n, INPUT_LAYER_NN(d->n), OUTPUT_LAYER_NN(d->n));
+}
+
+static void benchForwardSparse(BenchData *d) {
+  forwardSparse(d->s, INPUT_LAYER_NN(d->n), OUTPUT_LAYER_NN(d->n));
+}
+
+static void benchComputeCost(BenchData *d) {
+  computeCost(d->n, d->ti, d->to);
+}
+
+static void benchBackProp(BenchData *d) {
+  backProp(d->n, d->g, d->ti, d->to);
+}
+
+static void benchFiniteDiff(BenchData *d) {
+  computeFiniteDiff(d->n, d->g, 1e-1, d->ti, d->to);
+}
+
+static void benchFiniteDiffIncremental(BenchData *d) {
+  computeFiniteDiffIncremental(d->n, d->g, 1e-1, d->ti, d->to);
+}
+
+static void benchFiniteDiffParallel(BenchData *d) {
+  computeFiniteDiffParallel(d->fw, d->n, d->g, 1e-1, d->ti, d->to);
+}
+
+static uint64_t benchNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+  Prints one JSON result object.
+
+  Params:
+  first = 1 for the first result. The others are
+  preceded by a comma.
+*/
+static void benchRun(
+  const char *name,
+  BenchFunc f,
+  BenchData *d,
+  size_t width,
+  size_t depth,
+  size_t samples,
+  size_t repeats,
+  int first
+) {
+  fprintf(stderr, "%s width=%zu depth=%zu samples=%zu\n", name, width, depth, samples);
+
+  for(size_t i = 0; i < BENCH_WARMUP; i++) f(d);
+
+  //Number of calls per sample
+  size_t iters = 1;
+  for(;;) {
+    uint64_t start = benchNow();
+    for(size_t i = 0; i < iters; i++) f(d);
+    if(benchNow() - start >= BENCH_MIN_SAMPLE_NS) break;
+    iters *= 2;
+  }
+
+  //nanoseconds per call of each sample
+  double times[repeats];
+  for(size_t r = 0; r < repeats; r++) {
+    uint64_t start = benchNow();
+    for(size_t i = 0; i < iters; i++) f(d);
+    times[r] = (double)(benchNow() - start) / iters;
+  }
+  qsort(times, repeats, sizeof(*times), compareDouble);
+
+  double mean = 0;
+  for(size_t r = 0; r < repeats; r++) mean += times[r];
+  mean /= repeats;
+
+  //nearest rank
+  size_t p99 = (size_t)(0.99 * repeats + 0.999999);
+  if(p99 < 1) p99 = 1;
+
+  printf(
+    "%s    {\"bench\": \"%s\", \"width\": %zu, \"depth\": %zu, \"samples\": %zu, "
+    "\"iters\": %zu, \"repeats\": %zu, \"median_ns\": %.1f, \"p99_ns\": %.1f, "
+    "\"min_ns\": %.1f, \"mean_ns\": %.1f}",
+    first ? "" : ",\n",
+    name, width, depth, samples, iters, repeats,
+    times[repeats / 2], times[p99 - 1], times[0], mean
+  );
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  randomSeed(100);
+
+  size_t repeats = 31;
+  if(argc > 1) {
+    long r = strtol(argv[1], NULL, 10);
+    if(r > 0) repeats = (size_t)r;
+  }
+
+  size_t widths[] = {4, 16, 64, 256};
+  //number of hidden layers
+  size_t depths[] = {1, 2, 4};
+  size_t sampleCounts[] = {16, 256};
+  //activationDense of each activation. The sigmoid is
+  //fused into the GEMM kernel and the others are applied
+  //to the sums afterwards.
+  const char *denseNames[ACT_COUNT] = {
+    [ACT_SIGMOID] = "denseSigmoid", [ACT_RELU] = "denseRelu",
+    [ACT_TANH] = "denseTanh", [ACT_LEAKY_RELU] = "denseLeakyRelu"
+  };
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  ThreadPool *pool = createThreadPool(cpus > 0 ? (size_t)cpus : 1);
+
+  printf("{\n  \"isa\": \"%s\",\n  \"results\": [\n", simdIsaName(simdIsa()));
+  int first = 1;
+
+  for(size_t w = 0; w < ARRAY_LENGTH(widths); w++) {
+    for(size_t s = 0; s < ARRAY_LENGTH(sampleCounts); s++) {
+      size_t width = widths[w];
+      size_t samples = sampleCounts[s];
+
+      BenchData d;
+      d.a = matrixAlloc(samples, width);
+      d.b = matrixAlloc(width, width);
+      d.c = matrixAlloc(samples, width);
+      d.bias = matrixAlloc(1, width);
+      d.ti = matrixAlloc(samples, width);
+      d.to = matrixAlloc(samples, width);
+      randMatrix(d.a, -1, 1);
+      randMatrix(d.b, -1, 1);
+      randMatrix(d.bias, -1, 1);
+      randMatrix(d.ti, 0, 1);
+      randMatrix(d.to, 0, 1);
+
+      //The matrix benchmarks don't depend on the depth
+      benchRun("matrixDot", benchMatrixDot, &d, width, 0, samples, repeats, first);
+      first = 0;
+      matrixDot(d.c, d.a, d.b);
+      benchRun("applySigmoid", benchApplySigmoid, &d, width, 0, samples, repeats, first);
+      for(int t = 0; t < ACT_COUNT; t++) {
+        d.act = (ActivationType)t;
+        benchRun(denseNames[t], benchActivationDense, &d, width, 0, samples, repeats, first);
+      }
+
+      for(size_t k = 0; k < ARRAY_LENGTH(depths); k++) {
+        size_t depth = depths[k];
+
+        //input, 'depth' hidden layers and output all
+        //have 'width' neurons
+        size_t nModel[depth + 2];
+        for(size_t i = 0; i < depth + 2; i++) nModel[i] = width;
+
+        d.n = createBatchNetwork(nModel, depth + 2, samples);
+        d.g = createNetwork(nModel, depth + 2);
+        randNetwork(d.n, 0, 1);
+        matrixCopy(INPUT_LAYER_NN(d.n), d.ti);
+
+        benchRun("forwardNetwork", benchForwardNetwork, &d, width, depth, samples, repeats, first);
+        benchRun("forwardLanes", benchForwardLanes, &d, width, depth, samples, repeats, first);
+        benchRun("computeCost", benchComputeCost, &d, width, depth, samples, repeats, first);
+        benchRun("backProp", benchBackProp, &d, width, depth, samples, repeats, first);
+        if(d.n.paramCount <= BENCH_FINITE_DIFF_MAX_PARAMS) {
+          benchRun("computeFiniteDiff", benchFiniteDiff, &d, width, depth, samples, repeats, first);
+          benchRun(
+            "computeFiniteDiffIncremental", benchFiniteDiffIncremental,
+            &d, width, depth, samples, repeats, first
+          );
+          d.fw = createFiniteDiffWorkers(pool, d.n);
+          benchRun(
+            "computeFiniteDiffParallel", benchFiniteDiffParallel,
+            &d, width, depth, samples, repeats, first
+          );
+          destroyFiniteDiffWorkers(d.fw);
+        }
+
+        //Last because pruning changes the network
+        destroyPruneMask(pruneNetwork(d.n, pruneThreshold(d.n, BENCH_PRUNE)));
+        d.s = sparseNetwork(d.n);
+        benchRun("forwardSparse", benchForwardSparse, &d, width, depth, samples, repeats, first);
+        destroySparseNetwork(d.s);
+
+        destroyNetwork(d.n);
+        destroyNetwork(d.g);
+      }
+
+      matrixFree(d.a);
+      matrixFree(d.b);
+      matrixFree(d.c);
+      matrixFree(d.bias);
+      matrixFree(d.ti);
+      matrixFree(d.to);
+    }
+  }
+
+  printf("\n  ]\n}\n");
+  destroyThreadPool(pool);
+}
@@ -16,7 +16,29 @@ void computeGradient(
 
 float computeCost(NeuralNetwork n, Matrix tInput, Matrix tOutput);
 
-void computeFiniteDiff(
+/*
+  The functions below that fill a gradient return the cost
+  of the parameters before the gradient is used, the same
+  value as computeCost before the step. They need that
+  forward pass anyway so the cost costs almost nothing.
+*/
+float computeFiniteDiff(
+  NeuralNetwork n, 
+  NeuralNetwork gradient, 
+  float eps, 
+  Matrix ti, 
+  Matrix to
+);
+
+/*
+  Same gradient as computeFiniteDiff but the activations of
+  every sample are computed once and reused. A nudged
+  parameter only changes one neuron, so only that neuron
+  and the layers after it are computed again. The cost
+  change of each sample is added up directly instead of
+  subtracting two full costs.
+*/
+float computeFiniteDiffIncremental(
   NeuralNetwork n, 
   NeuralNetwork gradient, 
   float eps, 
@@ -26,7 +48,78 @@ void computeFiniteDiff(
 
 void trainNetwork(NeuralNetwork n, NeuralNetwork g, float rate);
 
-void backProp(NeuralNetwork n, NeuralNetwork g, Matrix tInput, Matrix tOutput);
+float backProp(NeuralNetwork n, NeuralNetwork g, Matrix tInput, Matrix tOutput);
+//Returns the squared error of the sample, not divided by anything
+float backPropSample(NeuralNetwork n, NeuralNetwork g, size_t s, Matrix outputRow);
+void averageGradient(NeuralNetwork g, size_t r);
+
+//backProp over the training rows listed in 'rows'
+float backPropRows(
+  NeuralNetwork n, 
+  NeuralNetwork g, 
+  Matrix tInput, 
+  Matrix tOutput, 
+  size_t *rows, 
+  size_t count
+);
+
+//Row indices 0 to rows-1 for trainMiniBatch.
+//Free it with NN_FREE.
+size_t *createRowOrder(size_t rows);
+//Fisher-Yates shuffle of the row indices with the seed
+//of randomSeed and a new stream
+void shuffleRows(size_t *order, size_t count);
+
+/*
+  One epoch of mini-batch gradient descent. The weights are
+  updated after every 'batchSize' rows instead of once per
+  pass over the training data.
+
+  Params:
+  order = row indices made by createRowOrder. They are
+  shuffled at the start of the epoch. If NULL, the rows
+  are used in order and every batch is a view of 'ti'
+  and 'to', so nothing is copied.
+
+  Returns the average cost of the rows, each one taken
+  before the update of its batch.
+*/
+float trainMiniBatch(
+  NeuralNetwork n, 
+  NeuralNetwork g, 
+  Matrix ti, 
+  Matrix to, 
+  size_t batchSize, 
+  float rate, 
+  size_t *order
+);
+
+//backProp then trainNetwork. Returns the cost before the update.
+float trainStep(NeuralNetwork n, NeuralNetwork g, Matrix ti, Matrix to, float rate);
+
+//Called by trainSteps with a step number and the cost
+//before that step
+typedef void (*TrainReport)(void *ctx, size_t step, float cost);
+
+/*
+  'steps' calls of trainStep. report(ctx, step, cost) is
+  called every 'reportEvery' steps and after the last step
+  with the cost that backProp gives back, so the cost is
+  never computed just to report it. If 'report' is NULL or
+  'reportEvery' is 0 it's never called. Returns the cost
+  before the last step.
+*/
+float trainSteps(
+  NeuralNetwork n, 
+  NeuralNetwork g, 
+  Matrix ti, 
+  Matrix to, 
+  float rate, 
+  size_t steps, 
+  size_t reportEvery,
+  TrainReport report,
+  void *ctx
+);
 
 #endif
 
@@ -72,7 +165,7 @@ void computeGradient(
   float costVal,
   size_t index
 ) {
-  float saved;
+  nnfloat saved;
 
   for(size_t i = 0; i < m[index].rows; i++) {
     for(size_t j = 0; j < m[index].cols; j++) {
@@ -93,25 +186,35 @@ void computeGradient(
 }
 
 float computeCost(NeuralNetwork n, Matrix tInput, Matrix tOutput) {
+  PROFILE_FUNC(PROFILE_COMPUTE_COST);
   ASSERT_NN(tInput.rows == tOutput.rows);
   ASSERT_NN(tOutput.cols == OUTPUT_LAYER_NN(n).cols);
 
   size_t r = tInput.rows;
+  size_t c = tOutput.cols;
+  size_t batch = BATCH_NN(n);
   
-  float costVal = 0;
-  for(size_t i = 0; i < r; i++) {
-    Matrix inputRow = getMatrixRow(tInput, i);
-    Matrix outputRow = getMatrixRow(tOutput, i);
-
-    matrixCopy(INPUT_LAYER_NN(n), inputRow);
-    forwardNetwork(n);
-
-    size_t c = tOutput.cols;
-    for(size_t j = 0; j < c; j++) {
-      float diff = 
-        OUTPUT_LAYER_NN(n).start[getCell(OUTPUT_LAYER_NN(n), 0, j)] - 
-        outputRow.start[getCell(outputRow, 0, j)];
-      costVal += diff*diff;
+  nnacc costVal = 0;
+  //Copy up to 'batch' training rows to the input layer
+  //and activate them at once. The last chunk can be
+  //smaller than the batch.
+  for(size_t i = 0; i < r; i += batch) {
+    size_t rows = r - i < batch ? r - i : batch;
+    Matrix outputRows = getMatrixRows(tOutput, i, rows);
+
+    matrixCopy(
+      getMatrixRows(INPUT_LAYER_NN(n), 0, rows), 
+      getMatrixRows(tInput, i, rows)
+    );
+    forwardBatch(n, rows);
+
+    for(size_t k = 0; k < rows; k++) {
+      for(size_t j = 0; j < c; j++) {
+        nnacc diff = 
+          OUTPUT_LAYER_NN(n).start[getCell(OUTPUT_LAYER_NN(n), k, j)] - 
+          outputRows.start[getCell(outputRows, k, j)];
+        costVal += diff*diff;
+      }
     }
   }
 
@@ -122,7 +225,7 @@ float computeCost(NeuralNetwork n, Matrix tInput, Matrix tOutput) {
   An alternative to back propagation. Easy to implement
   but it's inaccurate when dealing with larger models
 */
-void computeFiniteDiff(
+float computeFiniteDiff(
   NeuralNetwork n, 
   NeuralNetwork gradient, 
   float eps, 
@@ -136,90 +239,309 @@ void computeFiniteDiff(
     computeGradient(n, n.weights, gradient.weights, ti, to, eps, costVal, i);
     computeGradient(n, n.biases, gradient.biases, ti, to, eps, costVal, i);
   }
+
+  return costVal;
+}
+
+/*
+  Activations of every training sample that
+  computeFiniteDiffIncremental reuses. z[l] and acts.layers[l]
+  have one row per sample. z[l] is the value of layer l
+  before the activation, acts.layers[l] is after it.
+*/
+typedef struct {
+  NeuralNetwork acts;
+  Matrix *z;
+  //cost of each sample
+  nnacc *costs;
+  //two blocks with one row per sample that hold the
+  //layers after the nudged neuron
+  nnfloat *bufA;
+  nnfloat *bufB;
+} FiniteDiffCache;
+
+/*
+  Sum of the cost change of all samples when the value of
+  neuron j of layer l, before the activation, goes up by
+  eps*input[s][k]. If 'input' is NULL it goes up by eps
+  (a nudged bias).
+*/
+static float incrementalCostChange(
+  NeuralNetwork n,
+  FiniteDiffCache *cache,
+  Matrix to,
+  size_t l,
+  size_t j,
+  Matrix *input,
+  size_t k,
+  float eps
+) {
+  Matrix *a = cache->acts.layers;
+  size_t r = to.rows;
+  nnacc change = 0;
+  const Activation *act = getActivation(n.activations[l-1]);
+
+  if(l == n.count) {
+    //Output neuron. Only its own column of the cost changes.
+    for(size_t s = 0; s < r; s++) {
+      nnacc dz = input == NULL ? eps : eps*input->start[getCell(*input, s, k)];
+      nnacc aj = act->one(
+        cache->z[l].start[getCell(cache->z[l], s, j)] + dz, n.sigmoidMode
+      );
+      nnacc old = a[l].start[getCell(a[l], s, j)];
+      nnacc y = to.start[getCell(to, s, j)];
+      change += (aj - y)*(aj - y) - (old - y)*(old - y);
+    }
+    return change;
+  }
+
+  //Only row j of the next weights sees the change so the
+  //next layer is moved by delta*w instead of a new dot product.
+  Matrix cur = {r, n.layers[l+1].cols, n.layers[l+1].cols, cache->bufA};
+  const Activation *nextAct = getActivation(n.activations[l]);
+  for(size_t s = 0; s < r; s++) {
+    nnacc dz = input == NULL ? eps : eps*input->start[getCell(*input, s, k)];
+    nnacc aj = act->one(
+      cache->z[l].start[getCell(cache->z[l], s, j)] + dz, n.sigmoidMode
+    );
+    nnacc delta = aj - a[l].start[getCell(a[l], s, j)];
+
+    for(size_t c = 0; c < cur.cols; c++) {
+      cur.start[getCell(cur, s, c)] = nextAct->one(
+        cache->z[l+1].start[getCell(cache->z[l+1], s, c)] +
+        delta*n.weights[l].start[getCell(n.weights[l], j, c)],
+        n.sigmoidMode
+      );
+    }
+  }
+
+  //Every neuron after that layer changes so the rest of the
+  //layers are activated normally, all samples at once
+  for(size_t m = l + 1; m < n.count; m++) {
+    nnfloat *next = cur.start == cache->bufA ? cache->bufB : cache->bufA;
+    Matrix dst = {r, n.layers[m+1].cols, n.layers[m+1].cols, next};
+    activationDense(dst, cur, n.weights[m], n.biases[m], n.activations[m], n.sigmoidMode);
+    cur = dst;
+  }
+
+  for(size_t s = 0; s < r; s++) {
+    nnacc cost = 0;
+    for(size_t c = 0; c < cur.cols; c++) {
+      nnacc diff = cur.start[getCell(cur, s, c)] - to.start[getCell(to, s, c)];
+      cost += diff*diff;
+    }
+    change += cost - cache->costs[s];
+  }
+
+  return change;
+}
+
+float computeFiniteDiffIncremental(
+  NeuralNetwork n, 
+  NeuralNetwork gradient, 
+  float eps, 
+  Matrix ti, 
+  Matrix to
+) {
+  ASSERT_NN(ti.rows == to.rows);
+  ASSERT_NN(to.cols == OUTPUT_LAYER_NN(n).cols);
+
+  size_t r = ti.rows;
+  size_t width = 0;
+  for(size_t l = 0; l <= n.count; l++) {
+    if(n.layers[l].cols > width) width = n.layers[l].cols;
+  }
+
+  FiniteDiffCache cache;
+  cache.acts = createSharedNetwork(n, r);
+  cache.z = NN_MALLOC(sizeof(*cache.z) * (n.count + 1));
+  ASSERT_NN(cache.z != NULL);
+  cache.costs = NN_MALLOC(sizeof(*cache.costs) * r);
+  ASSERT_NN(cache.costs != NULL);
+  cache.bufA = NN_MALLOC(sizeof(nnfloat) * r * width * 2);
+  ASSERT_NN(cache.bufA != NULL);
+  cache.bufB = cache.bufA + r * width;
+
+  //Activate every sample once and keep the values
+  //before and after the activation
+  Matrix *a = cache.acts.layers;
+  matrixCopy(a[0], ti);
+  for(size_t l = 1; l <= n.count; l++) {
+    cache.z[l] = matrixAlloc(r, n.layers[l].cols);
+    matrixDot(cache.z[l], a[l-1], n.weights[l-1]);
+    matrixSumRow(cache.z[l], n.biases[l-1]);
+    matrixCopy(a[l], cache.z[l]);
+    applyActivation(a[l], n.activations[l-1], n.sigmoidMode);
+  }
+
+  nnacc costVal = 0;
+  for(size_t s = 0; s < r; s++) {
+    cache.costs[s] = 0;
+    for(size_t c = 0; c < to.cols; c++) {
+      nnacc diff = 
+        a[n.count].start[getCell(a[n.count], s, c)] - 
+        to.start[getCell(to, s, c)];
+      cache.costs[s] += diff*diff;
+    }
+    costVal += cache.costs[s];
+  }
+
+  //weights[i] and biases[i] feed layer i+1. Weight (k, j)
+  //connects neuron k of layer i to neuron j of layer i+1.
+  for(size_t i = 0; i < n.count; i++) {
+    Matrix w = gradient.weights[i];
+    for(size_t k = 0; k < w.rows; k++) {
+      for(size_t j = 0; j < w.cols; j++) {
+        w.start[getCell(w, k, j)] = 
+          incrementalCostChange(n, &cache, to, i+1, j, &a[i], k, eps)/r/eps;
+      }
+    }
+
+    Matrix b = gradient.biases[i];
+    for(size_t j = 0; j < b.cols; j++) {
+      b.start[getCell(b, 0, j)] = 
+        incrementalCostChange(n, &cache, to, i+1, j, NULL, 0, eps)/r/eps;
+    }
+  }
+
+  for(size_t l = 1; l <= n.count; l++) {
+    matrixFree(cache.z[l]);
+  }
+  NN_FREE(cache.z);
+  NN_FREE(cache.costs);
+  NN_FREE(cache.bufA);
+  destroyNetwork(cache.acts);
+
+  return costVal/r;
 }
 
 void trainNetwork(NeuralNetwork n, NeuralNetwork g, float rate) {
+  PROFILE_FUNC(PROFILE_TRAIN_NETWORK);
   for(size_t i = 0; i < n.count; i++) {
     computeLearnRate(n.weights, g.weights, rate, i);
     computeLearnRate(n.biases, g.biases, rate, i);
   }
 }
 
+/*
+  Accumulates the gradient of one sample into 'g'. The sample
+  must already be activated in row 's' of the layers of 'n'
+  and 'outputRow' is its expected output.
+*/
+float backPropSample(NeuralNetwork n, NeuralNetwork g, size_t s, Matrix outputRow) {
+  size_t c = outputRow.cols;
+  nnacc costVal = 0;
+
+  //reset layers value to 0.
+  for(int j = 0; j < n.count; j++) {
+    fillMatrix(g.layers[j], 0);
+  }
+
+  //Loop through training output columns
+  for(size_t j = 0; j < c; j++) {
+    //Store the difference between actual output and expected output
+    //in output layer of gradient neural network. This network is 
+    //a copy of original network. In the current state of this
+    //library as the time of writing, output layer is linear and
+    //only having one row.
+    nnacc diff = 
+      OUTPUT_LAYER_NN(n).start[getCell(OUTPUT_LAYER_NN(n), s, j)] -
+      outputRow.start[getCell(outputRow, 0, j)];
+    OUTPUT_LAYER_NN(g).start[getCell(OUTPUT_LAYER_NN(g), 0, j)] = diff;
+    //Same sum as computeCost
+    costVal += diff*diff;
+  }
+
+  //biases of this neural network structure only have 1 row.
+  //Only row 's' of the layers of 'n' and row 0 of the
+  //layers of 'g' are used.
+  //Loop through layers backwards. Thus, starting from the output
+  //layer.
+  for(size_t l = n.count; l > 0; l--) {
+    size_t cols = n.layers[l].cols;
+    //activation function value in the neurons of the current
+    //layer
+    nnacc a[cols];
+    //2*∂ai^(l)C^(l+1)*f'(z), the part that every derivative
+    //of this neuron shares. ∂ai^(l)C^(l+1) is the partial
+    //derivative of cost function of next neuron with respect
+    //to the current activation. If loop is in output layer,
+    //that value is the difference that we computed above
+    //when we traverse the output layer. f'(z) is found from
+    //the activation by the kernel of the layer, all neurons
+    //at once.
+    nnacc delta[cols];
+    for(size_t j = 0; j < cols; j++) {
+      a[j] = n.layers[l].start[getCell(n.layers[l], s, j)];
+      delta[j] = 2*g.layers[l].start[getCell(g.layers[l], 0, j)];
+    }
+    getActivation(n.activations[l-1])->derivative(a, delta, cols);
+
+    //Loop through each column of the layer and compute
+    //the bias derivative of each neuron in the layer
+    for(size_t j = 0; j < cols; j++) {
+      //add derivative of the current cost function with respect
+      //to current bias: ∂b(l)C^(1) = 2*∂ai^(l)C^(l+1)*f'(z).
+      //Put the result in the previous neuron in the previous layer in
+      //gradient matrix.
+      g.biases[l-1].start[getCell(g.biases[l-1], 0, j)] += delta[j];
+
+      //loop through the neurons of previous layer of 'n' network
+      for(size_t k = 0; k < n.layers[l-1].cols; k++) {
+        //previous activation
+        nnacc pa = n.layers[l-1].start[getCell(n.layers[l-1], s, k)];
+        //previous weight
+        nnacc w = n.weights[l-1].start[getCell(n.weights[l-1], k, j)];
+        //add derivative of the current cost function with respect
+        //to current weight: ∂wi^(l)C^(l) = 2*∂ai^(l)C^(l+1)*f'(z)*a^(l-1)
+        g.weights[l-1].start[getCell(g.weights[l-1], k, j)] += delta[j]*pa;
+        //add derivative of the current cost function with respect to
+        //previous activation function ∂ai^(l-1)C^(l) = 
+        //2*∂ai^(l)C^(l+1)*f'(z)*w^(l)
+        g.layers[l-1].start[getCell(g.layers[l-1], 0, k)] += delta[j]*w;
+      }
+    }
+  }
+
+  return costVal;
+}
+
 //Back Propagation
-void backProp(NeuralNetwork n, NeuralNetwork g, Matrix tInput, Matrix tOutput) {
+float backProp(NeuralNetwork n, NeuralNetwork g, Matrix tInput, Matrix tOutput) {
+  PROFILE_FUNC(PROFILE_BACK_PROP);
   ASSERT_NN(tInput.rows == tOutput.rows);
   ASSERT_NN(OUTPUT_LAYER_NN(n).cols == tOutput.cols);
   size_t r = tInput.rows;
-  size_t c = tOutput.cols;
+  size_t batch = BATCH_NN(n);
+  nnacc costVal = 0;
 
   resetNetwork(g);
 
-  //loop through the row of samples
-  for(size_t i = 0; i < r; i++) {
-    //Copy a training input row to first layer.
-    matrixCopy(INPUT_LAYER_NN(n), getMatrixRow(tInput, i));
-    //Activate neural network
-    forwardNetwork(n);
-
-    //reset layers value to 0.
-    for(int j = 0; j < n.count; j++) {
-      fillMatrix(g.layers[j], 0);
-    }
-
-    //Loop through training output columns
-    for(size_t j = 0; j < c; j++) {
-      //Store the difference between actual output and expected output
-      //in output layer of gradient neural network. This network is 
-      //a copy of original network. In the current state of this
-      //library as the time of writing, output layer is linear and
-      //only having one row.
-      OUTPUT_LAYER_NN(g).start[getCell(OUTPUT_LAYER_NN(g), 0, j)] = 
-        OUTPUT_LAYER_NN(n).start[getCell(OUTPUT_LAYER_NN(n), 0, j)] -
-        tOutput.start[getCell(tOutput, i, j)];
-    }
-    
-  
-    //layers and biases of this neural network structure 
-    //only have 1 row.
-    //Loop through layers backwards. Thus, starting from the output
-    //layer.
-    for(size_t l = n.count; l > 0; l--) {
-      //Loop through each column of the layer and compute
-      //the bias derivative of each neuron in the layer
-      for(size_t j = 0; j < n.layers[l].cols; j++) {
-        //activation function value in the neuron of the current
-        //layer
-        float a = n.layers[l].start[getCell(n.layers[l], 0, j)];
-        //partial derivative of cost function of next neuron
-        //with respect to the current activation: ∂ai^(l)C^(l+1).
-        //If loop is in output layer, that value of this variable
-        //is the difference that we computed above when we traverse
-        //the output layer;
-        float da = g.layers[l].start[getCell(g.layers[l], 0, j)];
-        //add derivative of the current cost function with respect
-        //to current bias: ∂b(l)C^(1) = 2*∂ai^(l)C^(l+1)*(1-a).
-        //Put the result in the previous neuron in the previous layer in
-        //gradient matrix.
-        g.biases[l-1].start[getCell(g.biases[l-1], 0, j)] += 2*da*a*(1-a);
-
-        //loop through the neurons of previous layer of 'n' network
-        for(size_t k = 0; k < n.layers[l-1].cols; k++) {
-          //previous activation
-          float pa = n.layers[l-1].start[getCell(n.layers[l-1], 0, k)];
-          //previous weight
-          float w = n.weights[l-1].start[getCell(n.weights[l-1], k, j)];
-          //add derivative of the current cost function with respect
-          //to current weight: ∂wi^(l)C^(l) = 2*∂ai^(l)C^(l+1)*(1-a)*a^(l-1)
-          g.weights[l-1].start[getCell(g.weights[l-1], k, j)] += 2*da*a*(1-a)*pa;
-          //add derivative of the current cost function with respect to
-          //previous activation function ∂ai^(l-1)C^(l) = 
-          //2*∂ai^(l)C^(l+1)*(1-a)*a^(l-1)*w^(l)
-          g.layers[l-1].start[getCell(g.layers[l-1], 0, k)] += 2*da*a*(1-a)*w;
-        }
-      }
+  //Activate up to 'batch' samples at once. Each row of
+  //the layers of 'n' holds the activations of one sample
+  for(size_t i = 0; i < r; i += batch) {
+    size_t rows = r - i < batch ? r - i : batch;
+    matrixCopy(
+      getMatrixRows(INPUT_LAYER_NN(n), 0, rows), 
+      getMatrixRows(tInput, i, rows)
+    );
+    forwardBatch(n, rows);
+
+    //loop through the row of samples
+    for(size_t s = 0; s < rows; s++) {
+      costVal += backPropSample(n, g, s, getMatrixRow(tOutput, i + s));
     }
   }
 
+  averageGradient(g, r);
+  return costVal/r;
+}
+
+/*
+  Divides every weight and bias of 'g' by 'r', the number
+  of training rows that were added to it.
+*/
+void averageGradient(NeuralNetwork g, size_t r) {
   //Loop through the model
   for(size_t i = 0; i < g.count; i++) {
     //Loop through all weights
@@ -242,4 +564,123 @@ void backProp(NeuralNetwork n, NeuralNetwork g, Matrix tInput, Matrix tOutput) {
   }
 }
 
-#endif
\ No newline at end of file
+float backPropRows(
+  NeuralNetwork n, 
+  NeuralNetwork g, 
+  Matrix tInput, 
+  Matrix tOutput, 
+  size_t *rows, 
+  size_t count
+) {
+  PROFILE_FUNC(PROFILE_BACK_PROP);
+  ASSERT_NN(tInput.rows == tOutput.rows);
+  ASSERT_NN(OUTPUT_LAYER_NN(n).cols == tOutput.cols);
+  size_t batch = BATCH_NN(n);
+  nnacc costVal = 0;
+
+  resetNetwork(g);
+
+  for(size_t i = 0; i < count; i += batch) {
+    size_t len = count - i < batch ? count - i : batch;
+
+    //The rows aren't next to each other in 'tInput' so
+    //they're copied one by one to the input layer
+    for(size_t s = 0; s < len; s++) {
+      matrixCopy(
+        getMatrixRow(INPUT_LAYER_NN(n), s), 
+        getMatrixRow(tInput, rows[i + s])
+      );
+    }
+    forwardBatch(n, len);
+
+    for(size_t s = 0; s < len; s++) {
+      costVal += backPropSample(n, g, s, getMatrixRow(tOutput, rows[i + s]));
+    }
+  }
+
+  averageGradient(g, count);
+  return costVal/count;
+}
+
+size_t *createRowOrder(size_t rows) {
+  size_t *order = NN_MALLOC(sizeof(*order) * rows);
+  ASSERT_NN(order != NULL);
+
+  for(size_t i = 0; i < rows; i++) {
+    order[i] = i;
+  }
+  return order;
+}
+
+void shuffleRows(size_t *order, size_t count) {
+  uint64_t seed = randomCurrentSeed();
+  uint64_t stream = randomNextStream();
+  for(size_t i = count; i > 1; i--) {
+    //random index from 0 to i-1
+    size_t j = (size_t)randomBelow(seed, stream, i, i);
+
+    size_t tmp = order[i-1];
+    order[i-1] = order[j];
+    order[j] = tmp;
+  }
+}
+
+float trainMiniBatch(
+  NeuralNetwork n, 
+  NeuralNetwork g, 
+  Matrix ti, 
+  Matrix to, 
+  size_t batchSize, 
+  float rate, 
+  size_t *order
+) {
+  ASSERT_NN(batchSize > 0);
+  size_t r = ti.rows;
+  nnacc costVal = 0;
+
+  if(order != NULL) shuffleRows(order, r);
+
+  for(size_t i = 0; i < r; i += batchSize) {
+    size_t len = r - i < batchSize ? r - i : batchSize;
+
+    //The cost of a batch is its average so it's weighted
+    //by the rows of the batch
+    if(order != NULL) {
+      costVal += backPropRows(n, g, ti, to, &order[i], len) * len;
+    } else {
+      costVal += backProp(n, g, getMatrixRows(ti, i, len), getMatrixRows(to, i, len)) * len;
+    }
+    trainNetwork(n, g, rate);
+  }
+
+  return costVal/r;
+}
+
+float trainStep(NeuralNetwork n, NeuralNetwork g, Matrix ti, Matrix to, float rate) {
+  float costVal = backProp(n, g, ti, to);
+  trainNetwork(n, g, rate);
+  return costVal;
+}
+
+float trainSteps(
+  NeuralNetwork n, 
+  NeuralNetwork g, 
+  Matrix ti, 
+  Matrix to, 
+  float rate, 
+  size_t steps, 
+  size_t reportEvery,
+  TrainReport report,
+  void *ctx
+) {
+  float costVal = 0;
+  for(size_t i = 0; i < steps; i++) {
+    costVal = trainStep(n, g, ti, to, rate);
+    if(report != NULL && reportEvery > 0 && (i % reportEvery == 0 || i + 1 == steps)) {
+      report(ctx, i, costVal);
+    }
+  }
+  return costVal;
+}
+
+#endif
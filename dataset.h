@@ -0,0 +1,302 @@
+#include <stdint.h>
+
+#ifndef DATASET_H
+#define DATASET_H
+
+/*
+  Training data that is made when it's needed instead of
+  being stored. Row 'row' of the data is always the same,
+  so any range of rows can be made again in any order.
+  A 16 bit adder has 2^32 rows which doesn't fit in memory
+  but a batch of them does.
+*/
+typedef struct DataSource DataSource;
+
+//Writes the input and the expected output of one row
+typedef void (*DataFill)(const DataSource *src, uint64_t row, nnfloat *input, nnfloat *output);
+
+struct DataSource {
+  uint64_t rows;
+  size_t inputCols;
+  size_t outputCols;
+  DataFill fill;
+  //bits of each number of the adder source
+  size_t bits;
+  //data of other sources
+  void *ctx;
+};
+
+//Rows of a source that are made at once
+typedef struct {
+  Matrix input;
+  Matrix output;
+} DataBatch;
+
+/*
+  Every pair of 'bits' bit numbers. Row x << bits | y has the
+  bits of x then the bits of y as input. The output is the
+  bits of x + y and the carry in the last column. Same rows
+  as the training data of adder2.c.
+*/
+DataSource createAdderSource(size_t bits);
+
+//Fills input.rows rows starting at row 'first'
+void dataFillRows(DataSource src, uint64_t first, Matrix input, Matrix output);
+//Fills input.rows random rows. A row can be picked more
+//than once.
+void dataFillRandom(DataSource src, Matrix input, Matrix output);
+
+DataBatch createDataBatch(DataSource src, size_t rows);
+void destroyDataBatch(DataBatch b);
+
+/*
+  These work like computeCost, backProp and the verification
+  loop of adder2.c over rows [first, first + count) of 'src'.
+  The rows are made 'b' rows at a time, so the memory used
+  doesn't depend on 'count'. backPropSource returns the cost
+  of the rows like backProp.
+*/
+float computeCostSource(
+  NeuralNetwork n,
+  DataSource src,
+  DataBatch b,
+  uint64_t first,
+  uint64_t count
+);
+float backPropSource(
+  NeuralNetwork n,
+  NeuralNetwork g,
+  DataSource src,
+  DataBatch b,
+  uint64_t first,
+  uint64_t count
+);
+//Number of rows with at least one output on the wrong
+//side of 0.5
+uint64_t verifySource(
+  NeuralNetwork n,
+  DataSource src,
+  DataBatch b,
+  uint64_t first,
+  uint64_t count
+);
+
+//One step of gradient descent over b.input.rows random rows.
+//Returns the cost of those rows before the step.
+float trainSourceRandom(
+  NeuralNetwork n,
+  NeuralNetwork g,
+  DataSource src,
+  DataBatch b,
+  float rate
+);
+
+#endif
+
+#ifdef DATASET_IMPL
+
+static void adderFill(const DataSource *src, uint64_t row, nnfloat *input, nnfloat *output) {
+  size_t bits = src->bits;
+  //The high bits of the row are the first number and
+  //the low bits are the second number
+  uint64_t x = row >> bits;
+  uint64_t y = row & (((uint64_t)1 << bits) - 1);
+  uint64_t z = x + y;
+
+  for(size_t j = 0; j < bits; j++) {
+    //Bits are stored from the rightmost bit to the left.
+    //The order doesn't matter for the network as long as
+    //every row uses the same order.
+    //Example: x = 1 0 1 -> (x>>0)&1 = 1, (x>>1)&1 = 0
+    input[j] = (x>>j)&1;
+    //y goes to the second half of the input
+    input[j + bits] = (y>>j)&1;
+    output[j] = (z>>j)&1;
+  }
+  //The carry is the bit after the last bit of the sum.
+  //It's 1 if the sum overflows 'bits' bits.
+  output[bits] = (z>>bits)&1;
+}
+
+DataSource createAdderSource(size_t bits) {
+  //x and y together are one row index
+  ASSERT_NN(bits > 0 && bits < 32);
+
+  return (DataSource){
+    .rows = (uint64_t)1 << (2*bits),
+    .inputCols = 2*bits,
+    .outputCols = bits + 1,
+    .fill = adderFill,
+    .bits = bits,
+    .ctx = NULL
+  };
+}
+
+void dataFillRows(DataSource src, uint64_t first, Matrix input, Matrix output) {
+  ASSERT_NN(input.rows == output.rows);
+  ASSERT_NN(input.cols == src.inputCols);
+  ASSERT_NN(output.cols == src.outputCols);
+  ASSERT_NN(first + input.rows <= src.rows);
+
+  for(size_t i = 0; i < input.rows; i++) {
+    src.fill(
+      &src, first + i,
+      &input.start[getCell(input, i, 0)],
+      &output.start[getCell(output, i, 0)]
+    );
+  }
+}
+
+void dataFillRandom(DataSource src, Matrix input, Matrix output) {
+  ASSERT_NN(input.rows == output.rows);
+  ASSERT_NN(input.cols == src.inputCols);
+  ASSERT_NN(output.cols == src.outputCols);
+
+  //Row i of the batch is number i of a new stream
+  uint64_t seed = randomCurrentSeed();
+  uint64_t stream = randomNextStream();
+  for(size_t i = 0; i < input.rows; i++) {
+    src.fill(
+      &src, randomBelow(seed, stream, i, src.rows),
+      &input.start[getCell(input, i, 0)],
+      &output.start[getCell(output, i, 0)]
+    );
+  }
+}
+
+DataBatch createDataBatch(DataSource src, size_t rows) {
+  return (DataBatch){
+    .input = matrixAlloc(rows, src.inputCols),
+    .output = matrixAlloc(rows, src.outputCols)
+  };
+}
+
+void destroyDataBatch(DataBatch b) {
+  matrixFree(b.input);
+  matrixFree(b.output);
+}
+
+float computeCostSource(
+  NeuralNetwork n,
+  DataSource src,
+  DataBatch b,
+  uint64_t first,
+  uint64_t count
+) {
+  ASSERT_NN(count > 0);
+
+  //computeCost is the average of its rows so every
+  //chunk is weighted by its size. Double because the
+  //sum of billions of rows loses too much in a float.
+  double costVal = 0;
+  for(uint64_t i = 0; i < count; i += b.input.rows) {
+    size_t len = count - i < b.input.rows ? count - i : b.input.rows;
+    Matrix ti = getMatrixRows(b.input, 0, len);
+    Matrix to = getMatrixRows(b.output, 0, len);
+
+    dataFillRows(src, first + i, ti, to);
+    costVal += (double)computeCost(n, ti, to) * len;
+  }
+
+  return costVal/count;
+}
+
+float backPropSource(
+  NeuralNetwork n,
+  NeuralNetwork g,
+  DataSource src,
+  DataBatch b,
+  uint64_t first,
+  uint64_t count
+) {
+  ASSERT_NN(count > 0);
+  ASSERT_NN(OUTPUT_LAYER_NN(n).cols == src.outputCols);
+  size_t batch = BATCH_NN(n);
+  //Double for the same reason as computeCostSource
+  double costVal = 0;
+
+  resetNetwork(g);
+
+  //Same as backPropRows but the rows come from the source
+  for(uint64_t i = 0; i < count; i += b.input.rows) {
+    size_t len = count - i < b.input.rows ? count - i : b.input.rows;
+    dataFillRows(
+      src, first + i,
+      getMatrixRows(b.input, 0, len),
+      getMatrixRows(b.output, 0, len)
+    );
+
+    for(size_t k = 0; k < len; k += batch) {
+      size_t rows = len - k < batch ? len - k : batch;
+      matrixCopy(
+        getMatrixRows(INPUT_LAYER_NN(n), 0, rows),
+        getMatrixRows(b.input, k, rows)
+      );
+      forwardBatch(n, rows);
+
+      for(size_t s = 0; s < rows; s++) {
+        costVal += backPropSample(n, g, s, getMatrixRow(b.output, k + s));
+      }
+    }
+  }
+
+  averageGradient(g, count);
+  return costVal/count;
+}
+
+uint64_t verifySource(
+  NeuralNetwork n,
+  DataSource src,
+  DataBatch b,
+  uint64_t first,
+  uint64_t count
+) {
+  ASSERT_NN(OUTPUT_LAYER_NN(n).cols == src.outputCols);
+  size_t batch = BATCH_NN(n);
+  Matrix output = OUTPUT_LAYER_NN(n);
+
+  uint64_t fails = 0;
+  for(uint64_t i = 0; i < count; i += b.input.rows) {
+    size_t len = count - i < b.input.rows ? count - i : b.input.rows;
+    dataFillRows(
+      src, first + i,
+      getMatrixRows(b.input, 0, len),
+      getMatrixRows(b.output, 0, len)
+    );
+
+    for(size_t k = 0; k < len; k += batch) {
+      size_t rows = len - k < batch ? len - k : batch;
+      matrixCopy(
+        getMatrixRows(INPUT_LAYER_NN(n), 0, rows),
+        getMatrixRows(b.input, k, rows)
+      );
+      forwardBatch(n, rows);
+
+      for(size_t s = 0; s < rows; s++) {
+        for(size_t j = 0; j < output.cols; j++) {
+          int bit = output.start[getCell(output, s, j)] > 0.5f;
+          int expected = b.output.start[getCell(b.output, k + s, j)] > 0.5f;
+          if(bit != expected) {
+            fails++;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  return fails;
+}
+
+float trainSourceRandom(
+  NeuralNetwork n,
+  NeuralNetwork g,
+  DataSource src,
+  DataBatch b,
+  float rate
+) {
+  dataFillRandom(src, b.input, b.output);
+  return trainStep(n, g, b.input, b.output, rate);
+}
+
+#endif
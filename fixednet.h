@@ -0,0 +1,225 @@
+#ifndef FIXED_NET_H
+#define FIXED_NET_H
+
+/*
+  Networks with one hidden layer whose sizes are known at
+  compile time, like {2, 2, 1} in gates.c. Every loop has a
+  constant bound so the compiler unrolls it, and the weights
+  are fixed size arrays instead of Matrix structs with a
+  runtime stride.
+
+  DEFINE_FIXED_NETWORK(GateNet, 2, 2, 1) defines the type
+  GateNet and these functions:
+
+  void GateNetLoad(GateNet *f, NeuralNetwork n)
+    copy the parameters, the sigmoid mode and the
+    activations of 'n'
+  void GateNetStore(const GateNet *f, NeuralNetwork n)
+    copy the parameters back to 'n'
+  void GateNetForward(const GateNet *f, size_t rows,
+    const nnacc in[][2], nnacc hidden[][2], nnacc out[][1])
+    activate 'rows' samples
+  void GateNetForwardRows(const GateNet *f, Matrix ti, size_t first, size_t rows,
+    nnacc in[][2], nnacc hidden[][2], nnacc out[][1])
+    same but the samples are rows of 'ti'. 'rows' <= FIXED_BLOCK.
+  float GateNetCost(const GateNet *f, Matrix ti, Matrix to)
+    same as computeCost
+  float GateNetBackProp(const GateNet *f, GateNet *g, Matrix ti, Matrix to)
+    same as backProp. 'g' gets the gradient and the cost
+    before the step is returned.
+  void GateNetTrain(GateNet *f, const GateNet *g, float rate)
+    same as trainNetwork
+
+  'n' must have the same model as the fixed network.
+*/
+
+//Asks gcc to unroll the loop that follows completely
+#define FIXED_UNROLL _Pragma("GCC unroll 64")
+//Samples activated at once by Cost and BackProp
+#define FIXED_BLOCK 16
+
+#define DEFINE_FIXED_NETWORK(name, IN, HIDDEN, OUT) \
+  typedef struct { \
+    nnfloat w0[IN][HIDDEN] __attribute__((aligned(NN_ALIGN))); \
+    nnfloat b0[HIDDEN]; \
+    nnfloat w1[HIDDEN][OUT]; \
+    nnfloat b1[OUT]; \
+    SigmoidMode sigmoidMode; \
+    ActivationType hiddenAct; \
+    ActivationType outAct; \
+  } name; \
+  \
+  static inline void name##Load(name *f, NeuralNetwork n) { \
+    ASSERT_NN(n.count == 2); \
+    ASSERT_NN(n.layers[0].cols == IN); \
+    ASSERT_NN(n.layers[1].cols == HIDDEN); \
+    ASSERT_NN(n.layers[2].cols == OUT); \
+    /* Same order as NeuralNetwork.params */ \
+    memcpy(f->w0, n.weights[0].start, sizeof(f->w0)); \
+    memcpy(f->b0, n.biases[0].start, sizeof(f->b0)); \
+    memcpy(f->w1, n.weights[1].start, sizeof(f->w1)); \
+    memcpy(f->b1, n.biases[1].start, sizeof(f->b1)); \
+    f->sigmoidMode = n.sigmoidMode; \
+    f->hiddenAct = n.activations[0]; \
+    f->outAct = n.activations[1]; \
+  } \
+  \
+  static inline void name##Store(const name *f, NeuralNetwork n) { \
+    ASSERT_NN(n.paramCount == IN*HIDDEN + HIDDEN + HIDDEN*OUT + OUT); \
+    memcpy(n.weights[0].start, f->w0, sizeof(f->w0)); \
+    memcpy(n.biases[0].start, f->b0, sizeof(f->b0)); \
+    memcpy(n.weights[1].start, f->w1, sizeof(f->w1)); \
+    memcpy(n.biases[1].start, f->b1, sizeof(f->b1)); \
+  } \
+  \
+  /* Activates 'rows' samples. The activation runs once */ \
+  /* over every row of a layer so it stays vectorized. */ \
+  static inline void name##Forward( \
+    const name *f, size_t rows, \
+    const nnacc in[][IN], nnacc hidden[][HIDDEN], nnacc out[][OUT] \
+  ) { \
+    for(size_t s = 0; s < rows; s++) { \
+      FIXED_UNROLL \
+      for(size_t j = 0; j < HIDDEN; j++) { \
+        nnacc sum = f->b0[j]; \
+        FIXED_UNROLL \
+        for(size_t k = 0; k < IN; k++) sum += in[s][k] * f->w0[k][j]; \
+        hidden[s][j] = sum; \
+      } \
+    } \
+    getActivation(f->hiddenAct)->forward(&hidden[0][0], rows*HIDDEN, f->sigmoidMode); \
+    \
+    for(size_t s = 0; s < rows; s++) { \
+      FIXED_UNROLL \
+      for(size_t j = 0; j < OUT; j++) { \
+        nnacc sum = f->b1[j]; \
+        FIXED_UNROLL \
+        for(size_t k = 0; k < HIDDEN; k++) sum += hidden[s][k] * f->w1[k][j]; \
+        out[s][j] = sum; \
+      } \
+    } \
+    getActivation(f->outAct)->forward(&out[0][0], rows*OUT, f->sigmoidMode); \
+  } \
+  \
+  /* Copies rows [first, first + rows) of 'ti' and activates them */ \
+  static inline void name##ForwardRows( \
+    const name *f, Matrix ti, size_t first, size_t rows, \
+    nnacc in[][IN], nnacc hidden[][HIDDEN], nnacc out[][OUT] \
+  ) { \
+    for(size_t s = 0; s < rows; s++) { \
+      const nnfloat *row = &ti.start[getCell(ti, first + s, 0)]; \
+      FIXED_UNROLL \
+      for(size_t k = 0; k < IN; k++) in[s][k] = row[k]; \
+    } \
+    name##Forward(f, rows, (const nnacc (*)[IN])in, hidden, out); \
+  } \
+  \
+  static inline float name##Cost(const name *f, Matrix ti, Matrix to) { \
+    ASSERT_NN(ti.rows == to.rows); \
+    ASSERT_NN(ti.cols == IN && to.cols == OUT); \
+    nnacc in[FIXED_BLOCK][IN], hidden[FIXED_BLOCK][HIDDEN], out[FIXED_BLOCK][OUT]; \
+    nnacc costVal = 0; \
+    for(size_t i = 0; i < ti.rows; i += FIXED_BLOCK) { \
+      size_t rows = ti.rows - i < FIXED_BLOCK ? ti.rows - i : FIXED_BLOCK; \
+      name##ForwardRows(f, ti, i, rows, in, hidden, out); \
+      for(size_t s = 0; s < rows; s++) { \
+        const nnfloat *y = &to.start[getCell(to, i + s, 0)]; \
+        FIXED_UNROLL \
+        for(size_t j = 0; j < OUT; j++) { \
+          nnacc diff = out[s][j] - y[j]; \
+          costVal += diff*diff; \
+        } \
+      } \
+    } \
+    return costVal/ti.rows; \
+  } \
+  \
+  /* The same steps as backPropSample for two layers */ \
+  static inline float name##BackProp(const name *f, name *g, Matrix ti, Matrix to) { \
+    ASSERT_NN(ti.rows == to.rows); \
+    ASSERT_NN(ti.cols == IN && to.cols == OUT); \
+    memset(g, 0, sizeof(*g)); \
+    nnacc costVal = 0; \
+    nnacc in[FIXED_BLOCK][IN], hidden[FIXED_BLOCK][HIDDEN], out[FIXED_BLOCK][OUT]; \
+    for(size_t i = 0; i < ti.rows; i += FIXED_BLOCK) { \
+      size_t rows = ti.rows - i < FIXED_BLOCK ? ti.rows - i : FIXED_BLOCK; \
+      name##ForwardRows(f, ti, i, rows, in, hidden, out); \
+      \
+      /* 2*da*f'(z) of every neuron of the block, da of the */ \
+      /* hidden layer is found like in backPropSample. The */ \
+      /* derivative kernels run over a whole layer at once. */ \
+      nnacc dOut[FIXED_BLOCK][OUT], dHidden[FIXED_BLOCK][HIDDEN]; \
+      for(size_t s = 0; s < rows; s++) { \
+        const nnfloat *y = &to.start[getCell(to, i + s, 0)]; \
+        FIXED_UNROLL \
+        for(size_t j = 0; j < OUT; j++) { \
+          nnacc da = out[s][j] - y[j]; \
+          costVal += da*da; \
+          dOut[s][j] = 2*da; \
+        } \
+      } \
+      getActivation(f->outAct)->derivative(&out[0][0], &dOut[0][0], rows*OUT); \
+      \
+      for(size_t s = 0; s < rows; s++) { \
+        FIXED_UNROLL \
+        for(size_t k = 0; k < HIDDEN; k++) dHidden[s][k] = 0; \
+        FIXED_UNROLL \
+        for(size_t j = 0; j < OUT; j++) { \
+          g->b1[j] += dOut[s][j]; \
+          FIXED_UNROLL \
+          for(size_t k = 0; k < HIDDEN; k++) { \
+            g->w1[k][j] += dOut[s][j]*hidden[s][k]; \
+            dHidden[s][k] += 2*dOut[s][j]*f->w1[k][j]; \
+          } \
+        } \
+      } \
+      getActivation(f->hiddenAct)->derivative(&hidden[0][0], &dHidden[0][0], rows*HIDDEN); \
+      \
+      for(size_t s = 0; s < rows; s++) { \
+        FIXED_UNROLL \
+        for(size_t j = 0; j < HIDDEN; j++) { \
+          g->b0[j] += dHidden[s][j]; \
+          FIXED_UNROLL \
+          for(size_t k = 0; k < IN; k++) { \
+            g->w0[k][j] += dHidden[s][j]*in[s][k]; \
+          } \
+        } \
+      } \
+    } \
+    \
+    nnacc r = ti.rows; \
+    FIXED_UNROLL \
+    for(size_t k = 0; k < IN; k++) { \
+      FIXED_UNROLL \
+      for(size_t j = 0; j < HIDDEN; j++) g->w0[k][j] /= r; \
+    } \
+    FIXED_UNROLL \
+    for(size_t j = 0; j < HIDDEN; j++) g->b0[j] /= r; \
+    FIXED_UNROLL \
+    for(size_t k = 0; k < HIDDEN; k++) { \
+      FIXED_UNROLL \
+      for(size_t j = 0; j < OUT; j++) g->w1[k][j] /= r; \
+    } \
+    FIXED_UNROLL \
+    for(size_t j = 0; j < OUT; j++) g->b1[j] /= r; \
+    return costVal/r; \
+  } \
+  \
+  static inline void name##Train(name *f, const name *g, float rate) { \
+    FIXED_UNROLL \
+    for(size_t k = 0; k < IN; k++) { \
+      FIXED_UNROLL \
+      for(size_t j = 0; j < HIDDEN; j++) f->w0[k][j] -= rate*g->w0[k][j]; \
+    } \
+    FIXED_UNROLL \
+    for(size_t j = 0; j < HIDDEN; j++) f->b0[j] -= rate*g->b0[j]; \
+    FIXED_UNROLL \
+    for(size_t k = 0; k < HIDDEN; k++) { \
+      FIXED_UNROLL \
+      for(size_t j = 0; j < OUT; j++) f->w1[k][j] -= rate*g->w1[k][j]; \
+    } \
+    FIXED_UNROLL \
+    for(size_t j = 0; j < OUT; j++) f->b1[j] -= rate*g->b1[j]; \
+  }
+
+#endif
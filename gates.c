@@ -1,8 +1,15 @@
 #include <time.h>
+#include <string.h>
+#include <unistd.h>
 
+#define SIMD_IMPL
+#define RANDOM_IMPL
 #define MATRIX_IMPL
+#define ACTIVATION_IMPL
 #define NEURAL_NET_IMPL
 #define COMPUTE_IMPL
+#define PARALLEL_IMPL
+#define LOGIC_IMPL
 
 /*
   Order of includes matters if one header uses 
@@ -10,15 +17,25 @@
   if I move compute.h on top of neuralnet.h
   I'll get errors
 */
+#include "simd.h"
+#include "random.h"
 #include "matrix.h"
+#include "activation.h"
 #include "neuralnet.h"
 #include "compute.h"
+#include "parallel.h"
 #include "samples.h"
+#include "fixednet.h"
+#include "logic.h"
+
+//Same model as nModel in main. The sizes are constants so
+//the training loops are unrolled.
+DEFINE_FIXED_NETWORK(GateNet, 2, 2, 1)
 
 int main() {
-  srand(100);
+  randomSeed(100);
 
-  float *td = xor_train_data;
+  nnfloat *td = xor_train_data;
 
   //Stride is used to divide linear array into
   //multiple sub arrays depicting a 2D array.
@@ -52,40 +69,117 @@ int main() {
   //Second to before last element is the number of hidden layers
   //last element is output layer
   size_t nModel[] = {2, 2, 1};
-  NeuralNetwork neuralNet = createNetwork(nModel, ARRAY_LENGTH(nModel));
+  //The layers hold every training row so each forward
+  //pass activates the whole training set at once
+  NeuralNetwork neuralNet = createBatchNetwork(nModel, ARRAY_LENGTH(nModel), n);
   NeuralNetwork gradient = createNetwork(nModel, ARRAY_LENGTH(nModel));
   randNetwork(neuralNet, 0, 1);
+  //Outputs only need to be on the right side of 0.5 so
+  //the polynomial sigmoid is accurate enough
+  neuralNet.sigmoidMode = SIGMOID_FAST;
 
   /** Train **/
 
   printf("Cost %f\n", computeCost(neuralNet, ti, to));
+  GateNet fixedNet, fixedGradient;
+  GateNetLoad(&fixedNet, neuralNet);
   for(int i = 0; i < 5000; i++) {
     //computeFiniteDiff(neuralNet, gradient, eps, ti, to);
-    backProp(neuralNet, gradient, ti, to);
-    trainNetwork(neuralNet, gradient, learnRate);
-    //printf("Cost %f\n", computeCost(neuralNet, ti, to));    
+    //backProp(neuralNet, gradient, ti, to);
+    //trainNetwork(neuralNet, gradient, learnRate);
+    float cost = GateNetBackProp(&fixedNet, &fixedGradient, ti, to);
+    GateNetTrain(&fixedNet, &fixedGradient, learnRate);
+    //Cost before this step
+    if(i % 1000 == 0) printf("%d: Cost %f\n", i, cost);
   }
+  GateNetStore(&fixedNet, neuralNet);
+  GateNetStore(&fixedGradient, gradient);
   printNetwork(gradient, "gradient");
   printf("Cost %f\n", computeCost(neuralNet, ti, to));
 
   /** **/
 
+  //Put every input combination in its own row of the
+  //input layer and activate them at once. forwardLanes
+  //works on all four rows together in one vector.
   for(size_t i = 0; i < 2; i++) {
     for(size_t j = 0; j < 2; j++) {
       INPUT_LAYER_NN(neuralNet).
-        start[getCell(INPUT_LAYER_NN(neuralNet), 0, 0)] = i;
+        start[getCell(INPUT_LAYER_NN(neuralNet), i*2 + j, 0)] = i;
       INPUT_LAYER_NN(neuralNet).
-        start[getCell(INPUT_LAYER_NN(neuralNet), 0, 1)] = j;
-      forwardNetwork(neuralNet);
+        start[getCell(INPUT_LAYER_NN(neuralNet), i*2 + j, 1)] = j;
+    }
+  }
+  forwardLanes(neuralNet, INPUT_LAYER_NN(neuralNet), OUTPUT_LAYER_NN(neuralNet));
 
+  for(size_t i = 0; i < 2; i++) {
+    for(size_t j = 0; j < 2; j++) {
       //%zu is used to display size_t value on the console.
       //%ld can also be used.
       printf(
         "%zu | %zu = %f\n", i, j, 
-        OUTPUT_LAYER_NN(neuralNet).
-          start[getCell(OUTPUT_LAYER_NN(neuralNet), 0, 0)]
+        (double)OUTPUT_LAYER_NN(neuralNet).
+          start[getCell(OUTPUT_LAYER_NN(neuralNet), i*2 + j, 0)]
       );
     }
   }
-  
+
+  /** Train every gate with several seeds and learning rates **/
+
+  nnfloat *gateData[] = {or_train_data, and_train_data, nand_train_data, xor_train_data};
+  const char *gateNames[] = {"or", "and", "nand", "xor"};
+  float rates[] = {0.5f, 1, 2};
+  size_t seeds = 4;
+
+  size_t jobCount = ARRAY_LENGTH(gateData) * ARRAY_LENGTH(rates) * seeds;
+  TrainJob jobs[jobCount];
+  TrainResult results[jobCount];
+  for(size_t g = 0; g < ARRAY_LENGTH(gateData); g++) {
+    for(size_t r = 0; r < ARRAY_LENGTH(rates); r++) {
+      for(size_t s = 0; s < seeds; s++) {
+        TrainJob *job = &jobs[(g*ARRAY_LENGTH(rates) + r)*seeds + s];
+        job->nModel = nModel;
+        job->modelCount = ARRAY_LENGTH(nModel);
+        job->ti = (Matrix){n, 2, stride, gateData[g]};
+        job->to = (Matrix){n, 1, stride, gateData[g] + 2};
+        job->learnRate = rates[r];
+        job->epochs = 5000;
+        job->seed = s;
+        job->sigmoidMode = SIGMOID_FAST;
+      }
+    }
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  ThreadPool *pool = createThreadPool(cpus > 0 ? (size_t)cpus : 1);
+  size_t steals = trainJobs(pool, jobs, jobCount, results);
+  printf(
+    "\nTrained %zu networks on %zu threads (%zu steals)\n", 
+    jobCount, poolThreads(pool), steals
+  );
+
+  //Lowest cost of each gate
+  for(size_t g = 0; g < ARRAY_LENGTH(gateData); g++) {
+    size_t best = g*ARRAY_LENGTH(rates)*seeds;
+    for(size_t k = best; k < (g + 1)*ARRAY_LENGTH(rates)*seeds; k++) {
+      if(results[k].cost < results[best].cost) best = k;
+    }
+    //The 4 rows of the gate as bits. Bit a + 2b is a gate b.
+    TruthTable table = compileTable(results[best].n);
+    printf(
+      "%-4s best cost %f (rate %.1f, seed %zu), table %d%d%d%d\n", gateNames[g], 
+      results[best].cost, jobs[best].learnRate, (size_t)jobs[best].seed,
+      (int)tableLookup(table, 0), (int)tableLookup(table, 1),
+      (int)tableLookup(table, 2), (int)tableLookup(table, 3)
+    );
+    destroyTruthTable(table);
+  }
+
+  for(size_t k = 0; k < jobCount; k++) {
+    destroyNetwork(results[k].n);
+  }
+  destroyThreadPool(pool);
+
+  destroyNetwork(neuralNet);
+  destroyNetwork(gradient);
 }
\ No newline at end of file
@@ -0,0 +1,424 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef LOGIC_H
+#define LOGIC_H
+
+/*
+  A network with few binary inputs computes a function that
+  can be written down completely. compileTable activates
+  every combination of the inputs once, rounds each output
+  to a bit and keeps the bits, so afterwards an answer is a
+  few loads instead of a forward pass.
+
+  Input combination x sets input column j to bit j of x
+  and output column o of the answer is bit o of the
+  result. For the adder of adder2 that makes the lookup of
+  x | y << BITS equal to x + y.
+*/
+
+//Most inputs of compileTable. A table has 2^inputs bits
+//per output, 2 MB per output at 24 inputs.
+#define LOGIC_MAX_INPUTS 24
+//An output above this is a 1, like the checks of
+//gates.c and adder2.c
+#define LOGIC_THRESHOLD 0.5f
+//Rows activated at once while the table is made
+#define LOGIC_BATCH 1024
+
+typedef struct {
+  size_t inputs;
+  //At most 64 so an answer fits in a uint64_t
+  size_t outputs;
+  //uint64_t words of the bitset of one output
+  size_t words;
+  //Bitset of output o starts at bits[o * words]. Bit x
+  //of it is the output for input combination x.
+  uint64_t *bits;
+} TruthTable;
+
+TruthTable compileTable(NeuralNetwork n);
+void destroyTruthTable(TruthTable t);
+
+//Output bits for input combination x. Defined here so it
+//can be inlined into the caller's loop.
+static inline uint64_t tableLookup(TruthTable t, uint64_t x) {
+  const uint64_t *word = &t.bits[x >> 6];
+  uint64_t out = 0;
+  for(size_t o = 0; o < t.outputs; o++) {
+    out |= ((word[o * t.words] >> (x & 63)) & 1) << o;
+  }
+  return out;
+}
+
+/*
+  Bit-sliced form of a table for widths where the table
+  doesn't fit in the cache anymore. The outputs are turned
+  into one reduced decision diagram: node i picks node
+  hi[i] if input var[i] is 1 and node lo[i] if it's 0.
+  Nodes 0 and 1 are the constants 0 and 1, every other node
+  comes after its two children and the outputs share the
+  nodes they have in common.
+
+  evalSliced runs the nodes on whole words. Bit q of every
+  word is a different query, so one pass answers 64
+  queries with a few AND, OR and NOT per node and no
+  branches.
+
+  The inputs are tested from the last one down to input 0,
+  which keeps the diagram small when the high inputs decide
+  the most. The adder has x in the low inputs and y in the
+  high ones so its diagram grows with 2^BITS.
+*/
+typedef struct {
+  size_t inputs;
+  size_t outputs;
+  size_t count;
+  uint32_t *var;
+  uint32_t *lo;
+  uint32_t *hi;
+  //Node of each output
+  uint32_t *roots;
+  //One word per node, used by evalSliced
+  uint64_t *values;
+} SlicedLogic;
+
+SlicedLogic compileSliced(TruthTable t);
+void destroySlicedLogic(SlicedLogic s);
+
+/*
+  Params:
+  in = 'inputs' words. Bit q of in[j] is input j of query q.
+  out = 'outputs' words. Bit q of out[o] is output o of
+  query q.
+
+  Uses the scratch words of 's' so one call at a time.
+*/
+void evalSliced(SlicedLogic s, const uint64_t *in, uint64_t *out);
+
+//Up to 64 queries where bit j of queries[q] is input j,
+//turned into the 'inputs' words of evalSliced
+void sliceQueries(const uint64_t *queries, size_t count, size_t inputs, uint64_t *in);
+//The other way: the 'outputs' words of evalSliced turned
+//into one word of output bits per query
+void unsliceOutputs(const uint64_t *out, size_t outputs, size_t count, uint64_t *answers);
+
+/*
+  Writes 's' as a C function
+    void name(const uint64_t *in, uint64_t *out)
+  that does what evalSliced does with every node as a
+  statement, so the compiler can keep the words in
+  registers. Returns 0 on success and -1 if writing fails.
+*/
+int writeSlicedC(SlicedLogic s, FILE *f, const char *name);
+
+#endif
+
+#ifdef LOGIC_IMPL
+
+#include <string.h>
+
+TruthTable compileTable(NeuralNetwork n) {
+  Matrix in = INPUT_LAYER_NN(n);
+  Matrix out = OUTPUT_LAYER_NN(n);
+  ASSERT_NN(in.cols <= LOGIC_MAX_INPUTS);
+  ASSERT_NN(out.cols <= 64);
+
+  TruthTable t = {
+    .inputs = in.cols,
+    .outputs = out.cols,
+    //Tables under 64 entries still take one word
+    .words = ((1ull << in.cols) + 63) / 64
+  };
+  t.bits = NN_MALLOC(sizeof(*t.bits) * t.words * t.outputs);
+  ASSERT_NN(t.bits != NULL);
+  memset(t.bits, 0, sizeof(*t.bits) * t.words * t.outputs);
+
+  uint64_t rows = 1ull << t.inputs;
+  size_t batch = rows < LOGIC_BATCH ? (size_t)rows : LOGIC_BATCH;
+  NeuralNetwork b = createSharedNetwork(n, batch);
+  in = INPUT_LAYER_NN(b);
+  out = OUTPUT_LAYER_NN(b);
+
+  float row[t.inputs + 1];
+  for(uint64_t first = 0; first < rows; first += batch) {
+    for(size_t r = 0; r < batch; r++) {
+      for(size_t j = 0; j < t.inputs; j++) row[j] = ((first + r) >> j) & 1;
+      storeFloats(&in.start[getCell(in, r, 0)], row, t.inputs);
+    }
+    forwardBatch(b, batch);
+
+    for(size_t r = 0; r < batch; r++) {
+      uint64_t x = first + r;
+      for(size_t o = 0; o < t.outputs; o++) {
+        if(out.start[getCell(out, r, o)] > LOGIC_THRESHOLD) {
+          t.bits[o * t.words + (x >> 6)] |= 1ull << (x & 63);
+        }
+      }
+    }
+  }
+
+  destroyNetwork(b);
+  return t;
+}
+
+void destroyTruthTable(TruthTable t) {
+  NN_FREE(t.bits);
+}
+
+/*
+  Nodes that are being made. 'unique' is an open address
+  hash set of node indices with the same (var, lo, hi), so
+  a node that already exists is used again. 'words' maps
+  the 64 entries of a table word to the node they make,
+  since many words of a table are the same.
+*/
+typedef struct {
+  SlicedLogic s;
+  size_t capacity;
+  uint32_t *unique;
+  size_t uniqueSize;
+  uint64_t *wordKeys;
+  uint32_t *wordNodes;
+  size_t wordSize;
+  size_t wordCount;
+} LogicBuilder;
+
+#define LOGIC_EMPTY UINT32_MAX
+
+static uint64_t logicHash(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t logicNodeHash(uint32_t var, uint32_t lo, uint32_t hi) {
+  return logicHash(((uint64_t)var << 58) ^ ((uint64_t)lo << 29) ^ hi);
+}
+
+static uint32_t *logicGrow(uint32_t *old, size_t count, size_t capacity) {
+  uint32_t *p = NN_MALLOC(sizeof(*p) * capacity);
+  ASSERT_NN(p != NULL);
+  if(old != NULL) memcpy(p, old, sizeof(*p) * count);
+  NN_FREE(old);
+  return p;
+}
+
+static void logicFillEmpty(uint32_t *set, size_t size) {
+  for(size_t i = 0; i < size; i++) set[i] = LOGIC_EMPTY;
+}
+
+//Node index of the slot of (var, lo, hi) in the set, or
+//the empty slot where it goes
+static uint32_t *logicFind(LogicBuilder *b, uint32_t var, uint32_t lo, uint32_t hi) {
+  size_t mask = b->uniqueSize - 1;
+  size_t i = logicNodeHash(var, lo, hi) & mask;
+  for(;;) {
+    uint32_t id = b->unique[i];
+    if(
+      id == LOGIC_EMPTY ||
+      (b->s.var[id] == var && b->s.lo[id] == lo && b->s.hi[id] == hi)
+    ) return &b->unique[i];
+    i = (i + 1) & mask;
+  }
+}
+
+static uint32_t logicNode(LogicBuilder *b, uint32_t var, uint32_t lo, uint32_t hi) {
+  //Both sides are the same so the input doesn't matter
+  if(lo == hi) return lo;
+
+  uint32_t *slot = logicFind(b, var, lo, hi);
+  if(*slot != LOGIC_EMPTY) return *slot;
+
+  if(b->s.count == b->capacity) {
+    b->capacity *= 2;
+    b->s.var = logicGrow(b->s.var, b->s.count, b->capacity);
+    b->s.lo = logicGrow(b->s.lo, b->s.count, b->capacity);
+    b->s.hi = logicGrow(b->s.hi, b->s.count, b->capacity);
+  }
+  uint32_t id = (uint32_t)b->s.count++;
+  ASSERT_NN(id != LOGIC_EMPTY);
+  b->s.var[id] = var;
+  b->s.lo[id] = lo;
+  b->s.hi[id] = hi;
+  *slot = id;
+
+  //Kept at most half full
+  if(2 * b->s.count > b->uniqueSize) {
+    NN_FREE(b->unique);
+    b->uniqueSize *= 2;
+    b->unique = NN_MALLOC(sizeof(*b->unique) * b->uniqueSize);
+    ASSERT_NN(b->unique != NULL);
+    logicFillEmpty(b->unique, b->uniqueSize);
+    for(uint32_t i = 2; i < b->s.count; i++) {
+      *logicFind(b, b->s.var[i], b->s.lo[i], b->s.hi[i]) = i;
+    }
+  }
+  return id;
+}
+
+//Node of the 2^k entries in the low bits of 'w', which
+//are inputs 0 to k-1
+static uint32_t logicWordNode(LogicBuilder *b, uint64_t w, size_t k) {
+  if(k == 0) return (uint32_t)(w & 1);
+  size_t half = (size_t)1 << (k - 1);
+  uint32_t lo = logicWordNode(b, w & ((1ull << half) - 1), k - 1);
+  uint32_t hi = logicWordNode(b, w >> half, k - 1);
+  return logicNode(b, (uint32_t)(k - 1), lo, hi);
+}
+
+static uint32_t logicWord(LogicBuilder *b, uint64_t w, size_t k) {
+  size_t mask = b->wordSize - 1;
+  size_t i = logicHash(w) & mask;
+  while(b->wordNodes[i] != LOGIC_EMPTY) {
+    if(b->wordKeys[i] == w) return b->wordNodes[i];
+    i = (i + 1) & mask;
+  }
+
+  uint32_t id = logicWordNode(b, w, k);
+  b->wordKeys[i] = w;
+  b->wordNodes[i] = id;
+  b->wordCount++;
+
+  if(2 * b->wordCount > b->wordSize) {
+    uint64_t *keys = b->wordKeys;
+    uint32_t *nodes = b->wordNodes;
+    size_t size = b->wordSize;
+    b->wordSize *= 2;
+    b->wordKeys = NN_MALLOC(sizeof(*b->wordKeys) * b->wordSize);
+    b->wordNodes = NN_MALLOC(sizeof(*b->wordNodes) * b->wordSize);
+    ASSERT_NN(b->wordKeys != NULL && b->wordNodes != NULL);
+    logicFillEmpty(b->wordNodes, b->wordSize);
+    for(size_t j = 0; j < size; j++) {
+      if(nodes[j] == LOGIC_EMPTY) continue;
+      size_t slot = logicHash(keys[j]) & (b->wordSize - 1);
+      while(b->wordNodes[slot] != LOGIC_EMPTY) slot = (slot + 1) & (b->wordSize - 1);
+      b->wordKeys[slot] = keys[j];
+      b->wordNodes[slot] = nodes[j];
+    }
+    NN_FREE(keys);
+    NN_FREE(nodes);
+  }
+  return id;
+}
+
+SlicedLogic compileSliced(TruthTable t) {
+  LogicBuilder b = {
+    .s = {.inputs = t.inputs, .outputs = t.outputs},
+    .capacity = 256,
+    .uniqueSize = 512,
+    .wordSize = 256
+  };
+  b.s.var = logicGrow(NULL, 0, b.capacity);
+  b.s.lo = logicGrow(NULL, 0, b.capacity);
+  b.s.hi = logicGrow(NULL, 0, b.capacity);
+  b.unique = logicGrow(NULL, 0, b.uniqueSize);
+  logicFillEmpty(b.unique, b.uniqueSize);
+  b.wordKeys = NN_MALLOC(sizeof(*b.wordKeys) * b.wordSize);
+  b.wordNodes = logicGrow(NULL, 0, b.wordSize);
+  ASSERT_NN(b.wordKeys != NULL);
+  logicFillEmpty(b.wordNodes, b.wordSize);
+
+  //The constants. Their input is never read.
+  for(uint32_t c = 0; c < 2; c++) {
+    b.s.var[c] = 0;
+    b.s.lo[c] = c;
+    b.s.hi[c] = c;
+  }
+  b.s.count = 2;
+
+  b.s.roots = NN_MALLOC(sizeof(*b.s.roots) * t.outputs);
+  ASSERT_NN(b.s.roots != NULL);
+
+  //Inputs 0 to 5 are inside each word, the others pick
+  //the word
+  size_t k = t.inputs < 6 ? t.inputs : 6;
+  uint32_t *level = logicGrow(NULL, 0, t.words);
+  for(size_t o = 0; o < t.outputs; o++) {
+    for(size_t w = 0; w < t.words; w++) {
+      level[w] = logicWord(&b, t.bits[o * t.words + w], k);
+    }
+    //Pairs of nodes of the same level are joined on the
+    //next input until one node is left
+    for(size_t count = t.words, var = k; count > 1; count /= 2, var++) {
+      for(size_t i = 0; i < count / 2; i++) {
+        level[i] = logicNode(&b, (uint32_t)var, level[2*i], level[2*i + 1]);
+      }
+    }
+    b.s.roots[o] = level[0];
+  }
+  NN_FREE(level);
+  NN_FREE(b.unique);
+  NN_FREE(b.wordKeys);
+  NN_FREE(b.wordNodes);
+
+  b.s.values = NN_MALLOC(sizeof(*b.s.values) * b.s.count);
+  ASSERT_NN(b.s.values != NULL);
+  return b.s;
+}
+
+void destroySlicedLogic(SlicedLogic s) {
+  NN_FREE(s.var);
+  NN_FREE(s.lo);
+  NN_FREE(s.hi);
+  NN_FREE(s.roots);
+  NN_FREE(s.values);
+}
+
+void evalSliced(SlicedLogic s, const uint64_t *in, uint64_t *out) {
+  uint64_t *v = s.values;
+  v[0] = 0;
+  v[1] = ~0ull;
+  for(size_t i = 2; i < s.count; i++) {
+    //lo where the input is 0 and hi where it's 1
+    uint64_t lo = v[s.lo[i]];
+    v[i] = lo ^ (in[s.var[i]] & (lo ^ v[s.hi[i]]));
+  }
+  for(size_t o = 0; o < s.outputs; o++) {
+    out[o] = v[s.roots[o]];
+  }
+}
+
+void sliceQueries(const uint64_t *queries, size_t count, size_t inputs, uint64_t *in) {
+  ASSERT_NN(count <= 64);
+  for(size_t j = 0; j < inputs; j++) {
+    uint64_t w = 0;
+    for(size_t q = 0; q < count; q++) w |= ((queries[q] >> j) & 1) << q;
+    in[j] = w;
+  }
+}
+
+void unsliceOutputs(const uint64_t *out, size_t outputs, size_t count, uint64_t *answers) {
+  ASSERT_NN(count <= 64);
+  for(size_t q = 0; q < count; q++) {
+    uint64_t a = 0;
+    for(size_t o = 0; o < outputs; o++) a |= ((out[o] >> q) & 1) << o;
+    answers[q] = a;
+  }
+}
+
+int writeSlicedC(SlicedLogic s, FILE *f, const char *name) {
+  fprintf(f, "#include <stdint.h>\n\n");
+  fprintf(f, "//%zu inputs, %zu outputs, %zu nodes\n", s.inputs, s.outputs, s.count - 2);
+  fprintf(f, "void %s(const uint64_t *in, uint64_t *out) {\n", name);
+  fprintf(f, "  const uint64_t n0 = 0, n1 = ~(uint64_t)0;\n");
+  for(size_t i = 2; i < s.count; i++) {
+    uint32_t v = s.var[i], lo = s.lo[i], hi = s.hi[i];
+    fprintf(f, "  const uint64_t n%zu = ", i);
+    //The constants make most nodes a single operation
+    if(lo == 0 && hi == 1) fprintf(f, "in[%u];\n", v);
+    else if(lo == 1 && hi == 0) fprintf(f, "~in[%u];\n", v);
+    else if(lo == 0) fprintf(f, "in[%u] & n%u;\n", v, hi);
+    else if(hi == 0) fprintf(f, "~in[%u] & n%u;\n", v, lo);
+    else if(hi == 1) fprintf(f, "in[%u] | n%u;\n", v, lo);
+    else if(lo == 1) fprintf(f, "~in[%u] | n%u;\n", v, hi);
+    else fprintf(f, "n%u ^ (in[%u] & (n%u ^ n%u));\n", lo, v, lo, hi);
+  }
+  for(size_t o = 0; o < s.outputs; o++) {
+    fprintf(f, "  out[%zu] = n%u;\n", o, s.roots[o]);
+  }
+  fprintf(f, "  (void)n0; (void)n1;\n}\n");
+  return ferror(f) ? -1 : 0;
+}
+
+#endif
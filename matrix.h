@@ -1,9 +1,39 @@
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
 
 #ifndef MATRIX_H
 #define MATRIX_H
 
+/*
+  Type of the numbers of every matrix, chosen when the
+  program is compiled. 'nnacc' is the type of the sums.
+
+  default = float. The SIMD kernels of simd.h are used.
+  -DNN_DOUBLE = double, for reference runs. Every sum is
+  done in double and the sigmoid uses exp in double. The
+  kernels of simd.h are float only so the loops in this
+  file are used.
+  -DNN_HALF = _Float16. Half of the memory of float. Sums
+  are done in float, and the SIMD kernels run on float
+  copies that are made with loadFloats and written back
+  with storeFloats.
+*/
+#if defined(NN_DOUBLE)
+typedef double nnfloat;
+typedef double nnacc;
+#define NN_TYPE_NAME "double"
+#elif defined(NN_HALF)
+typedef _Float16 nnfloat;
+typedef float nnacc;
+#define NN_TYPE_NAME "half"
+#else
+#define NN_FLOAT32 1
+typedef float nnfloat;
+typedef float nnacc;
+#define NN_TYPE_NAME "float"
+#endif
+
 typedef struct {
   size_t rows;
   size_t cols;
@@ -14,7 +44,7 @@ typedef struct {
   //as 2D array. stride is used
   //to divide this array into multiple
   //array. Thus, acting as 2D array
-  float *start;
+  nnfloat *start;
 } Matrix;
 
 #ifndef NN_MALLOC
@@ -22,24 +52,71 @@ typedef struct {
 #define NN_MALLOC malloc
 #endif
 
+#ifndef NN_FREE
+#include <stdlib.h>
+#define NN_FREE free
+#endif
+
 #ifndef ASSERT_NN
 #include <assert.h>
 #define ASSERT_NN assert
 #endif
 
+//Instrumentation of profile.h. It does nothing if
+//profile.h is not included before this header.
+#ifndef PROFILE_FUNC
+#define PROFILE_FUNC(id)
+#endif
+
+//Number of the seed of randomSeed, 0 up to but not
+//including 1. Thread safe. Every call takes its own stream.
 float randFloat();
 float sigmoid(float x);
+//simdSigmoidOne in the type of the sums. Always exact with NN_DOUBLE.
+nnacc sigmoidOne(nnacc x, SigmoidMode mode);
+//sigmoidOne of 'count' sums in place
+void sigmoidRun(nnacc *x, size_t count, SigmoidMode mode);
+//Converting load and store between the numbers of a
+//matrix and floats
+void loadFloats(float *dst, const nnfloat *src, size_t count);
+void storeFloats(nnfloat *dst, const float *src, size_t count);
 
 Matrix matrixAlloc(size_t rows, size_t cols);
+//Only for matrices that are made by matrixAlloc
+void matrixFree(Matrix matrix);
 void matrixDot(Matrix dst, Matrix a, Matrix b);
 void matrixSum(Matrix dst, Matrix a);
+void matrixSumRow(Matrix dst, Matrix row);
 size_t getCell(Matrix matrix, size_t row, size_t col);
 void printMatrix(Matrix matrix, const char *label);
+//randMatrixSeed on the seed of randomSeed and a new stream
 void randMatrix(Matrix matrix, float rStart, float rEnd);
+//Element (i, j) is number i*cols + j of the stream, so the
+//result doesn't depend on the stride of the matrix
+void randMatrixSeed(
+  Matrix matrix, float rStart, float rEnd, uint64_t seed, uint64_t stream
+);
+//Only the elements 'first' to 'first' + 'count' - 1 in row
+//order. Ranges that don't overlap can be filled by
+//different threads and give the same matrix as one call.
+void randMatrixRange(
+  Matrix matrix, float rStart, float rEnd, uint64_t seed, uint64_t stream,
+  size_t first, size_t count
+);
 void fillMatrix(Matrix matrix, float value);
 void matrixCopy(Matrix dst, Matrix src);
 void applySigmoid(Matrix matrix);
+//applySigmoid with a chosen accuracy. See SigmoidMode in simd.h
+void applySigmoidMode(Matrix matrix, SigmoidMode mode);
+void denseForward(
+  Matrix dst, Matrix input, Matrix weights, Matrix biases, SigmoidMode mode
+);
 Matrix getMatrixRow(Matrix m, size_t row);
+Matrix getMatrixRows(Matrix m, size_t row, size_t count);
+//Frees the scratch that matrixDot and denseForward keep
+//on the calling thread with -DNN_HALF. A thread that ends
+//before the program calls it when it's done.
+void matrixScratchFree(void);
 
 //Add parentheses in-between the variable in order to
 //prevent any problems when the content of variable is
@@ -60,7 +137,46 @@ float sigmoid(float x) {
 }
 
 float randFloat() {
-  return (float)rand()/(float)RAND_MAX;
+  return randomFloat(randomCurrentSeed(), randomNextStream(), 0);
+}
+
+nnacc sigmoidOne(nnacc x, SigmoidMode mode) {
+#ifdef NN_DOUBLE
+  (void)mode;
+  return 1.0/(1.0 + exp(-x));
+#else
+  return simdSigmoidOne(x, mode);
+#endif
+}
+
+void sigmoidRun(nnacc *x, size_t count, SigmoidMode mode) {
+#ifdef NN_DOUBLE
+  for(size_t i = 0; i < count; i++) {
+    x[i] = sigmoidOne(x[i], mode);
+  }
+#else
+  simdSigmoid(x, count, mode);
+#endif
+}
+
+void loadFloats(float *dst, const nnfloat *src, size_t count) {
+#ifdef NN_HALF
+  simdHalfToFloat(src, dst, count);
+#else
+  for(size_t i = 0; i < count; i++) {
+    dst[i] = (float)src[i];
+  }
+#endif
+}
+
+void storeFloats(nnfloat *dst, const float *src, size_t count) {
+#ifdef NN_HALF
+  simdFloatToHalf(src, dst, count);
+#else
+  for(size_t i = 0; i < count; i++) {
+    dst[i] = (nnfloat)src[i];
+  }
+#endif
 }
 
 size_t getCell(Matrix matrix, size_t row, size_t col) {
@@ -74,11 +190,58 @@ Matrix matrixAlloc(size_t rows, size_t cols) {
   matrix.rows = rows;
   matrix.cols = cols;
   matrix.stride = cols;
-  matrix.start = NN_MALLOC(sizeof(Matrix) * rows * cols);
+  matrix.start = NN_MALLOC(sizeof(*matrix.start) * rows * cols);
   ASSERT_NN(matrix.start != NULL);
   return matrix;
 }
+void matrixFree(Matrix matrix) {
+  NN_FREE(matrix.start);
+}
+#ifdef NN_HALF
+//Float copies of the tiles of halfDense. Only grows, so
+//the training loop doesn't allocate after the first step.
+static __thread float *halfScratch;
+static __thread size_t halfScratchFloats;
+
+/*
+  simdDenseHalf on the half float matrices. If 'biases' is
+  NULL there is no bias and no sigmoid, like simdGemm.
+  Returns 0 without converting anything if there is no
+  SIMD kernel.
+*/
+static int halfDense(
+  Matrix dst, Matrix a, Matrix b, const Matrix *biases, SigmoidMode mode
+) {
+  size_t floats = simdHalfScratch(a.cols);
+  if(floats == 0) return 0;
+  if(floats > halfScratchFloats) {
+    NN_FREE(halfScratch);
+    halfScratch = NN_MALLOC(sizeof(*halfScratch) * floats);
+    ASSERT_NN(halfScratch != NULL);
+    halfScratchFloats = floats;
+  }
+
+  return simdDenseHalf(
+    dst.rows, dst.cols, a.cols,
+    a.start, a.stride,
+    b.start, b.stride,
+    biases != NULL ? biases->start : NULL,
+    dst.start, dst.stride,
+    mode, halfScratch
+  );
+}
+#endif
+
+void matrixScratchFree(void) {
+#ifdef NN_HALF
+  NN_FREE(halfScratch);
+  halfScratch = NULL;
+  halfScratchFloats = 0;
+#endif
+}
+
 void matrixDot(Matrix dst, Matrix a, Matrix b){
+  PROFILE_FUNC(PROFILE_MATRIX_DOT);
 
   //Reference: https://www.mathsisfun.com/algebra/matrix-multiplying.html
   //To multiply matrix using dot product, we make
@@ -91,24 +254,38 @@ void matrixDot(Matrix dst, Matrix a, Matrix b){
   ASSERT_NN(dst.rows == a.rows);
   ASSERT_NN(dst.cols == b.cols);
 
+  //Use the tiled SIMD kernel in simd.h if the CPU has
+  //one. The loop below is the fallback.
+#if defined(NN_FLOAT32)
+  if(simdGemm(
+    dst.rows, dst.cols, a.cols, 
+    a.start, a.stride, 
+    b.start, b.stride, 
+    dst.start, dst.stride
+  )) return;
+#elif defined(NN_HALF)
+  if(halfDense(dst, a, b, NULL, SIGMOID_EXACT)) return;
+#endif
+
   size_t refMat = a.cols;
   for(size_t i = 0; i < dst.rows; i++) {
     for(size_t j = 0; j < dst.cols; j++) {
 
-      dst.start[getCell(dst, i, j)] = 0;
+      nnacc sum = 0;
       for(size_t k = 0; k < refMat; k++) {
         //Read the explanation above to understand this
         //statement. Traverse 'a' matrix from left to right
         //and traverse 'b' matrix from top to bottom. Multiply
         //each value in 'a' and 'b' during traversal and
         //sum the products of each multiplication.
-        dst.start[getCell(dst, i, j)] +=
-          a.start[getCell(a, i, k)] * b.start[getCell(b, k, j)];
+        sum += (nnacc)a.start[getCell(a, i, k)] * b.start[getCell(b, k, j)];
       }
+      dst.start[getCell(dst, i, j)] = sum;
     }
   }
 }
 void matrixSum(Matrix dst, Matrix matrix){
+  PROFILE_FUNC(PROFILE_MATRIX_SUM);
   ASSERT_NN(dst.rows == matrix.rows);
   ASSERT_NN(dst.cols == matrix.cols);
 
@@ -119,22 +296,58 @@ void matrixSum(Matrix dst, Matrix matrix){
     }
   }
 }
+//Same as matrixSum but 'row' is a single row that is
+//added to every row of 'dst'. This is used to add the
+//biases of a layer to every sample in a batch.
+void matrixSumRow(Matrix dst, Matrix row){
+  ASSERT_NN(row.rows == 1);
+  ASSERT_NN(dst.cols == row.cols);
+
+  for(size_t i = 0; i < dst.rows; i++) {
+    for(size_t j = 0; j < dst.cols; j++) {
+      dst.start[getCell(dst, i, j)] +=
+      row.start[getCell(row, 0, j)];
+    }
+  }
+}
 void printMatrix(Matrix matrix, const char *label){
   printf("%s\n", label);
   for(size_t i = 0; i < matrix.rows; i++) {
     for(size_t j = 0; j < matrix.cols; j++) {
-      printf("%f ", matrix.start[getCell(matrix, i, j)]);
+      printf("%f ", (double)matrix.start[getCell(matrix, i, j)]);
     }
     printf("\n");
   }
   printf("\n");
 }
 void randMatrix(Matrix matrix, float rStart, float rEnd) {
-  for(int i = 0; i < matrix.rows; i++) {
-    for(int j = 0; j < matrix.cols; j++) {
-      matrix.start[getCell(matrix, i, j)] = 
-        randFloat()*(rEnd - rStart) + rStart;
-    }
+  randMatrixSeed(matrix, rStart, rEnd, randomCurrentSeed(), randomNextStream());
+}
+void randMatrixSeed(
+  Matrix matrix, float rStart, float rEnd, uint64_t seed, uint64_t stream
+) {
+  randMatrixRange(
+    matrix, rStart, rEnd, seed, stream, 0, matrix.rows*matrix.cols
+  );
+}
+void randMatrixRange(
+  Matrix matrix, float rStart, float rEnd, uint64_t seed, uint64_t stream,
+  size_t first, size_t count
+) {
+  ASSERT_NN(first + count <= matrix.rows*matrix.cols);
+  //The numbers are made as floats in pieces of a row and
+  //converted into the matrix
+  float chunk[256];
+  size_t end = first + count;
+  while(first < end) {
+    size_t row = first / matrix.cols;
+    size_t col = first % matrix.cols;
+    size_t n = matrix.cols - col;
+    if(n > end - first) n = end - first;
+    if(n > ARRAY_LENGTH(chunk)) n = ARRAY_LENGTH(chunk);
+    randomFill(chunk, n, seed, stream, first, rStart, rEnd);
+    storeFloats(&matrix.start[getCell(matrix, row, col)], chunk, n);
+    first += n;
   }
 }
 void fillMatrix(Matrix matrix, float value) {
@@ -145,6 +358,7 @@ void fillMatrix(Matrix matrix, float value) {
   }
 }
 void matrixCopy(Matrix dst, Matrix src) {
+  PROFILE_FUNC(PROFILE_MATRIX_COPY);
   ASSERT_NN(dst.rows == src.rows);
   ASSERT_NN(dst.cols == src.cols);
 
@@ -164,13 +378,82 @@ Matrix getMatrixRow(Matrix m, size_t row) {
     .start = &m.start[getCell(m, row, 0)]
   };
 
+}
+//Like getMatrixRow but the view spans 'count' rows.
+//No data is copied, the view shares the memory and
+//the stride of 'm'.
+Matrix getMatrixRows(Matrix m, size_t row, size_t count) {
+  ASSERT_NN(row + count <= m.rows);
+
+  return (Matrix){
+    .rows = count,
+    .cols = m.cols,
+    .stride = m.stride,
+    .start = &m.start[getCell(m, row, 0)]
+  };
+
 }
 
 void applySigmoid(Matrix matrix) {
-  for(int i = 0; i < matrix.rows; i++) {
-    for(int j = 0; j < matrix.cols; j++) {
-      matrix.start[getCell(matrix, i, j)] =
-        sigmoid(matrix.start[getCell(matrix, i, j)]);
+  applySigmoidMode(matrix, SIGMOID_EXACT);
+}
+
+void applySigmoidMode(Matrix matrix, SigmoidMode mode) {
+  PROFILE_FUNC(PROFILE_APPLY_SIGMOID);
+  //Rows are contiguous but the gap between rows is
+  //not part of the matrix
+  for(size_t i = 0; i < matrix.rows; i++) {
+#ifdef NN_FLOAT32
+    simdSigmoid(&matrix.start[getCell(matrix, i, 0)], matrix.cols, mode);
+#else
+    for(size_t j = 0; j < matrix.cols; j++) {
+      nnfloat *x = &matrix.start[getCell(matrix, i, j)];
+      *x = sigmoidOne(*x, mode);
+    }
+#endif
+  }
+}
+
+/*
+  dst = sigmoid(input * weights + biases)
+
+  This does matrixDot, matrixSumRow and applySigmoid in
+  one pass. The bias and the activation are applied while
+  the result is still in registers instead of walking
+  'dst' three times. 'biases' is a single row that is
+  added to every row of the result.
+*/
+void denseForward(
+  Matrix dst, Matrix input, Matrix weights, Matrix biases, SigmoidMode mode
+) {
+  PROFILE_FUNC(PROFILE_DENSE_FORWARD);
+  ASSERT_NN(input.cols == weights.rows);
+  ASSERT_NN(dst.rows == input.rows);
+  ASSERT_NN(dst.cols == weights.cols);
+  ASSERT_NN(biases.rows == 1);
+  ASSERT_NN(biases.cols == dst.cols);
+
+#if defined(NN_FLOAT32)
+  if(simdDense(
+    dst.rows, dst.cols, input.cols,
+    input.start, input.stride,
+    weights.start, weights.stride,
+    biases.start,
+    dst.start, dst.stride,
+    mode
+  )) return;
+#elif defined(NN_HALF)
+  if(halfDense(dst, input, weights, &biases, mode)) return;
+#endif
+
+  for(size_t i = 0; i < dst.rows; i++) {
+    for(size_t j = 0; j < dst.cols; j++) {
+      nnacc sum = biases.start[getCell(biases, 0, j)];
+      for(size_t k = 0; k < input.cols; k++) {
+        sum += (nnacc)input.start[getCell(input, i, k)] * 
+          weights.start[getCell(weights, k, j)];
+      }
+      dst.start[getCell(dst, i, j)] = sigmoidOne(sum, mode);
     }
   }
 }
@@ -0,0 +1,312 @@
+#include <stdint.h>
+
+#ifndef MODEL_H
+#define MODEL_H
+
+/*
+  Binary model file. Every number is stored in the byte
+  order of the machine that saved it. 'byteOrder' is used
+  to reject files from a machine with the other order.
+
+  offset 0              ModelHeader
+  offset 48             uint64_t layers[layerCount]
+  after 'layers'        uint32_t activations[layerCount - 1]
+  offset paramOffset    nnfloat params[paramCount]
+
+  'layers' is the model array given to createNetwork.
+  'activations' is NeuralNetwork.activations.
+  'params' is NeuralNetwork.params: weights[0], biases[0],
+  weights[1], ... with every matrix stored row by row.
+  paramOffset is a multiple of 'alignment' so the
+  parameters can be used straight from a memory map.
+*/
+#define MODEL_MAGIC "NNMODEL"
+#define MODEL_VERSION 2
+#define MODEL_BYTE_ORDER 0x01020304u
+//Most layers a file can have, so a broken file can't ask
+//for huge arrays
+#define MODEL_MAX_LAYERS 4096
+
+//Type of the stored parameters. A build only loads the
+//type of its own nnfloat.
+#define MODEL_DTYPE_F32 1
+#define MODEL_DTYPE_F64 2
+#define MODEL_DTYPE_F16 3
+
+#if defined(NN_DOUBLE)
+#define MODEL_DTYPE MODEL_DTYPE_F64
+#elif defined(NN_HALF)
+#define MODEL_DTYPE MODEL_DTYPE_F16
+#else
+#define MODEL_DTYPE MODEL_DTYPE_F32
+#endif
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t dtype;
+  uint32_t alignment;
+  uint32_t layerCount;
+  uint32_t sigmoidMode;
+  uint64_t paramCount;
+  uint64_t paramOffset;
+} ModelHeader;
+
+_Static_assert(sizeof(ModelHeader) == 48, "ModelHeader must be 48 bytes");
+
+//Returns 0 on success and -1 if the file can't be written
+int saveNetwork(NeuralNetwork n, const char *path);
+
+/*
+  Reads a model file into a new network with 'batch' rows
+  in each layer. The network owns its parameters. Returns 0
+  on success and -1 if the file can't be read or is not a
+  valid model. Free it with destroyNetwork.
+*/
+int loadNetwork(const char *path, size_t batch, NeuralNetwork *n);
+
+/*
+  Same as loadNetwork but the file is mapped into memory and
+  the weights and biases point into the mapping. Nothing is
+  read until it's used. The mapping is private, so training
+  the network doesn't change the file. Free it with
+  unmapNetwork.
+*/
+int mapNetwork(const char *path, size_t batch, NeuralNetwork *n);
+void unmapNetwork(NeuralNetwork n);
+
+#endif
+
+#ifdef MODEL_IMPL
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Offset of the parameters in a file with 'layerCount' layers
+static uint64_t modelParamOffset(uint64_t layerCount) {
+  uint64_t end = sizeof(ModelHeader) + sizeof(uint64_t) * layerCount +
+    sizeof(uint32_t) * (layerCount - 1);
+  return (end + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+}
+
+int saveNetwork(NeuralNetwork n, const char *path) {
+  ModelHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+  h.version = MODEL_VERSION;
+  h.byteOrder = MODEL_BYTE_ORDER;
+  h.dtype = MODEL_DTYPE;
+  h.alignment = NN_ALIGN;
+  h.layerCount = n.count + 1;
+  h.sigmoidMode = n.sigmoidMode;
+  h.paramCount = n.paramCount;
+  h.paramOffset = modelParamOffset(h.layerCount);
+
+  FILE *f = fopen(path, "wb");
+  if(f == NULL) return -1;
+
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  for(size_t i = 0; ok && i <= n.count; i++) {
+    uint64_t cols = n.layers[i].cols;
+    ok = fwrite(&cols, sizeof(cols), 1, f) == 1;
+  }
+  for(size_t i = 0; ok && i < n.count; i++) {
+    uint32_t act = n.activations[i];
+    ok = fwrite(&act, sizeof(act), 1, f) == 1;
+  }
+
+  //zeros up to the aligned start of the parameters
+  long pad = (long)h.paramOffset - ftell(f);
+  for(long i = 0; ok && i < pad; i++) {
+    ok = fputc(0, f) != EOF;
+  }
+
+  if(ok) {
+    ok = fwrite(n.params, sizeof(*n.params), n.paramCount, f) == n.paramCount;
+  }
+
+  if(fclose(f) != 0) ok = 0;
+  return ok ? 0 : -1;
+}
+
+//Checks the header and the layers of a model file
+//that has 'bytes' bytes
+static int modelCheck(const ModelHeader *h, const uint64_t *layers, uint64_t bytes) {
+  if(memcmp(h->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0) return -1;
+  if(h->version != MODEL_VERSION) return -1;
+  if(h->byteOrder != MODEL_BYTE_ORDER) return -1;
+  if(h->dtype != MODEL_DTYPE) return -1;
+  if(h->alignment != NN_ALIGN) return -1;
+  //An input layer and at least one layer of weights
+  if(h->layerCount < 2 || h->layerCount > MODEL_MAX_LAYERS) return -1;
+  if(h->paramOffset != modelParamOffset(h->layerCount)) return -1;
+  if(h->sigmoidMode > SIGMOID_TABLE) return -1;
+
+  //Every size is checked before it's used so a file can't
+  //make a count wrap around. Each width is at most
+  //paramCount after this, so the sizes of the layers of
+  //createNetwork can't wrap either.
+  size_t params = 0;
+  for(uint32_t i = 0; i < h->layerCount; i++) {
+    if(layers[i] == 0 || layers[i] > SIZE_MAX) return -1;
+    if(i == 0) continue;
+    size_t weights;
+    if(
+      __builtin_mul_overflow((size_t)layers[i-1], (size_t)layers[i], &weights) ||
+      __builtin_add_overflow(params, weights, &params) ||
+      __builtin_add_overflow(params, (size_t)layers[i], &params)
+    ) return -1;
+  }
+  if(params != h->paramCount) return -1;
+
+  size_t paramBytes, end;
+  if(
+    __builtin_mul_overflow(params, sizeof(nnfloat), &paramBytes) ||
+    __builtin_add_overflow(paramBytes, (size_t)h->paramOffset, &end)
+  ) return -1;
+  if(bytes < end) return -1;
+
+  return 0;
+}
+
+//Header and layers at the start of an open file
+static int modelReadHeader(int fd, ModelHeader *h, uint64_t **layers, uint64_t *bytes) {
+  struct stat st;
+  if(fstat(fd, &st) != 0) return -1;
+  *bytes = (uint64_t)st.st_size;
+
+  if(pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h)) return -1;
+  //Upper bound so a broken file can't ask for a huge array
+  if(
+    h->layerCount == 0 || h->layerCount > MODEL_MAX_LAYERS ||
+    h->layerCount > *bytes / sizeof(uint64_t)
+  ) return -1;
+
+  *layers = NN_MALLOC(sizeof(**layers) * h->layerCount);
+  ASSERT_NN(*layers != NULL);
+  ssize_t layerBytes = sizeof(**layers) * h->layerCount;
+  if(pread(fd, *layers, layerBytes, sizeof(*h)) != layerBytes ||
+     modelCheck(h, *layers, *bytes) != 0) {
+    NN_FREE(*layers);
+    return -1;
+  }
+
+  return 0;
+}
+
+//The layerCount - 1 activations that follow the layers
+static int modelReadActivations(int fd, const ModelHeader *h, ActivationType *acts) {
+  ssize_t actBytes = sizeof(uint32_t) * (h->layerCount - 1);
+  uint32_t *stored = NN_MALLOC(actBytes);
+  ASSERT_NN(stored != NULL);
+  off_t offset = sizeof(*h) + sizeof(uint64_t) * h->layerCount;
+
+  int result = pread(fd, stored, actBytes, offset) == actBytes ? 0 : -1;
+  for(uint32_t i = 0; result == 0 && i + 1 < h->layerCount; i++) {
+    if(stored[i] >= ACT_COUNT) result = -1;
+    else acts[i] = (ActivationType)stored[i];
+  }
+  NN_FREE(stored);
+  return result;
+}
+
+//The layers as the model array of createNetwork. Free it
+//with NN_FREE.
+static size_t *modelLayers(const ModelHeader *h, uint64_t *layers) {
+  size_t *nModel = NN_MALLOC(sizeof(*nModel) * h->layerCount);
+  ASSERT_NN(nModel != NULL);
+  for(uint32_t i = 0; i < h->layerCount; i++) {
+    nModel[i] = layers[i];
+  }
+  NN_FREE(layers);
+  return nModel;
+}
+
+int loadNetwork(const char *path, size_t batch, NeuralNetwork *n) {
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return -1;
+
+  ModelHeader h;
+  uint64_t *layers;
+  uint64_t bytes;
+  if(modelReadHeader(fd, &h, &layers, &bytes) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  size_t *nModel = modelLayers(&h, layers);
+  NeuralNetwork nn = createBatchNetwork(nModel, h.layerCount, batch);
+  NN_FREE(nModel);
+  nn.sigmoidMode = (SigmoidMode)h.sigmoidMode;
+
+  ssize_t paramBytes = sizeof(nnfloat) * h.paramCount;
+  if(modelReadActivations(fd, &h, nn.activations) != 0 ||
+     pread(fd, nn.params, paramBytes, h.paramOffset) != paramBytes) {
+    destroyNetwork(nn);
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+  *n = nn;
+  return 0;
+}
+
+int mapNetwork(const char *path, size_t batch, NeuralNetwork *n) {
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return -1;
+
+  ModelHeader h;
+  uint64_t *layers;
+  uint64_t bytes;
+  if(modelReadHeader(fd, &h, &layers, &bytes) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  size_t *nModel = modelLayers(&h, layers);
+  ActivationType *acts = NN_MALLOC(sizeof(*acts) * (h.layerCount - 1));
+  ASSERT_NN(acts != NULL);
+  if(modelReadActivations(fd, &h, acts) != 0) {
+    NN_FREE(nModel);
+    NN_FREE(acts);
+    close(fd);
+    return -1;
+  }
+
+  //Private and writable. Pages are shared with the page
+  //cache until the network writes to them.
+  size_t mapBytes = h.paramOffset + sizeof(nnfloat) * h.paramCount;
+  char *map = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    NN_FREE(nModel);
+    NN_FREE(acts);
+    return -1;
+  }
+
+  NeuralNetwork nn = createNetworkWithParams(
+    nModel, h.layerCount, batch, (nnfloat *)(map + h.paramOffset)
+  );
+  nn.sigmoidMode = (SigmoidMode)h.sigmoidMode;
+  memcpy(nn.activations, acts, sizeof(*acts) * nn.count);
+  NN_FREE(nModel);
+  NN_FREE(acts);
+
+  *n = nn;
+  return 0;
+}
+
+void unmapNetwork(NeuralNetwork n) {
+  //The parameters start at a fixed offset from the start
+  //of the mapping
+  uint64_t offset = modelParamOffset(n.count + 1);
+  char *map = (char *)n.params - offset;
+  munmap(map, offset + sizeof(nnfloat) * n.paramCount);
+  destroyNetwork(n);
+}
+
+#endif
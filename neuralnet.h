@@ -12,6 +12,32 @@ typedef struct {
   Matrix *weights;
   Matrix *biases;
 
+  //Accuracy of the sigmoid that forwardNetwork uses.
+  //SIGMOID_EXACT by default.
+  SigmoidMode sigmoidMode;
+  //activations[i] is the activation of layers[i+1].
+  //ACT_SIGMOID by default. See activation.h.
+  ActivationType *activations;
+
+  //Every weight and bias of the network back to back:
+  //weights[0], biases[0], weights[1], biases[1], ...
+  //The weights and biases matrices point inside this array.
+  nnfloat *params;
+  size_t paramCount;
+
+  //Two blocks of SIMD_MAX_LANES samples of the widest
+  //layer that forwardLanes activates a group in
+  nnacc *lanes;
+
+  //One allocation holds the matrix arrays, the parameters
+  //and the layers. 'arena' is the pointer returned by
+  //NN_MALLOC and 'arenaBytes' is the size that was asked.
+  //Networks made by createSharedNetwork or
+  //createNetworkWithParams don't have the parameters
+  //in their arena.
+  void *arena;
+  size_t arenaBytes;
+
 } NeuralNetwork;
 
 /*
@@ -20,10 +46,61 @@ typedef struct {
   size_t modelCount = length of model array
 */
 NeuralNetwork createNetwork(size_t *nModel, size_t modelCount);
+/*
+  Same as createNetwork but every layer has 'batch' rows.
+  Each row of a layer is one sample, so forwardNetwork
+  can run 'batch' samples with one matrix product per layer.
+*/
+NeuralNetwork createBatchNetwork(size_t *nModel, size_t modelCount, size_t batch);
+/*
+  Creates a network with its own layers that uses the
+  weights and biases of 'n'. Changes to the parameters of
+  'n' are seen by the new network. 'n' must outlive it.
+  The sigmoid mode of 'n' is copied.
+*/
+NeuralNetwork createSharedNetwork(NeuralNetwork n, size_t batch);
+/*
+  Creates a network whose weights and biases point inside
+  'params' instead of its own arena. 'params' holds
+  paramCount numbers in the order of NeuralNetwork.params
+  and must outlive the network.
+*/
+NeuralNetwork createNetworkWithParams(
+  size_t *nModel, size_t modelCount, size_t batch, nnfloat *params
+);
+//New network with the same model, batch, parameters and
+//sigmoid mode as 'n'. Nothing is shared with 'n'.
+NeuralNetwork cloneNetwork(NeuralNetwork n);
 void printNetwork(NeuralNetwork n, const char *name);
+//randNetworkSeed on the seed of randomSeed and a new stream
 void randNetwork(NeuralNetwork n, float rStart, float rEnd);
+//Parameter k is number k of the stream, so the same seed
+//and stream give the same network with any batch size
+void randNetworkSeed(
+  NeuralNetwork n, float rStart, float rEnd, uint64_t seed, uint64_t stream
+);
+//Row of all the parameters, for randMatrixRange
+Matrix networkParams(NeuralNetwork n);
 void forwardNetwork(NeuralNetwork n);
+//forward only the first 'rows' rows of the layers
+void forwardBatch(NeuralNetwork n, size_t rows);
+/*
+  Activates every row of 'input' and writes the outputs to
+  the rows of 'output'. The layers of 'n' are not used.
+  simdLanes() samples go through the network together: they
+  are transposed so each neuron of a layer is one vector that
+  holds that neuron for every sample of the group. Narrow
+  layers then fill the vectors, which a row per sample can't.
+  The groups are kept in the arena of 'n', so nothing is
+  allocated but only one call at a time can use a network.
+*/
+void forwardLanes(NeuralNetwork n, Matrix input, Matrix output);
 void resetNetwork(NeuralNetwork n);
+//Frees the arena of the network. The matrices of the
+//network can't be used after this.
+void destroyNetwork(NeuralNetwork n);
+//Bytes allocated for the network
+size_t networkBytes(NeuralNetwork n);
 
 #define PRINT_NN(n) printNetwork(n, #n)
 #define INPUT_LAYER_NN(n) (n).layers[0]
@@ -31,17 +108,38 @@ void resetNetwork(NeuralNetwork n);
 //already reduced by one when our neural network
 //is initialized
 #define OUTPUT_LAYER_NN(n) (n).layers[(n).count]
+//Number of samples that the layers can hold
+#define BATCH_NN(n) INPUT_LAYER_NN(n).rows
+
+//Alignment in bytes of every block in the arena of a
+//network. 64 is the size of a cache line and of an
+//AVX-512 register.
+#define NN_ALIGN 64
 
 #endif
 
 
 #ifdef NEURAL_NET_IMPL
 
+#include <string.h>
+
 void randNetwork(NeuralNetwork n, float rStart, float rEnd) {
-  for(size_t i = 0; i < n.count; i++) {
-    randMatrix(n.weights[i], rStart, rEnd);
-    randMatrix(n.biases[i], rStart, rEnd);
-  }
+  randNetworkSeed(n, rStart, rEnd, randomCurrentSeed(), randomNextStream());
+}
+
+void randNetworkSeed(
+  NeuralNetwork n, float rStart, float rEnd, uint64_t seed, uint64_t stream
+) {
+  randMatrixSeed(networkParams(n), rStart, rEnd, seed, stream);
+}
+
+Matrix networkParams(NeuralNetwork n) {
+  return (Matrix){
+    .rows = 1,
+    .cols = n.paramCount,
+    .stride = n.paramCount,
+    .start = n.params
+  };
 }
 
 void printNetwork(NeuralNetwork n, const char *name) {
@@ -61,31 +159,100 @@ void printNetwork(NeuralNetwork n, const char *name) {
 }
 
 NeuralNetwork createNetwork(size_t *nModel, size_t modelCount) {
+  return createBatchNetwork(nModel, modelCount, 1);
+}
+
+//Round up to the next multiple of NN_ALIGN
+static size_t alignNN(size_t bytes) {
+  return (bytes + NN_ALIGN - 1) & ~(size_t)(NN_ALIGN - 1);
+}
+
+static Matrix arenaMatrix(nnfloat *start, size_t rows, size_t cols) {
+  return (Matrix){
+    .rows = rows,
+    .cols = cols,
+    .stride = cols,
+    .start = start
+  };
+}
+
+//If 'params' is NULL the network gets its own parameters.
+//Otherwise the parameters are not part of the arena and
+//the weights and biases point inside 'params'.
+static NeuralNetwork allocNetwork(
+  size_t *nModel, size_t modelCount, size_t batch, nnfloat *params
+) {
   NeuralNetwork nn;
 
   ASSERT_NN(modelCount > 0);
+  ASSERT_NN(batch > 0);
 
   nn.count = modelCount - 1;
+  nn.sigmoidMode = SIGMOID_EXACT;
+
+  /*
+    The arena is split into three blocks and each block
+    starts at a multiple of NN_ALIGN:
+    1. the weights, biases and layers Matrix arrays and
+       the activations
+    2. the parameters. Weights and biases of each layer
+       are next to each other.
+    3. the layers. Each layer starts at its own alignment.
+    4. the two lane blocks of forwardLanes
+  */
+  size_t matrixBytes = sizeof(Matrix) * (nn.count * 2 + modelCount);
+  size_t headerBytes = 
+    alignNN(matrixBytes + sizeof(ActivationType) * nn.count);
+
+  nn.paramCount = 0;
+  for(size_t i = 1; i < modelCount; i++) {
+    nn.paramCount += nModel[i-1] * nModel[i] + nModel[i];
+  }
+  size_t paramBytes = 
+    params == NULL ? alignNN(sizeof(nnfloat) * nn.paramCount) : 0;
+
+  size_t layerBytes = 0;
+  size_t width = 0;
+  for(size_t i = 0; i < modelCount; i++) {
+    layerBytes += alignNN(sizeof(nnfloat) * batch * nModel[i]);
+    if(nModel[i] > width) width = nModel[i];
+  }
+  size_t laneBytes = 2 * alignNN(sizeof(nnacc) * width * SIMD_MAX_LANES);
+
+  //NN_MALLOC doesn't promise any alignment so extra
+  //bytes are asked to move the start of the arena to
+  //the next multiple of NN_ALIGN.
+  nn.arenaBytes = headerBytes + paramBytes + layerBytes + laneBytes + NN_ALIGN - 1;
+  nn.arena = NN_MALLOC(nn.arenaBytes);
+  ASSERT_NN(nn.arena != NULL);
+
+  char *cursor = (char *)alignNN((size_t)nn.arena);
+  memset(cursor, 0, headerBytes + paramBytes + layerBytes + laneBytes);
+
   //Create an array of weights excluding the input layer.
   //hidden and output layers are required to have weights
   //because they are neurons.
-  nn.weights = NN_MALLOC(sizeof(*nn.weights) * nn.count);
-  ASSERT_NN(nn.weights != NULL);
-
+  nn.weights = (Matrix *)cursor;
   //Create an array of biases excluding the input layer
   //hidden and output layers are required to have biases
   //because they are neurons.
-  nn.biases = NN_MALLOC(sizeof(*nn.biases) * nn.count);
-  ASSERT_NN(nn.biases != NULL);
-
+  nn.biases = nn.weights + nn.count;
   //Create an array of layers of neural network. This
   //includes input, hidden and output layers
-  nn.layers = NN_MALLOC(sizeof(*nn.layers) * modelCount);
-  ASSERT_NN(nn.layers != NULL);
+  nn.layers = nn.biases + nn.count;
+  //All 0, which is ACT_SIGMOID
+  nn.activations = (ActivationType *)(cursor + matrixBytes);
+  cursor += headerBytes;
+
+  nn.params = params == NULL ? (nnfloat *)cursor : params;
+  cursor += paramBytes;
 
-  //Set input layer and number of inputs
-  nn.layers[0] = matrixAlloc(1, nModel[0]);
+  //Set input layer and number of inputs. Each row
+  //holds the inputs of one sample.
+  nn.layers[0] = arenaMatrix((nnfloat *)cursor, batch, nModel[0]);
+  cursor += alignNN(sizeof(nnfloat) * batch * nModel[0]);
 
+  nnfloat *param = nn.params;
   for(size_t i = 1; i < modelCount; i++) {
     //weights matrix rows must be equal to their corresponding
     //input layers in order to make dot product work. In order to create
@@ -96,34 +263,172 @@ NeuralNetwork createNetwork(size_t *nModel, size_t modelCount) {
     //to neuron. For example, 2x2 weight metrix is equal to two neurons
     //with two inputs in input layer. Each neuron has a connection to
     //each input and the connections contain the weights.
-    nn.weights[i-1] = matrixAlloc(nn.layers[i-1].cols, nModel[i]);
+    nn.weights[i-1] = arenaMatrix(param, nModel[i-1], nModel[i]);
+    param += nModel[i-1] * nModel[i];
     //Biases is always a single row. Each neuron has one bias.
-    nn.biases[i-1] = matrixAlloc(1, nModel[i]);
+    nn.biases[i-1] = arenaMatrix(param, 1, nModel[i]);
+    param += nModel[i];
     //set hidden layers
-    nn.layers[i] = matrixAlloc(1, nModel[i]);
+    nn.layers[i] = arenaMatrix((nnfloat *)cursor, batch, nModel[i]);
+    cursor += alignNN(sizeof(nnfloat) * batch * nModel[i]);
   }
 
+  nn.lanes = (nnacc *)cursor;
+
   return nn;
 }
 
+NeuralNetwork createBatchNetwork(size_t *nModel, size_t modelCount, size_t batch) {
+  return allocNetwork(nModel, modelCount, batch, NULL);
+}
+
+NeuralNetwork createSharedNetwork(NeuralNetwork n, size_t batch) {
+  size_t nModel[n.count + 1];
+  for(size_t i = 0; i <= n.count; i++) {
+    nModel[i] = n.layers[i].cols;
+  }
+  NeuralNetwork s = createNetworkWithParams(nModel, n.count + 1, batch, n.params);
+  s.sigmoidMode = n.sigmoidMode;
+  memcpy(s.activations, n.activations, sizeof(*n.activations) * n.count);
+  return s;
+}
+
+NeuralNetwork createNetworkWithParams(
+  size_t *nModel, size_t modelCount, size_t batch, nnfloat *params
+) {
+  ASSERT_NN(params != NULL);
+  return allocNetwork(nModel, modelCount, batch, params);
+}
+
+NeuralNetwork cloneNetwork(NeuralNetwork n) {
+  size_t nModel[n.count + 1];
+  for(size_t i = 0; i <= n.count; i++) {
+    nModel[i] = n.layers[i].cols;
+  }
+
+  NeuralNetwork c = createBatchNetwork(nModel, n.count + 1, BATCH_NN(n));
+  memcpy(c.params, n.params, sizeof(*n.params) * n.paramCount);
+  c.sigmoidMode = n.sigmoidMode;
+  memcpy(c.activations, n.activations, sizeof(*n.activations) * n.count);
+  return c;
+}
+
+void destroyNetwork(NeuralNetwork n) {
+  NN_FREE(n.arena);
+}
+
+size_t networkBytes(NeuralNetwork n) {
+  return n.arenaBytes;
+}
+
 void forwardNetwork(NeuralNetwork n) {
+  forwardBatch(n, BATCH_NN(n));
+}
+
+void forwardBatch(NeuralNetwork n, size_t rows) {
+  PROFILE_FUNC(PROFILE_FORWARD_NETWORK);
+  ASSERT_NN(rows <= BATCH_NN(n));
 
   /*
     At 0, we multiply input layer with weights and
     then store the value to the next layer which is
     the hidden layer. Then, add each neuron's bias
     to each product of the previous operation and
-    then use activation function to each result in
-    order to clamp values from 0 to 1.
+    then use the activation function of the layer to
+    each result, like the sigmoid that clamps values
+    from 0 to 1.
 
     At next iteration, we multiply the previous result
     with the next set of weights and then add biases
     and activation function and repeat.
+
+    Every row of a layer is a separate sample. The
+    biases are added to each row.
+
+    denseForward does the three steps in one pass. Define
+    NN_NO_FUSE to use the separate matrix functions.
   */
   for(size_t i = 0; i < n.count; i++) {
-    matrixDot(n.layers[i+1], n.layers[i], n.weights[i]);
-    matrixSum(n.layers[i+1], n.biases[i]);
-    applySigmoid(n.layers[i+1]);
+    Matrix dst = getMatrixRows(n.layers[i+1], 0, rows);
+    Matrix src = getMatrixRows(n.layers[i], 0, rows);
+#ifdef NN_NO_FUSE
+    matrixDot(dst, src, n.weights[i]);
+    matrixSumRow(dst, n.biases[i]);
+    applyActivation(dst, n.activations[i], n.sigmoidMode);
+#else
+    activationDense(dst, src, n.weights[i], n.biases[i], n.activations[i], n.sigmoidMode);
+#endif
+  }
+}
+
+//Scalar version of simdDenseLanes for every activation
+static void denseLanes(
+  size_t lanes, Matrix weights, Matrix biases,
+  const nnacc *in, nnacc *out, ActivationType type, SigmoidMode mode
+) {
+  for(size_t j = 0; j < weights.cols; j++) {
+    nnacc *o = &out[j*lanes];
+    for(size_t s = 0; s < lanes; s++) {
+      o[s] = biases.start[getCell(biases, 0, j)];
+    }
+    for(size_t p = 0; p < weights.rows; p++) {
+      nnacc w = weights.start[getCell(weights, p, j)];
+      for(size_t s = 0; s < lanes; s++) {
+        o[s] += in[p*lanes + s] * w;
+      }
+    }
+  }
+  getActivation(type)->forward(out, weights.cols*lanes, mode);
+}
+
+void forwardLanes(NeuralNetwork n, Matrix input, Matrix output) {
+  ASSERT_NN(input.rows == output.rows);
+  ASSERT_NN(input.cols == INPUT_LAYER_NN(n).cols);
+  ASSERT_NN(output.cols == OUTPUT_LAYER_NN(n).cols);
+
+  size_t lanes = simdLanes();
+  size_t width = 0;
+  for(size_t i = 0; i <= n.count; i++) {
+    if(n.layers[i].cols > width) width = n.layers[i].cols;
+  }
+
+  //Two layers of one group from the arena. The vectors
+  //are loaded with aligned loads.
+  ASSERT_NN(lanes <= SIMD_MAX_LANES);
+  nnacc *bufA = n.lanes;
+  nnacc *bufB = (nnacc *)((char *)bufA + alignNN(sizeof(nnacc) * width * SIMD_MAX_LANES));
+
+  for(size_t first = 0; first < input.rows; first += lanes) {
+    size_t rows = input.rows - first < lanes ? input.rows - first : lanes;
+    nnacc *in = bufA;
+    nnacc *out = bufB;
+
+    //Lanes past the last row are 0 and thrown away
+    for(size_t p = 0; p < input.cols; p++) {
+      for(size_t s = 0; s < lanes; s++) {
+        in[p*lanes + s] = s < rows ? input.start[getCell(input, first + s, p)] : 0;
+      }
+    }
+
+    for(size_t i = 0; i < n.count; i++) {
+      Matrix w = n.weights[i];
+      //The vector kernels fuse the sigmoid only
+#ifdef NN_FLOAT32
+      if(n.activations[i] != ACT_SIGMOID || !simdDenseLanes(
+        w.cols, w.rows, in, w.start, w.stride, n.biases[i].start, out, n.sigmoidMode
+      ))
+#endif
+      denseLanes(lanes, w, n.biases[i], in, out, n.activations[i], n.sigmoidMode);
+      nnacc *tmp = in;
+      in = out;
+      out = tmp;
+    }
+
+    for(size_t s = 0; s < rows; s++) {
+      for(size_t j = 0; j < output.cols; j++) {
+        output.start[getCell(output, first + s, j)] = in[j*lanes + s];
+      }
+    }
   }
 }
 
@@ -134,7 +439,8 @@ void resetNetwork(NeuralNetwork n) {
     fillMatrix(n.biases[i], 0);
     fillMatrix(n.layers[i], 0);
   }
-  fillMatrix(n.weights[n.count], 0);
+  //layers has one more element than weights and biases
+  fillMatrix(n.layers[n.count], 0);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,312 @@
+#include <stddef.h>
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+/*
+  How the gradient is turned into an update of the
+  parameters. 'g' is the gradient of a parameter 'p',
+  'rate' is the learning rate.
+
+  OPT_SGD = p -= rate*g. Same as trainNetwork.
+  OPT_MOMENTUM = v = beta1*v + g; p -= rate*v
+  OPT_NESTEROV = v = beta1*v + g; p -= rate*(g + beta1*v)
+  OPT_RMSPROP = s = beta2*s + (1-beta2)*g*g;
+    p -= rate*g/(sqrt(s) + eps)
+  OPT_ADAM = m = beta1*m + (1-beta1)*g;
+    v = beta2*v + (1-beta2)*g*g;
+    p -= rate*m'/(sqrt(v') + eps) where m' and v' are m and
+    v divided by 1 - beta^step to remove the bias of their
+    start at 0.
+*/
+typedef enum {
+  OPT_SGD = 0,
+  OPT_MOMENTUM,
+  OPT_NESTEROV,
+  OPT_RMSPROP,
+  OPT_ADAM
+} OptimizerType;
+
+typedef struct {
+  OptimizerType type;
+  float rate;
+  float beta1;
+  float beta2;
+  float eps;
+  //updates done so far. Adam uses it for the bias correction.
+  size_t step;
+
+  //State of every parameter, in the order of
+  //NeuralNetwork.params so an update is one pass over
+  //three flat arrays. 'm' is the velocity of momentum and
+  //Nesterov, the average of the squared gradient of
+  //RMSProp and the first moment of Adam. 'v' is the
+  //second moment of Adam. NULL if it's not used.
+  nnacc *m;
+  nnacc *v;
+  size_t paramCount;
+
+  void *arena;
+} Optimizer;
+
+/*
+  Optimizer for the parameters of 'n' with the usual
+  defaults: beta1 = 0.9, beta2 = 0.999 (0.9 for RMSProp)
+  and eps = 1e-8. They can be changed before the first step.
+*/
+Optimizer createOptimizer(OptimizerType type, NeuralNetwork n, float rate);
+void destroyOptimizer(Optimizer o);
+//Sets the state back to 0 like a new optimizer
+void resetOptimizer(Optimizer *o);
+//Updates the parameters of 'n' with the gradient 'g'.
+//Use it in place of trainNetwork.
+void optimizerStep(Optimizer *o, NeuralNetwork n, NeuralNetwork g);
+const char *optimizerName(OptimizerType type);
+
+#endif
+
+#ifdef OPTIMIZER_IMPL
+
+#include <string.h>
+
+#ifdef NN_DOUBLE
+#define NN_SQRT sqrt
+#else
+#define NN_SQRT sqrtf
+#endif
+
+Optimizer createOptimizer(OptimizerType type, NeuralNetwork n, float rate) {
+  Optimizer o;
+  o.type = type;
+  o.rate = rate;
+  o.beta1 = 0.9f;
+  o.beta2 = type == OPT_RMSPROP ? 0.9f : 0.999f;
+  o.eps = 1e-8f;
+  o.step = 0;
+  o.paramCount = n.paramCount;
+  o.m = NULL;
+  o.v = NULL;
+  o.arena = NULL;
+
+  size_t arrays = type == OPT_SGD ? 0 : type == OPT_ADAM ? 2 : 1;
+  if(arrays == 0) return o;
+
+  //Each array starts at its own NN_ALIGN boundary
+  size_t bytes = (sizeof(nnacc) * o.paramCount + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+  o.arena = NN_MALLOC(bytes * arrays + NN_ALIGN - 1);
+  ASSERT_NN(o.arena != NULL);
+
+  char *cursor = (char *)(((size_t)o.arena + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN);
+  o.m = (nnacc *)cursor;
+  if(arrays == 2) o.v = (nnacc *)(cursor + bytes);
+
+  resetOptimizer(&o);
+  return o;
+}
+
+void destroyOptimizer(Optimizer o) {
+  NN_FREE(o.arena);
+}
+
+void resetOptimizer(Optimizer *o) {
+  o->step = 0;
+  if(o->m != NULL) memset(o->m, 0, sizeof(*o->m) * o->paramCount);
+  if(o->v != NULL) memset(o->v, 0, sizeof(*o->v) * o->paramCount);
+}
+
+const char *optimizerName(OptimizerType type) {
+  switch(type) {
+    case OPT_MOMENTUM: return "momentum";
+    case OPT_NESTEROV: return "nesterov";
+    case OPT_RMSPROP: return "rmsprop";
+    case OPT_ADAM: return "adam";
+    default: return "sgd";
+  }
+}
+
+/*
+  The update kernels below do every step of an optimizer
+  on one parameter at a time, so the parameter, the
+  gradient and the state are each read and written once.
+  'first' is where the scalar loop starts, the vector
+  versions do the parameters before it.
+
+  Adam's bias correction is folded into 'rate' and 'eps'
+  by the caller so the loop has no per step powers.
+*/
+static void optSgd(size_t first, size_t count, nnfloat *p, const nnfloat *g, float rate) {
+  for(size_t i = first; i < count; i++) {
+    p[i] -= rate*g[i];
+  }
+}
+
+static void optMomentum(
+  size_t first, size_t count, nnfloat *p, const nnfloat *g, nnacc *m,
+  float rate, float beta1, int nesterov
+) {
+  for(size_t i = first; i < count; i++) {
+    m[i] = beta1*m[i] + g[i];
+    p[i] -= nesterov ? rate*(g[i] + beta1*m[i]) : rate*m[i];
+  }
+}
+
+static void optRmsProp(
+  size_t first, size_t count, nnfloat *p, const nnfloat *g, nnacc *m,
+  float rate, float beta2, float eps
+) {
+  for(size_t i = first; i < count; i++) {
+    m[i] = beta2*m[i] + (1 - beta2)*g[i]*g[i];
+    p[i] -= rate*g[i]/(NN_SQRT(m[i]) + eps);
+  }
+}
+
+static void optAdam(
+  size_t first, size_t count, nnfloat *p, const nnfloat *g, nnacc *m, nnacc *v,
+  float rate, float beta1, float beta2, float eps
+) {
+  for(size_t i = first; i < count; i++) {
+    m[i] = beta1*m[i] + (1 - beta1)*g[i];
+    v[i] = beta2*v[i] + (1 - beta2)*g[i]*g[i];
+    p[i] -= rate*m[i]/(NN_SQRT(v[i]) + eps);
+  }
+}
+
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+
+//Each one returns the number of parameters it did, a
+//multiple of 8. The scalar kernel does the rest.
+__attribute__((target("avx2,fma")))
+static size_t optSgdAvx2(size_t count, float *p, const float *g, float rate) {
+  __m256 r = _mm256_set1_ps(rate);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 pv = _mm256_loadu_ps(&p[i]);
+    _mm256_storeu_ps(&p[i], _mm256_fnmadd_ps(r, _mm256_loadu_ps(&g[i]), pv));
+  }
+  return i;
+}
+
+__attribute__((target("avx2,fma")))
+static size_t optMomentumAvx2(
+  size_t count, float *p, const float *g, float *m,
+  float rate, float beta1, int nesterov
+) {
+  __m256 r = _mm256_set1_ps(rate);
+  __m256 b1 = _mm256_set1_ps(beta1);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 gv = _mm256_loadu_ps(&g[i]);
+    __m256 mv = _mm256_fmadd_ps(b1, _mm256_loadu_ps(&m[i]), gv);
+    __m256 step = nesterov ? _mm256_fmadd_ps(b1, mv, gv) : mv;
+    _mm256_storeu_ps(&m[i], mv);
+    _mm256_storeu_ps(&p[i], _mm256_fnmadd_ps(r, step, _mm256_loadu_ps(&p[i])));
+  }
+  return i;
+}
+
+__attribute__((target("avx2,fma")))
+static size_t optRmsPropAvx2(
+  size_t count, float *p, const float *g, float *m,
+  float rate, float beta2, float eps
+) {
+  __m256 r = _mm256_set1_ps(rate);
+  __m256 b2 = _mm256_set1_ps(beta2);
+  __m256 c2 = _mm256_set1_ps(1 - beta2);
+  __m256 e = _mm256_set1_ps(eps);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 gv = _mm256_loadu_ps(&g[i]);
+    __m256 mv = _mm256_fmadd_ps(
+      c2, _mm256_mul_ps(gv, gv), _mm256_mul_ps(b2, _mm256_loadu_ps(&m[i]))
+    );
+    __m256 step = _mm256_div_ps(gv, _mm256_add_ps(_mm256_sqrt_ps(mv), e));
+    _mm256_storeu_ps(&m[i], mv);
+    _mm256_storeu_ps(&p[i], _mm256_fnmadd_ps(r, step, _mm256_loadu_ps(&p[i])));
+  }
+  return i;
+}
+
+__attribute__((target("avx2,fma")))
+static size_t optAdamAvx2(
+  size_t count, float *p, const float *g, float *m, float *v,
+  float rate, float beta1, float beta2, float eps
+) {
+  __m256 r = _mm256_set1_ps(rate);
+  __m256 b1 = _mm256_set1_ps(beta1);
+  __m256 c1 = _mm256_set1_ps(1 - beta1);
+  __m256 b2 = _mm256_set1_ps(beta2);
+  __m256 c2 = _mm256_set1_ps(1 - beta2);
+  __m256 e = _mm256_set1_ps(eps);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 gv = _mm256_loadu_ps(&g[i]);
+    __m256 mv = _mm256_fmadd_ps(c1, gv, _mm256_mul_ps(b1, _mm256_loadu_ps(&m[i])));
+    __m256 vv = _mm256_fmadd_ps(
+      c2, _mm256_mul_ps(gv, gv), _mm256_mul_ps(b2, _mm256_loadu_ps(&v[i]))
+    );
+    __m256 step = _mm256_div_ps(mv, _mm256_add_ps(_mm256_sqrt_ps(vv), e));
+    _mm256_storeu_ps(&m[i], mv);
+    _mm256_storeu_ps(&v[i], vv);
+    _mm256_storeu_ps(&p[i], _mm256_fnmadd_ps(r, step, _mm256_loadu_ps(&p[i])));
+  }
+  return i;
+}
+
+#endif
+
+void optimizerStep(Optimizer *o, NeuralNetwork n, NeuralNetwork g) {
+  PROFILE_FUNC(PROFILE_TRAIN_NETWORK);
+  ASSERT_NN(n.paramCount == o->paramCount);
+  ASSERT_NN(g.paramCount == o->paramCount);
+
+  o->step++;
+  size_t count = o->paramCount;
+  nnfloat *p = n.params;
+  const nnfloat *grad = g.params;
+  size_t first = 0;
+
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+  int avx2 = simdIsa() >= SIMD_AVX2;
+#endif
+
+  switch(o->type) {
+    case OPT_MOMENTUM:
+    case OPT_NESTEROV: {
+      int nesterov = o->type == OPT_NESTEROV;
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+      if(avx2) first = optMomentumAvx2(count, p, grad, o->m, o->rate, o->beta1, nesterov);
+#endif
+      optMomentum(first, count, p, grad, o->m, o->rate, o->beta1, nesterov);
+      break;
+    }
+    case OPT_RMSPROP:
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+      if(avx2) first = optRmsPropAvx2(count, p, grad, o->m, o->rate, o->beta2, o->eps);
+#endif
+      optRmsProp(first, count, p, grad, o->m, o->rate, o->beta2, o->eps);
+      break;
+    case OPT_ADAM: {
+      //rate*m/(1-b1^t) / (sqrt(v/(1-b2^t)) + eps) is the same as
+      //rate*sqrt(1-b2^t)/(1-b1^t) * m / (sqrt(v) + eps*sqrt(1-b2^t))
+      float c1 = 1 - powf(o->beta1, (float)o->step);
+      float c2 = sqrtf(1 - powf(o->beta2, (float)o->step));
+      float rate = o->rate*c2/c1;
+      float eps = o->eps*c2;
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+      if(avx2) {
+        first = optAdamAvx2(count, p, grad, o->m, o->v, rate, o->beta1, o->beta2, eps);
+      }
+#endif
+      optAdam(first, count, p, grad, o->m, o->v, rate, o->beta1, o->beta2, eps);
+      break;
+    }
+    default:
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+      if(avx2) first = optSgdAvx2(count, p, grad, o->rate);
+#endif
+      optSgd(first, count, p, grad, o->rate);
+      break;
+  }
+}
+
+#endif
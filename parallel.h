@@ -0,0 +1,652 @@
+#include <pthread.h>
+#include <stdint.h>
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+//A task is called once for every index from 0 to
+//the task count given to poolRun.
+typedef void (*PoolTask)(void *ctx, size_t index);
+
+typedef struct {
+  //worker threads. The thread that calls poolRun
+  //also runs tasks so there are 'count' + 1 runners.
+  pthread_t *workers;
+  size_t count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+
+  PoolTask task;
+  void *ctx;
+  size_t taskCount;
+  //next task index that is not taken yet
+  size_t next;
+  //number of workers that haven't finished the current run
+  size_t running;
+  //incremented every time poolRun starts new tasks
+  size_t generation;
+  int stop;
+} ThreadPool;
+
+/*
+  Params:
+  threads = number of threads that run tasks including the
+  thread that calls poolRun. 1 means no worker is started.
+*/
+ThreadPool *createThreadPool(size_t threads);
+//Runs task(ctx, i) for i = 0 to count-1 and returns when
+//every task is finished.
+void poolRun(ThreadPool *pool, PoolTask task, void *ctx, size_t count);
+size_t poolThreads(ThreadPool *pool);
+void destroyThreadPool(ThreadPool *pool);
+
+/*
+  Scratch space of backPropParallel. The training rows are
+  split into 'parts' contiguous ranges and every part has
+  its own activation network and gradient network.
+  'parts' is the thread count of the pool so the result
+  only depends on the number of threads.
+*/
+typedef struct {
+  ThreadPool *pool;
+  size_t parts;
+  //activation networks. They share the parameters
+  //of the trained network.
+  NeuralNetwork *acts;
+  //gradient of each part. grads[0] is not allocated,
+  //the gradient given to backPropParallel is used.
+  NeuralNetwork *grads;
+} BackPropWorkers;
+
+/*
+  Params:
+  n = the network that is trained
+  batch = rows that are activated at once by each part
+*/
+BackPropWorkers createBackPropWorkers(ThreadPool *pool, NeuralNetwork n, size_t batch);
+void destroyBackPropWorkers(BackPropWorkers w);
+
+/*
+  Same result as backProp(n, g, tInput, tOutput) where 'n'
+  is the network the workers were made for. The gradients
+  of the parts are added with a tree reduction in a fixed
+  order, so the result is the same on every run with the
+  same thread count. With one thread the result is
+  identical to backProp. Returns the cost like backProp.
+*/
+float backPropParallel(
+  BackPropWorkers w,
+  NeuralNetwork g,
+  Matrix tInput,
+  Matrix tOutput
+);
+
+/*
+  Scratch space of computeFiniteDiffParallel: one copy of
+  the network for every thread of the pool. The parameters
+  of 'n' are copied into them at the start of every call,
+  so the same workers are used for every step.
+*/
+typedef struct {
+  ThreadPool *pool;
+  size_t parts;
+  NeuralNetwork *copies;
+} FiniteDiffWorkers;
+
+FiniteDiffWorkers createFiniteDiffWorkers(ThreadPool *pool, NeuralNetwork n);
+void destroyFiniteDiffWorkers(FiniteDiffWorkers w);
+
+/*
+  Same result as computeFiniteDiff. The parameters are split
+  into one contiguous range per thread of the pool and every
+  thread nudges its range in its own copy of 'n', so 'n' is
+  never changed. Each gradient value only depends on its own
+  parameter so the result doesn't depend on the thread count.
+  'n' is the network the workers were made for or one of the
+  same model and batch. Returns the cost like
+  computeFiniteDiff.
+*/
+float computeFiniteDiffParallel(
+  FiniteDiffWorkers w,
+  NeuralNetwork n,
+  NeuralNetwork gradient,
+  float eps,
+  Matrix ti,
+  Matrix to
+);
+
+/*
+  Same result as randMatrixSeed and randNetworkSeed. The
+  elements are split into one range per thread of the
+  pool, and every element only depends on its own index,
+  so the result doesn't depend on the thread count.
+*/
+void randMatrixParallel(
+  ThreadPool *pool, Matrix matrix, float rStart, float rEnd,
+  uint64_t seed, uint64_t stream
+);
+void randNetworkParallel(
+  ThreadPool *pool, NeuralNetwork n, float rStart, float rEnd,
+  uint64_t seed, uint64_t stream
+);
+
+/*
+  One network to train with full batch gradient descent,
+  the same loop as gates.c: backProp then trainNetwork for
+  'epochs' steps. The parameters start as random numbers
+  from 0 to 1 made from 'seed', so a job gives the same
+  network on any thread and in any order.
+*/
+typedef struct {
+  size_t *nModel;
+  size_t modelCount;
+  Matrix ti;
+  Matrix to;
+  float learnRate;
+  size_t epochs;
+  uint64_t seed;
+  SigmoidMode sigmoidMode;
+} TrainJob;
+
+typedef struct {
+  //The trained network. Its layers hold every training
+  //row. Free it with destroyNetwork.
+  NeuralNetwork n;
+  //computeCost after the last step
+  float cost;
+} TrainResult;
+
+/*
+  Trains every job and writes its result to the same index
+  of 'results'. Each runner of the pool starts with its own
+  contiguous range of jobs and takes them from the end. A
+  runner that runs out takes half of the jobs left at the
+  start of another runner's range, so jobs of very different
+  sizes still keep every thread busy. Each job has its own
+  network and gradient, nothing is shared between jobs.
+
+  Returns the number of times a runner took jobs from another.
+*/
+size_t trainJobs(ThreadPool *pool, TrainJob *jobs, size_t count, TrainResult *results);
+
+#endif
+
+#ifdef PARALLEL_IMPL
+
+//Takes task indices until there is none left
+static void poolDrain(ThreadPool *pool) {
+  for(;;) {
+    size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    if(i >= pool->taskCount) break;
+    pool->task(pool->ctx, i);
+  }
+}
+
+static void *poolWorker(void *arg) {
+  ThreadPool *pool = arg;
+
+  //Workers are started before the first poolRun so the
+  //first generation they have to wait for is 1. Reading
+  //pool->generation here could already see the first run.
+  size_t seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for(;;) {
+    while(pool->generation == seen && !pool->stop) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if(pool->stop) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    poolDrain(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running--;
+    if(pool->running == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  matrixScratchFree();
+  return NULL;
+}
+
+ThreadPool *createThreadPool(size_t threads) {
+  ASSERT_NN(threads > 0);
+
+  ThreadPool *pool = NN_MALLOC(sizeof(*pool));
+  ASSERT_NN(pool != NULL);
+  memset(pool, 0, sizeof(*pool));
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  pool->count = threads - 1;
+  pool->workers = NN_MALLOC(sizeof(*pool->workers) * (pool->count + 1));
+  ASSERT_NN(pool->workers != NULL);
+
+  for(size_t i = 0; i < pool->count; i++) {
+    int err = pthread_create(&pool->workers[i], NULL, poolWorker, pool);
+    ASSERT_NN(err == 0);
+  }
+
+  return pool;
+}
+
+void poolRun(ThreadPool *pool, PoolTask task, void *ctx, size_t count) {
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->ctx = ctx;
+  pool->taskCount = count;
+  pool->next = 0;
+  pool->running = pool->count;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  poolDrain(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while(pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+size_t poolThreads(ThreadPool *pool) {
+  return pool->count + 1;
+}
+
+void destroyThreadPool(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for(size_t i = 0; i < pool->count; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  NN_FREE(pool->workers);
+  NN_FREE(pool);
+}
+
+BackPropWorkers createBackPropWorkers(ThreadPool *pool, NeuralNetwork n, size_t batch) {
+  BackPropWorkers w;
+  w.pool = pool;
+  w.parts = poolThreads(pool);
+
+  w.acts = NN_MALLOC(sizeof(*w.acts) * w.parts);
+  ASSERT_NN(w.acts != NULL);
+  w.grads = NN_MALLOC(sizeof(*w.grads) * w.parts);
+  ASSERT_NN(w.grads != NULL);
+
+  size_t nModel[n.count + 1];
+  for(size_t i = 0; i <= n.count; i++) {
+    nModel[i] = n.layers[i].cols;
+  }
+
+  for(size_t p = 0; p < w.parts; p++) {
+    w.acts[p] = createSharedNetwork(n, batch);
+    //the gradient networks only use the first row
+    //of their layers
+    if(p > 0) w.grads[p] = createNetwork(nModel, n.count + 1);
+  }
+
+  return w;
+}
+
+void destroyBackPropWorkers(BackPropWorkers w) {
+  for(size_t p = 0; p < w.parts; p++) {
+    destroyNetwork(w.acts[p]);
+    if(p > 0) destroyNetwork(w.grads[p]);
+  }
+  NN_FREE(w.acts);
+  NN_FREE(w.grads);
+}
+
+typedef struct {
+  BackPropWorkers w;
+  Matrix tInput;
+  Matrix tOutput;
+  //distance between the two gradients that are added
+  //in the current level of the reduction
+  size_t step;
+  //squared error of the rows of each part
+  nnacc *costs;
+} BackPropTask;
+
+//Rows of 'part' are [first, first + count). Also used
+//to split the parameters between threads.
+static void partRows(size_t rows, size_t parts, size_t part, size_t *first, size_t *count) {
+  size_t base = rows / parts;
+  size_t extra = rows % parts;
+  *first = part * base + (part < extra ? part : extra);
+  *count = base + (part < extra ? 1 : 0);
+}
+
+static void backPropPart(void *ctx, size_t p) {
+  BackPropTask *t = ctx;
+  NeuralNetwork n = t->w.acts[p];
+  NeuralNetwork g = t->w.grads[p];
+  size_t batch = BATCH_NN(n);
+
+  size_t first, count;
+  partRows(t->tInput.rows, t->w.parts, p, &first, &count);
+
+  resetNetwork(g);
+  t->costs[p] = 0;
+
+  //Same loop as backProp but only over the rows of this part
+  for(size_t i = 0; i < count; i += batch) {
+    size_t rows = count - i < batch ? count - i : batch;
+    matrixCopy(
+      getMatrixRows(INPUT_LAYER_NN(n), 0, rows),
+      getMatrixRows(t->tInput, first + i, rows)
+    );
+    forwardBatch(n, rows);
+
+    for(size_t s = 0; s < rows; s++) {
+      t->costs[p] += backPropSample(n, g, s, getMatrixRow(t->tOutput, first + i + s));
+    }
+  }
+}
+
+//Adds the gradient of part 'p + step' to part 'p'. Task 'i'
+//of a level handles part i*2*step.
+static void reduceParts(void *ctx, size_t i) {
+  BackPropTask *t = ctx;
+  size_t p = i * 2 * t->step;
+  nnfloat *dst = t->w.grads[p].params;
+  nnfloat *src = t->w.grads[p + t->step].params;
+
+  for(size_t k = 0; k < t->w.grads[p].paramCount; k++) {
+    dst[k] += src[k];
+  }
+}
+
+float backPropParallel(
+  BackPropWorkers w,
+  NeuralNetwork g,
+  Matrix tInput,
+  Matrix tOutput
+) {
+  PROFILE_FUNC(PROFILE_BACK_PROP);
+  ASSERT_NN(tInput.rows == tOutput.rows);
+  ASSERT_NN(OUTPUT_LAYER_NN(g).cols == tOutput.cols);
+  ASSERT_NN(g.paramCount == w.acts[0].paramCount);
+
+  w.grads[0] = g;
+  nnacc costs[w.parts];
+  BackPropTask t = {
+    .w = w,
+    .tInput = tInput,
+    .tOutput = tOutput,
+    .step = 0,
+    .costs = costs
+  };
+
+  poolRun(w.pool, backPropPart, &t, w.parts);
+
+  //Pairs are always added in the same order: 0+1, 2+3, ...
+  //then 0+2, 4+6, ... until everything is in part 0.
+  for(t.step = 1; t.step < w.parts; t.step *= 2) {
+    size_t pairs = (w.parts - t.step + 2*t.step - 1) / (2*t.step);
+    poolRun(w.pool, reduceParts, &t, pairs);
+  }
+
+  //Added in part order so the cost is the same on every run
+  nnacc costVal = 0;
+  for(size_t p = 0; p < w.parts; p++) {
+    costVal += costs[p];
+  }
+
+  averageGradient(g, tInput.rows);
+  return costVal/tInput.rows;
+}
+
+typedef struct {
+  NeuralNetwork *copies;
+  size_t parts;
+  NeuralNetwork gradient;
+  float eps;
+  nnacc costVal;
+  Matrix ti;
+  Matrix to;
+} FiniteDiffTask;
+
+static void finiteDiffPart(void *ctx, size_t p) {
+  FiniteDiffTask *t = ctx;
+  NeuralNetwork n = t->copies[p];
+
+  size_t first, count;
+  partRows(n.paramCount, t->parts, p, &first, &count);
+
+  //Same steps as computeGradient. The flat parameter
+  //array has the same layout in every network of the
+  //same model so index k is the same parameter in the
+  //copy and in the gradient.
+  for(size_t k = first; k < first + count; k++) {
+    nnfloat saved = n.params[k];
+    n.params[k] += t->eps;
+    t->gradient.params[k] = 
+      (computeCost(n, t->ti, t->to) - t->costVal)/t->eps;
+    n.params[k] = saved;
+  }
+}
+
+FiniteDiffWorkers createFiniteDiffWorkers(ThreadPool *pool, NeuralNetwork n) {
+  FiniteDiffWorkers w;
+  w.pool = pool;
+  w.parts = poolThreads(pool);
+
+  w.copies = NN_MALLOC(sizeof(*w.copies) * w.parts);
+  ASSERT_NN(w.copies != NULL);
+  for(size_t p = 0; p < w.parts; p++) {
+    w.copies[p] = cloneNetwork(n);
+  }
+
+  return w;
+}
+
+void destroyFiniteDiffWorkers(FiniteDiffWorkers w) {
+  for(size_t p = 0; p < w.parts; p++) {
+    destroyNetwork(w.copies[p]);
+  }
+  NN_FREE(w.copies);
+}
+
+float computeFiniteDiffParallel(
+  FiniteDiffWorkers w,
+  NeuralNetwork n,
+  NeuralNetwork gradient,
+  float eps,
+  Matrix ti,
+  Matrix to
+) {
+  ASSERT_NN(gradient.paramCount == n.paramCount);
+  ASSERT_NN(w.copies[0].paramCount == n.paramCount);
+  ASSERT_NN(BATCH_NN(w.copies[0]) == BATCH_NN(n));
+
+  //The copies start from the current parameters of 'n'
+  for(size_t p = 0; p < w.parts; p++) {
+    NeuralNetwork c = w.copies[p];
+    memcpy(c.params, n.params, sizeof(*n.params) * n.paramCount);
+    c.sigmoidMode = n.sigmoidMode;
+    memcpy(c.activations, n.activations, sizeof(*n.activations) * n.count);
+    w.copies[p] = c;
+  }
+
+  FiniteDiffTask t = {
+    .copies = w.copies,
+    .parts = w.parts,
+    .gradient = gradient,
+    .eps = eps,
+    //Initial cost
+    .costVal = computeCost(n, ti, to),
+    .ti = ti,
+    .to = to
+  };
+
+  poolRun(w.pool, finiteDiffPart, &t, t.parts);
+  return t.costVal;
+}
+
+typedef struct {
+  Matrix matrix;
+  size_t parts;
+  float rStart;
+  float rEnd;
+  uint64_t seed;
+  uint64_t stream;
+} RandTask;
+
+static void randPart(void *ctx, size_t p) {
+  RandTask *t = ctx;
+  size_t first, count;
+  partRows(t->matrix.rows*t->matrix.cols, t->parts, p, &first, &count);
+  randMatrixRange(
+    t->matrix, t->rStart, t->rEnd, t->seed, t->stream, first, count
+  );
+}
+
+void randMatrixParallel(
+  ThreadPool *pool, Matrix matrix, float rStart, float rEnd,
+  uint64_t seed, uint64_t stream
+) {
+  RandTask t = {
+    .matrix = matrix,
+    .parts = poolThreads(pool),
+    .rStart = rStart,
+    .rEnd = rEnd,
+    .seed = seed,
+    .stream = stream
+  };
+  poolRun(pool, randPart, &t, t.parts);
+}
+
+void randNetworkParallel(
+  ThreadPool *pool, NeuralNetwork n, float rStart, float rEnd,
+  uint64_t seed, uint64_t stream
+) {
+  randMatrixParallel(pool, networkParams(n), rStart, rEnd, seed, stream);
+}
+
+//Jobs [head, tail) of one runner. The runner takes jobs
+//from the tail and other runners take from the head.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+} JobQueue;
+
+typedef struct {
+  TrainJob *jobs;
+  TrainResult *results;
+  JobQueue *queues;
+  size_t parts;
+  size_t steals;
+} TrainTask;
+
+static void runTrainJob(TrainJob *job, TrainResult *result) {
+  NeuralNetwork n = createBatchNetwork(job->nModel, job->modelCount, job->ti.rows);
+  NeuralNetwork g = createNetwork(job->nModel, job->modelCount);
+  n.sigmoidMode = job->sigmoidMode;
+
+  //Same range as randNetwork(n, 0, 1). Each job has its
+  //own seed so the global one isn't used.
+  randNetworkSeed(n, 0, 1, job->seed, 0);
+
+  for(size_t i = 0; i < job->epochs; i++) {
+    trainStep(n, g, job->ti, job->to, job->learnRate);
+  }
+
+  result->n = n;
+  result->cost = computeCost(n, job->ti, job->to);
+  destroyNetwork(g);
+}
+
+//Next job of 'q' taken from its tail. Returns 0 if it's empty.
+static int popJob(JobQueue *q, size_t *job) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if(q->head < q->tail) {
+    *job = --q->tail;
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+//Moves half of the jobs of another queue, rounded up, to
+//queue 'p'. Returns 0 if every other queue is empty.
+static int stealJobs(TrainTask *t, size_t p) {
+  for(size_t i = 1; i < t->parts; i++) {
+    JobQueue *victim = &t->queues[(p + i) % t->parts];
+
+    pthread_mutex_lock(&victim->lock);
+    size_t left = victim->tail - victim->head;
+    size_t first = victim->head;
+    size_t take = (left + 1) / 2;
+    victim->head += take;
+    pthread_mutex_unlock(&victim->lock);
+
+    if(take > 0) {
+      JobQueue *own = &t->queues[p];
+      pthread_mutex_lock(&own->lock);
+      own->head = first;
+      own->tail = first + take;
+      pthread_mutex_unlock(&own->lock);
+      __atomic_fetch_add(&t->steals, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void trainPart(void *ctx, size_t p) {
+  TrainTask *t = ctx;
+  size_t job;
+
+  for(;;) {
+    while(popJob(&t->queues[p], &job)) {
+      runTrainJob(&t->jobs[job], &t->results[job]);
+    }
+    if(!stealJobs(t, p)) break;
+  }
+}
+
+size_t trainJobs(ThreadPool *pool, TrainJob *jobs, size_t count, TrainResult *results) {
+  TrainTask t = {
+    .jobs = jobs,
+    .results = results,
+    .parts = poolThreads(pool),
+    .steals = 0
+  };
+
+  t.queues = NN_MALLOC(sizeof(*t.queues) * t.parts);
+  ASSERT_NN(t.queues != NULL);
+  for(size_t p = 0; p < t.parts; p++) {
+    size_t first, len;
+    partRows(count, t.parts, p, &first, &len);
+    pthread_mutex_init(&t.queues[p].lock, NULL);
+    t.queues[p].head = first;
+    t.queues[p].tail = first + len;
+  }
+
+  poolRun(pool, trainPart, &t, t.parts);
+
+  for(size_t p = 0; p < t.parts; p++) {
+    pthread_mutex_destroy(&t.queues[p].lock);
+  }
+  NN_FREE(t.queues);
+  return t.steals;
+}
+
+#endif
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+  Call counts and time spent in the hot functions of the
+  training loop. Compile with -DNN_PROFILE to turn it on.
+  Without NN_PROFILE the PROFILE_FUNC lines in the other
+  headers expand to nothing, so a normal build has no
+  instrumentation at all.
+
+  -DNN_PROFILE_PERF also counts CPU cycles and instructions
+  with perf_event_open (Linux only). Reading the counters
+  is a system call, so this is slower than timing only.
+
+  This header must be included before matrix.h. If it isn't,
+  matrix.h turns PROFILE_FUNC into nothing by itself.
+*/
+
+#if defined(NN_PROFILE_PERF) && !defined(NN_PROFILE)
+#define NN_PROFILE
+#endif
+
+typedef enum {
+  PROFILE_MATRIX_DOT,
+  PROFILE_MATRIX_SUM,
+  PROFILE_APPLY_SIGMOID,
+  PROFILE_MATRIX_COPY,
+  PROFILE_DENSE_FORWARD,
+  //forwardBatch. forwardNetwork and computeCost use it.
+  PROFILE_FORWARD_NETWORK,
+  PROFILE_COMPUTE_COST,
+  //backProp, backPropRows and backPropParallel. The
+  //worker threads of backPropParallel are counted in the
+  //functions they call, so its self time is mostly waiting.
+  PROFILE_BACK_PROP,
+  PROFILE_TRAIN_NETWORK,
+  PROFILE_COUNT
+} ProfileId;
+
+typedef struct {
+  uint64_t calls;
+  //time from the start to the end of every call
+  uint64_t totalNs;
+  //totalNs without the time of the other profiled
+  //functions that were called inside it
+  uint64_t selfNs;
+  //0 without NN_PROFILE_PERF
+  uint64_t cycles;
+  uint64_t instructions;
+} ProfileCounter;
+
+//Prints a table with one row per function
+void profileReport(FILE *f);
+void profileReset(void);
+//Counter of one function. All zeros without NN_PROFILE.
+ProfileCounter profileCounter(ProfileId id);
+
+#ifdef NN_PROFILE
+
+//State of one call that is being profiled
+typedef struct {
+  ProfileId id;
+  uint64_t startNs;
+  //profileChildNs when the call started
+  uint64_t childNs;
+  uint64_t cycles;
+  uint64_t instructions;
+} ProfileMark;
+
+ProfileMark profileStart(ProfileId id);
+void profileStop(ProfileMark *mark);
+
+//Put at the start of a function. The call is recorded when
+//the function returns, also from an early return.
+#define PROFILE_FUNC(id) \
+  ProfileMark profileMark __attribute__((cleanup(profileStop))) = profileStart(id)
+
+#else
+
+#define PROFILE_FUNC(id)
+
+#endif
+
+#endif
+
+#ifdef PROFILE_IMPL
+
+#include <string.h>
+#include <time.h>
+
+#ifdef NN_PROFILE
+
+static const char *profileNames[PROFILE_COUNT] = {
+  "matrixDot",
+  "matrixSum",
+  "applySigmoid",
+  "matrixCopy",
+  "denseForward",
+  "forwardNetwork",
+  "computeCost",
+  "backProp",
+  "trainNetwork"
+};
+
+static ProfileCounter profileCounters[PROFILE_COUNT];
+
+//Time of the profiled calls that finished inside the call
+//that is running on this thread
+static __thread uint64_t profileChildNs;
+
+#ifdef NN_PROFILE_PERF
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+//Counters of this thread. -1 if they can't be opened, for
+//example when perf_event_paranoid doesn't allow it.
+static __thread int profileCycleFd = -2;
+static __thread int profileInstructionFd = -2;
+//Set when one thread could open its counters
+static int profilePerfOpened;
+
+static int profileOpenCounter(uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  //this thread on any CPU
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t profileReadCounter(int fd) {
+  uint64_t value = 0;
+  if(fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return 0;
+  return value;
+}
+
+#endif
+
+static uint64_t profileNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+ProfileMark profileStart(ProfileId id) {
+  ProfileMark mark;
+  mark.id = id;
+  mark.childNs = profileChildNs;
+  mark.cycles = 0;
+  mark.instructions = 0;
+
+#ifdef NN_PROFILE_PERF
+  if(profileCycleFd == -2) {
+    profileCycleFd = profileOpenCounter(PERF_COUNT_HW_CPU_CYCLES);
+    profileInstructionFd = profileOpenCounter(PERF_COUNT_HW_INSTRUCTIONS);
+    if(profileCycleFd >= 0) __atomic_store_n(&profilePerfOpened, 1, __ATOMIC_RELAXED);
+  }
+  mark.cycles = profileReadCounter(profileCycleFd);
+  mark.instructions = profileReadCounter(profileInstructionFd);
+#endif
+
+  //Last so the work above is not part of the call
+  mark.startNs = profileNow();
+  return mark;
+}
+
+void profileStop(ProfileMark *mark) {
+  uint64_t ns = profileNow() - mark->startNs;
+  uint64_t childNs = profileChildNs - mark->childNs;
+  //The caller sees all of this call as time of a child
+  profileChildNs = mark->childNs + ns;
+
+  ProfileCounter *c = &profileCounters[mark->id];
+  //Workers of parallel.h can be in the same function
+  //at the same time
+  __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->totalNs, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->selfNs, ns - childNs, __ATOMIC_RELAXED);
+
+#ifdef NN_PROFILE_PERF
+  //Inclusive like totalNs
+  uint64_t cycles = profileReadCounter(profileCycleFd) - mark->cycles;
+  uint64_t instructions = profileReadCounter(profileInstructionFd) - mark->instructions;
+  __atomic_fetch_add(&c->cycles, cycles, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->instructions, instructions, __ATOMIC_RELAXED);
+#endif
+}
+
+ProfileCounter profileCounter(ProfileId id) {
+  return profileCounters[id];
+}
+
+void profileReset(void) {
+  memset(profileCounters, 0, sizeof(profileCounters));
+}
+
+void profileReport(FILE *f) {
+  uint64_t selfSum = 0;
+  for(size_t i = 0; i < PROFILE_COUNT; i++) {
+    selfSum += profileCounters[i].selfNs;
+  }
+
+  fprintf(
+    f, "%-15s %10s %12s %12s %7s %10s",
+    "function", "calls", "total ms", "self ms", "self %", "ns/call"
+  );
+#ifdef NN_PROFILE_PERF
+  fprintf(f, " %14s %14s %5s", "cycles", "instructions", "IPC");
+#endif
+  fprintf(f, "\n");
+
+  for(size_t i = 0; i < PROFILE_COUNT; i++) {
+    ProfileCounter c = profileCounters[i];
+    if(c.calls == 0) continue;
+
+    fprintf(
+      f, "%-15s %10llu %12.3f %12.3f %6.1f%% %10.1f",
+      profileNames[i],
+      (unsigned long long)c.calls,
+      c.totalNs / 1e6,
+      c.selfNs / 1e6,
+      selfSum ? 100.0 * c.selfNs / selfSum : 0.0,
+      (double)c.totalNs / c.calls
+    );
+#ifdef NN_PROFILE_PERF
+    fprintf(
+      f, " %14llu %14llu %5.2f",
+      (unsigned long long)c.cycles,
+      (unsigned long long)c.instructions,
+      c.cycles ? (double)c.instructions / c.cycles : 0.0
+    );
+#endif
+    fprintf(f, "\n");
+  }
+
+#ifdef NN_PROFILE_PERF
+  if(!profilePerfOpened) {
+    fprintf(f, "perf_event_open failed, cycles and instructions were not counted\n");
+  }
+#endif
+}
+
+#else
+
+ProfileCounter profileCounter(ProfileId id) {
+  (void)id;
+  ProfileCounter c;
+  memset(&c, 0, sizeof(c));
+  return c;
+}
+
+void profileReset(void) {}
+
+void profileReport(FILE *f) {
+  fprintf(f, "Profiling is off. Compile with -DNN_PROFILE to turn it on.\n");
+}
+
+#endif
+
+#endif
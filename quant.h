@@ -0,0 +1,387 @@
+#include <stdint.h>
+
+#ifndef QUANT_H
+#define QUANT_H
+
+/*
+  Inference only copy of a trained network with int8
+  weights. Every output is thresholded at 0.5 after
+  training, so the outputs don't need the precision of
+  floats.
+
+  - Weights of a layer share one scale: w = q * weightScale
+    where q is from -127 to 127.
+  - Activations are from 0 to 1 so they are stored as a
+    byte from 0 to QUANT_ONE. The inputs are clamped to
+    [0, 1] the same way.
+  - The biases are int32 in the scale of the accumulator.
+  - The sum of a neuron is turned into an index of a
+    256 entry sigmoid table with a fixed point multiply,
+    so no float is used between the input and the output.
+  - Every layer must use ACT_SIGMOID. The outputs of the
+    other activations don't fit in a byte from 0 to 1.
+*/
+
+//Value of an activation of 1
+#define QUANT_ONE 127
+//Steps of the sigmoid table per 1 of the sum of a neuron.
+//The table covers [-128/QUANT_TABLE_SCALE, 127/QUANT_TABLE_SCALE].
+#define QUANT_TABLE_SCALE 16
+//Weights of a neuron are padded to a multiple of this
+//many bytes, which is one AVX2 register
+#define QUANT_PAD 32
+
+typedef struct {
+  size_t inputs;
+  size_t outputs;
+  //inputs rounded up to QUANT_PAD
+  size_t stride;
+  //'outputs' rows of 'stride' weights. Row j holds the
+  //weights into neuron j, so it's the transpose of the
+  //float weights. The padding is 0.
+  int8_t *weights;
+  int32_t *biases;
+  float weightScale;
+  //index = (sum * mult) >> shift
+  int64_t mult;
+  int shift;
+} QuantLayer;
+
+typedef struct {
+  //number of QuantLayer, same as NeuralNetwork.count
+  size_t count;
+  QuantLayer *layers;
+  //sigmoid of index - 128 divided by QUANT_TABLE_SCALE
+  uint8_t *sigmoidTable;
+  //activations of the layer that is computed and of
+  //the one before it. They have the stride of the
+  //widest layer.
+  uint8_t *bufA;
+  uint8_t *bufB;
+
+  void *arena;
+  size_t arenaBytes;
+} QuantNetwork;
+
+//Float model compared with the quantized model
+typedef struct {
+  size_t rows;
+  size_t outputs;
+  //largest and average absolute difference of the outputs
+  float maxError;
+  float meanError;
+  //outputs that are on the other side of 0.5
+  size_t flips;
+  //rows with at least one output on the wrong side of
+  //0.5 compared with the expected output
+  size_t floatFails;
+  size_t quantFails;
+  size_t floatBytes;
+  size_t quantBytes;
+} QuantReport;
+
+QuantNetwork quantizeNetwork(NeuralNetwork n);
+void destroyQuantNetwork(QuantNetwork q);
+//Bytes allocated for the quantized network
+size_t quantNetworkBytes(QuantNetwork q);
+
+/*
+  Activates every row of 'input' and writes the outputs
+  to the rows of 'output' as floats from 0 to 1. The
+  buffers of 'q' are used, so a network must only be used
+  by one thread at a time.
+*/
+void quantForward(QuantNetwork q, Matrix input, Matrix output);
+
+//Runs both models over 'ti'. 'to' is the expected output.
+QuantReport quantCompare(NeuralNetwork n, QuantNetwork q, Matrix ti, Matrix to);
+void printQuantReport(QuantReport r);
+
+#endif
+
+#ifdef QUANT_IMPL
+
+#include <string.h>
+
+static size_t quantAlign(size_t bytes, size_t align) {
+  return (bytes + align - 1) / align * align;
+}
+
+static uint8_t quantActivation(float x) {
+  x = x < 0 ? 0 : x > 1 ? 1 : x;
+  return (uint8_t)lrintf(x * QUANT_ONE);
+}
+
+QuantNetwork quantizeNetwork(NeuralNetwork n) {
+  QuantNetwork q;
+  q.count = n.count;
+  for(size_t i = 0; i < n.count; i++) ASSERT_NN(n.activations[i] == ACT_SIGMOID);
+
+  size_t width = 0;
+  size_t weightBytes = 0;
+  for(size_t i = 0; i <= n.count; i++) {
+    size_t stride = quantAlign(n.layers[i].cols, QUANT_PAD);
+    if(stride > width) width = stride;
+    if(i < n.count) {
+      weightBytes += stride * n.layers[i+1].cols;
+    }
+  }
+
+  size_t biasBytes = 0;
+  for(size_t i = 0; i < n.count; i++) {
+    biasBytes += sizeof(int32_t) * n.layers[i+1].cols;
+  }
+
+  //Same idea as the arena of a network: the layers, the
+  //weights, the biases, the table and the two buffers
+  //are one allocation and each block is aligned
+  size_t layerBytes = quantAlign(sizeof(QuantLayer) * n.count, NN_ALIGN);
+  weightBytes = quantAlign(weightBytes, NN_ALIGN);
+  biasBytes = quantAlign(biasBytes, NN_ALIGN);
+  size_t tableBytes = 256;
+  size_t bufBytes = width * 2;
+
+  q.arenaBytes = layerBytes + weightBytes + biasBytes + tableBytes + bufBytes + NN_ALIGN - 1;
+  q.arena = NN_MALLOC(q.arenaBytes);
+  ASSERT_NN(q.arena != NULL);
+
+  char *cursor = (char *)quantAlign((size_t)q.arena, NN_ALIGN);
+  memset(cursor, 0, q.arenaBytes - (NN_ALIGN - 1));
+
+  q.layers = (QuantLayer *)cursor;
+  cursor += layerBytes;
+  int8_t *weights = (int8_t *)cursor;
+  cursor += weightBytes;
+  int32_t *biases = (int32_t *)cursor;
+  cursor += biasBytes;
+  q.sigmoidTable = (uint8_t *)cursor;
+  cursor += tableBytes;
+  q.bufA = (uint8_t *)cursor;
+  q.bufB = q.bufA + width;
+
+  for(int i = 0; i < 256; i++) {
+    q.sigmoidTable[i] = quantActivation(sigmoid((float)(i - 128) / QUANT_TABLE_SCALE));
+  }
+
+  //Activations and the input have the scale 1/QUANT_ONE
+  double inScale = 1.0 / QUANT_ONE;
+
+  for(size_t i = 0; i < n.count; i++) {
+    QuantLayer *l = &q.layers[i];
+    Matrix w = n.weights[i];
+    Matrix b = n.biases[i];
+
+    l->inputs = w.rows;
+    l->outputs = w.cols;
+    l->stride = quantAlign(w.rows, QUANT_PAD);
+    l->weights = weights;
+    l->biases = biases;
+    weights += l->stride * l->outputs;
+    biases += l->outputs;
+
+    float maxAbs = 0;
+    for(size_t k = 0; k < w.rows; k++) {
+      for(size_t j = 0; j < w.cols; j++) {
+        float v = fabsf((float)w.start[getCell(w, k, j)]);
+        if(v > maxAbs) maxAbs = v;
+      }
+    }
+    l->weightScale = maxAbs > 0 ? maxAbs / 127 : 1;
+
+    for(size_t k = 0; k < w.rows; k++) {
+      for(size_t j = 0; j < w.cols; j++) {
+        long v = lrintf(w.start[getCell(w, k, j)] / l->weightScale);
+        v = v > 127 ? 127 : v < -127 ? -127 : v;
+        l->weights[j*l->stride + k] = (int8_t)v;
+      }
+    }
+
+    //The sum of a neuron is in the scale inScale * weightScale
+    double sumScale = inScale * l->weightScale;
+    for(size_t j = 0; j < w.cols; j++) {
+      double v = b.start[getCell(b, 0, j)] / sumScale;
+      v = v > INT32_MAX / 2 ? INT32_MAX / 2 : v < -(INT32_MAX / 2) ? -(INT32_MAX / 2) : v;
+      l->biases[j] = (int32_t)lrint(v);
+    }
+
+    //Largest shift that keeps mult below 2^31
+    double m = sumScale * QUANT_TABLE_SCALE;
+    l->shift = 0;
+    while(l->shift < 62 && m * 2.0 < (double)(1u << 31)) {
+      m *= 2;
+      l->shift++;
+    }
+    l->mult = (int64_t)llround(m);
+  }
+
+  return q;
+}
+
+void destroyQuantNetwork(QuantNetwork q) {
+  NN_FREE(q.arena);
+}
+
+size_t quantNetworkBytes(QuantNetwork q) {
+  return q.arenaBytes;
+}
+
+//Sum of a[k] * w[k] over 'stride' bytes
+static int32_t quantDotScalar(const uint8_t *a, const int8_t *w, size_t stride) {
+  int32_t sum = 0;
+  for(size_t k = 0; k < stride; k++) {
+    sum += (int32_t)a[k] * (int32_t)w[k];
+  }
+  return sum;
+}
+
+#ifdef SIMD_X86
+
+/*
+  maddubs multiplies unsigned bytes by signed bytes and adds
+  pairs into int16. An activation is at most 127 and a weight
+  at least -127, so a pair never saturates. madd with ones
+  adds pairs of int16 into int32.
+*/
+__attribute__((target("avx2")))
+static int32_t quantDotAvx2(const uint8_t *a, const int8_t *w, size_t stride) {
+  __m256i acc = _mm256_setzero_si256();
+  __m256i ones = _mm256_set1_epi16(1);
+
+  for(size_t k = 0; k < stride; k += QUANT_PAD) {
+    __m256i av = _mm256_loadu_si256((const __m256i *)&a[k]);
+    __m256i wv = _mm256_loadu_si256((const __m256i *)&w[k]);
+    __m256i pairs = _mm256_maddubs_epi16(av, wv);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+  }
+
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+#endif
+
+//Activations of one layer from the activations in 'in'
+static void quantLayerForward(
+  const QuantLayer *l, const uint8_t *table, const uint8_t *in, uint8_t *out
+) {
+#ifdef SIMD_X86
+  int avx2 = simdIsa() >= SIMD_AVX2;
+#endif
+
+  for(size_t j = 0; j < l->outputs; j++) {
+    const int8_t *w = &l->weights[j*l->stride];
+    int32_t sum;
+#ifdef SIMD_X86
+    if(avx2) sum = quantDotAvx2(in, w, l->stride);
+    else
+#endif
+    sum = quantDotScalar(in, w, l->stride);
+    sum += l->biases[j];
+
+    //round to the nearest table index
+    int64_t index = (int64_t)sum * l->mult;
+    if(l->shift > 0) index = (index + ((int64_t)1 << (l->shift - 1))) >> l->shift;
+    index = index > 127 ? 127 : index < -128 ? -128 : index;
+    out[j] = table[index + 128];
+  }
+
+  //The next layer reads whole QUANT_PAD blocks
+  size_t stride = quantAlign(l->outputs, QUANT_PAD);
+  memset(&out[l->outputs], 0, stride - l->outputs);
+}
+
+void quantForward(QuantNetwork q, Matrix input, Matrix output) {
+  ASSERT_NN(input.rows == output.rows);
+  ASSERT_NN(input.cols == q.layers[0].inputs);
+  ASSERT_NN(output.cols == q.layers[q.count - 1].outputs);
+
+  for(size_t s = 0; s < input.rows; s++) {
+    uint8_t *in = q.bufA;
+    uint8_t *out = q.bufB;
+
+    for(size_t k = 0; k < input.cols; k++) {
+      in[k] = quantActivation(input.start[getCell(input, s, k)]);
+    }
+    memset(&in[input.cols], 0, q.layers[0].stride - input.cols);
+
+    for(size_t i = 0; i < q.count; i++) {
+      quantLayerForward(&q.layers[i], q.sigmoidTable, in, out);
+      uint8_t *tmp = in;
+      in = out;
+      out = tmp;
+    }
+
+    for(size_t j = 0; j < output.cols; j++) {
+      output.start[getCell(output, s, j)] = (float)in[j] / QUANT_ONE;
+    }
+  }
+}
+
+QuantReport quantCompare(NeuralNetwork n, QuantNetwork q, Matrix ti, Matrix to) {
+  ASSERT_NN(ti.rows == to.rows);
+  ASSERT_NN(to.cols == OUTPUT_LAYER_NN(n).cols);
+
+  QuantReport r;
+  memset(&r, 0, sizeof(r));
+  r.rows = ti.rows;
+  r.outputs = to.cols;
+  r.floatBytes = sizeof(*n.params) * n.paramCount;
+  for(size_t i = 0; i < q.count; i++) {
+    r.quantBytes += q.layers[i].inputs * q.layers[i].outputs;
+    r.quantBytes += sizeof(*q.layers[i].biases) * q.layers[i].outputs;
+  }
+
+  size_t batch = BATCH_NN(n);
+  Matrix qo = matrixAlloc(batch, to.cols);
+  double errorSum = 0;
+
+  //Same chunks as computeCost
+  for(size_t i = 0; i < ti.rows; i += batch) {
+    size_t rows = ti.rows - i < batch ? ti.rows - i : batch;
+    Matrix inputRows = getMatrixRows(ti, i, rows);
+    Matrix fo = OUTPUT_LAYER_NN(n);
+
+    matrixCopy(getMatrixRows(INPUT_LAYER_NN(n), 0, rows), inputRows);
+    forwardBatch(n, rows);
+    quantForward(q, inputRows, getMatrixRows(qo, 0, rows));
+
+    for(size_t s = 0; s < rows; s++) {
+      int floatFail = 0;
+      int quantFail = 0;
+
+      for(size_t j = 0; j < to.cols; j++) {
+        float f = fo.start[getCell(fo, s, j)];
+        float v = qo.start[getCell(qo, s, j)];
+        int expected = to.start[getCell(to, i + s, j)] > 0.5f;
+
+        float error = fabsf(f - v);
+        errorSum += error;
+        if(error > r.maxError) r.maxError = error;
+        if((f > 0.5f) != (v > 0.5f)) r.flips++;
+        if((f > 0.5f) != expected) floatFail = 1;
+        if((v > 0.5f) != expected) quantFail = 1;
+      }
+
+      r.floatFails += floatFail;
+      r.quantFails += quantFail;
+    }
+  }
+
+  r.meanError = ti.rows > 0 ? errorSum / (ti.rows * to.cols) : 0;
+  matrixFree(qo);
+  return r;
+}
+
+void printQuantReport(QuantReport r) {
+  printf("--Quantized Network--\n");
+  printf("rows: %zu, outputs per row: %zu\n", r.rows, r.outputs);
+  printf("parameter bytes: %zu float, %zu int8\n", r.floatBytes, r.quantBytes);
+  printf("max error: %f, mean error: %f\n", r.maxError, r.meanError);
+  printf("outputs on the other side of 0.5: %zu\n", r.flips);
+  printf("wrong rows: %zu float, %zu int8\n", r.floatFails, r.quantFails);
+  printf("-- --\n\n");
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+/*
+  Counter-based random numbers. Every number is a hash of
+  (seed, stream, index) instead of the next value of a
+  shared state like rand(), so:
+
+  - any number can be made without the ones before it,
+    which lets threads and vectors fill different parts
+    of the same array
+  - the same seed gives the same numbers no matter how
+    many threads are used or in which order they run
+  - nothing is shared, so it's thread safe without locks
+
+  The hash is the output function of SplitMix64. The seed
+  and the stream are hashed into a key and number 'index'
+  is SplitMix64 started at that key after index + 1 steps.
+  A stream is an independent sequence for the same seed,
+  like one per matrix or one per shuffle.
+*/
+
+uint64_t randomBits(uint64_t seed, uint64_t stream, uint64_t index);
+//From 0 up to but not including 1 with 24 random bits,
+//which is every float of that range with the same spacing
+float randomFloat(uint64_t seed, uint64_t stream, uint64_t index);
+//From 0 to 'count' - 1 without the bias of a modulo
+uint64_t randomBelow(uint64_t seed, uint64_t stream, uint64_t index, uint64_t count);
+//dst[i] = randomFloat(seed, stream, first + i)*(end - start) + start
+//with AVX2 when the CPU has it. The result is the same
+//with and without AVX2.
+void randomFill(
+  float *dst, size_t count,
+  uint64_t seed, uint64_t stream, uint64_t first,
+  float start, float end
+);
+
+/*
+  Seed of the functions that don't take one: randFloat,
+  randMatrix, randNetwork, shuffleRows and dataFillRandom.
+  Like srand it also starts the streams from 0 again, so
+  the same calls after the same seed give the same numbers.
+  The seed is 0 until it's set.
+*/
+void randomSeed(uint64_t seed);
+uint64_t randomCurrentSeed();
+//Stream that no other caller gets until the next
+//randomSeed. Thread safe.
+uint64_t randomNextStream();
+
+#endif
+
+#ifdef RANDOM_IMPL
+
+#define RANDOM_GAMMA 0x9E3779B97F4A7C15ull
+
+static uint64_t randomState = 0;
+static uint64_t randomStreams = 0;
+
+static uint64_t randomMix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t randomKey(uint64_t seed, uint64_t stream) {
+  return randomMix(seed + randomMix(stream + RANDOM_GAMMA));
+}
+
+uint64_t randomBits(uint64_t seed, uint64_t stream, uint64_t index) {
+  return randomMix(randomKey(seed, stream) + (index + 1) * RANDOM_GAMMA);
+}
+
+float randomFloat(uint64_t seed, uint64_t stream, uint64_t index) {
+  return (float)(randomBits(seed, stream, index) >> 40) * (1.0f / 16777216.0f);
+}
+
+uint64_t randomBelow(uint64_t seed, uint64_t stream, uint64_t index, uint64_t count) {
+  //High half of the 128 bit product of the bits and the
+  //count, which is evenly spread over 0 to count-1
+  return (uint64_t)(((unsigned __int128)randomBits(seed, stream, index) * count) >> 64);
+}
+
+#ifdef SIMD_X86
+
+//64 bit multiply. AVX2 only multiplies 32 bit halves.
+__attribute__((target("avx2")))
+static inline __m256i randomMul64(__m256i a, __m256i b) {
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i cross = _mm256_add_epi64(
+    _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+    _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32))
+  );
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i randomMixAvx2(__m256i z) {
+  const __m256i m1 = _mm256_set1_epi64x((long long)0xBF58476D1CE4E5B9ull);
+  const __m256i m2 = _mm256_set1_epi64x((long long)0x94D049BB133111EBull);
+  z = randomMul64(_mm256_xor_si256(z, _mm256_srli_epi64(z, 30)), m1);
+  z = randomMul64(_mm256_xor_si256(z, _mm256_srli_epi64(z, 27)), m2);
+  return _mm256_xor_si256(z, _mm256_srli_epi64(z, 31));
+}
+
+/*
+  8 floats per step. One vector has the even indexes and
+  the other the odd ones, so after the top 24 bits are
+  moved into 32 bit lanes the two interleave back into
+  index order. No FMA so the rounding is the same as the
+  scalar loop.
+*/
+__attribute__((target("avx2")))
+static size_t randomFillAvx2(
+  float *dst, size_t count, uint64_t key, uint64_t first, float start, float end
+) {
+  const __m256i gamma = _mm256_set1_epi64x((long long)RANDOM_GAMMA);
+  const __m256i step = _mm256_set1_epi64x((long long)(8 * RANDOM_GAMMA));
+  __m256i even = _mm256_set_epi64x(
+    (long long)(key + (first + 7) * RANDOM_GAMMA), (long long)(key + (first + 5) * RANDOM_GAMMA),
+    (long long)(key + (first + 3) * RANDOM_GAMMA), (long long)(key + (first + 1) * RANDOM_GAMMA)
+  );
+  __m256i odd = _mm256_add_epi64(even, gamma);
+  const __m256 unit = _mm256_set1_ps(1.0f / 16777216.0f);
+  const __m256 range = _mm256_set1_ps(end - start);
+  const __m256 offset = _mm256_set1_ps(start);
+
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256i lo = _mm256_srli_epi64(randomMixAvx2(even), 40);
+    __m256i hi = _mm256_slli_epi64(_mm256_srli_epi64(randomMixAvx2(odd), 40), 32);
+    __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_or_si256(lo, hi)), unit);
+    _mm256_storeu_ps(&dst[i], _mm256_add_ps(_mm256_mul_ps(u, range), offset));
+    even = _mm256_add_epi64(even, step);
+    odd = _mm256_add_epi64(odd, step);
+  }
+  return i;
+}
+
+#endif
+
+void randomFill(
+  float *dst, size_t count,
+  uint64_t seed, uint64_t stream, uint64_t first,
+  float start, float end
+) {
+  uint64_t key = randomKey(seed, stream);
+  size_t i = 0;
+#ifdef SIMD_X86
+  if(simdIsa() >= SIMD_AVX2) i = randomFillAvx2(dst, count, key, first, start, end);
+#endif
+  for(; i < count; i++) {
+    uint64_t bits = randomMix(key + (first + i + 1) * RANDOM_GAMMA);
+    float u = (float)(bits >> 40) * (1.0f / 16777216.0f);
+    //Two steps like the vector loop so neither is fused
+    float scaled = u * (end - start);
+    dst[i] = scaled + start;
+  }
+}
+
+void randomSeed(uint64_t seed) {
+  __atomic_store_n(&randomState, seed, __ATOMIC_RELAXED);
+  __atomic_store_n(&randomStreams, 0, __ATOMIC_RELAXED);
+}
+
+uint64_t randomCurrentSeed() {
+  return __atomic_load_n(&randomState, __ATOMIC_RELAXED);
+}
+
+uint64_t randomNextStream() {
+  return __atomic_fetch_add(&randomStreams, 1, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -1,26 +1,26 @@
 
-float or_train_data[] = {
+nnfloat or_train_data[] = {
     0, 0, 0,
     1, 0, 1,
     0, 1, 1,
     1, 1, 1
 };
 
-float and_train_data[] = {
+nnfloat and_train_data[] = {
     0, 0, 0,
     1, 0, 0,
     0, 1, 0,
     1, 1, 1
 };
 
-float nand_train_data[] = {
+nnfloat nand_train_data[] = {
     0, 0, 1,
     1, 0, 1,
     0, 1, 1,
     1, 1, 0
 };
 
-float xor_train_data[] = {
+nnfloat xor_train_data[] = {
     0, 0, 0,
     1, 0, 1,
     0, 1, 1,
@@ -0,0 +1,102 @@
+#define SIMD_IMPL
+#define RANDOM_IMPL
+#define MATRIX_IMPL
+#define ACTIVATION_IMPL
+#define NEURAL_NET_IMPL
+#define COMPUTE_IMPL
+#define MODEL_IMPL
+#define SERVER_IMPL
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simd.h"
+#include "random.h"
+#include "matrix.h"
+#include "activation.h"
+#include "neuralnet.h"
+#include "compute.h"
+#include "model.h"
+#include "server.h"
+
+/*
+  Serves a model file saved by adder2 with server.h.
+
+  Usage: ./serve [-b rows] [-d microseconds] [-c clients] model [socket]
+
+  Without a socket path the requests are read from stdin
+  and the replies are written to stdout, and the server
+  stops when stdin is closed. The stats are printed to
+  stderr when the server stops.
+*/
+
+#define SERVE_DEFAULT_BATCH 64
+#define SERVE_DEFAULT_DEADLINE_US 200
+#define SERVE_DEFAULT_CLIENTS 64
+
+int main(int argc, char *argv[]) {
+  size_t batch = SERVE_DEFAULT_BATCH;
+  uint64_t deadlineUs = SERVE_DEFAULT_DEADLINE_US;
+  size_t clients = SERVE_DEFAULT_CLIENTS;
+
+  int opt;
+  while((opt = getopt(argc, argv, "b:d:c:")) != -1) {
+    switch(opt) {
+      case 'b': batch = strtoul(optarg, NULL, 10); break;
+      case 'd': deadlineUs = strtoull(optarg, NULL, 10); break;
+      case 'c': clients = strtoul(optarg, NULL, 10); break;
+      default: optind = argc + 1;
+    }
+  }
+  if(optind >= argc || batch == 0 || clients == 0) {
+    fprintf(stderr, "Usage: %s [-b rows] [-d microseconds] [-c clients] model [socket]\n", argv[0]);
+    return 1;
+  }
+  const char *modelPath = argv[optind];
+  const char *socketPath = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+  NeuralNetwork n;
+  if(mapNetwork(modelPath, 1, &n) != 0) {
+    fprintf(stderr, "Can't load %s\n", modelPath);
+    return 1;
+  }
+
+  //Writes to a client that went away fail with EPIPE
+  //instead of stopping the server
+  signal(SIGPIPE, SIG_IGN);
+
+  Server *s = createServer(n, batch, deadlineUs * 1000, clients);
+  if(socketPath != NULL) {
+    if(serverListen(s, socketPath) != 0) {
+      fprintf(stderr, "Can't listen on %s\n", socketPath);
+      return 1;
+    }
+    fprintf(stderr, "Serving %s on %s\n", modelPath, socketPath);
+  }
+  else {
+    serverAddClient(s, 0, 1);
+  }
+
+  int result = serverRun(s);
+
+  ServeStats stats = serverStats(s);
+  fprintf(
+    stderr,
+    "%llu requests, %llu rows in %llu batches (%.1f rows per batch)\n"
+    "latency p50 %.1f us, p99 %.1f us, max %.1f us\n"
+    "%.0f requests/s, %.0f rows/s\n",
+    (unsigned long long)stats.requests,
+    (unsigned long long)stats.rows,
+    (unsigned long long)stats.batches,
+    stats.meanBatch,
+    stats.p50Ns / 1e3, stats.p99Ns / 1e3, stats.maxNs / 1e3,
+    stats.requestsPerSecond, stats.rowsPerSecond
+  );
+
+  destroyServer(s);
+  if(socketPath != NULL) unlink(socketPath);
+  unmapNetwork(n);
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,649 @@
+#include <stdint.h>
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+  Inference server. A trained network stays in memory and
+  other local processes send it rows to activate, through
+  a Unix domain socket or through a pipe like stdin and
+  stdout.
+
+  Requests that arrive close together are put in the same
+  micro-batch. A batch is activated by one forwardBatch call
+  when it has maxBatch rows, when its oldest request has
+  waited 'deadlineNs' or when a request doesn't fit in it.
+  So a lone request waits at most 'deadlineNs' and a busy
+  server does one pass for many requests.
+
+  Every message starts with a ServeHeader. The numbers are
+  in the byte order of the machine, like model files, and
+  inputs and outputs are always float whatever nnfloat is.
+
+  SERVE_FORWARD request: header with 'rows' from 1 to
+    maxBatch, then rows*inputs floats, row by row.
+    Reply: header with the same 'rows', then rows*outputs
+    floats.
+  SERVE_STATS request: header with 'rows' 0.
+    Reply: header with 'rows' 0, then ServeStats.
+  SERVE_SHUTDOWN request: header with 'rows' 0. The server
+    replies with the header, finishes every request it has
+    and serverRun returns.
+
+  A request with another type or too many rows gets a
+  SERVE_ERROR header and the connection is closed. Replies
+  to one connection are in the order of its requests, so a
+  client can send many requests before it reads the
+  replies.
+
+  Replies wait in a buffer of their client until the client
+  takes them, so a client that doesn't read never blocks
+  the others. While more than SERVE_MAX_BACKLOG bytes wait,
+  no more requests are read from that client.
+*/
+#define SERVE_ERROR 0
+#define SERVE_FORWARD 1
+#define SERVE_STATS 2
+#define SERVE_SHUTDOWN 3
+
+typedef struct {
+  uint32_t type;
+  uint32_t rows;
+} ServeHeader;
+
+_Static_assert(sizeof(ServeHeader) == 8, "ServeHeader must be 8 bytes");
+
+//Latencies of the last SERVE_LATENCY_SAMPLES requests are
+//kept for the percentiles
+#define SERVE_LATENCY_SAMPLES 8192
+//Unsent reply bytes of one client above which its requests
+//aren't read anymore
+#define SERVE_MAX_BACKLOG (1 << 20)
+//How long the replies that are left may take to be sent
+//after a SERVE_SHUTDOWN
+#define SERVE_DRAIN_NS 1000000000ull
+
+/*
+  Latency is the time from when the last byte of a request
+  is read to when its reply is ready to be sent, so it
+  includes the wait for the batch. The counts and the throughput are
+  from the start of the server.
+*/
+typedef struct {
+  uint64_t requests;
+  uint64_t rows;
+  uint64_t batches;
+  uint64_t p50Ns;
+  uint64_t p99Ns;
+  uint64_t maxNs;
+  double requestsPerSecond;
+  double rowsPerSecond;
+  //rows per forward pass
+  double meanBatch;
+} ServeStats;
+
+_Static_assert(sizeof(ServeStats) == 72, "ServeStats must be 72 bytes");
+
+typedef struct {
+  int inFd;
+  int outFd;
+  //Bytes that are read but not handled yet
+  uint8_t *buf;
+  size_t used;
+  //Replies that aren't sent yet. Bytes 'sent' to 'queued'
+  //are left.
+  uint8_t *out;
+  size_t sent;
+  size_t queued;
+  size_t outSize;
+  //Replies to pipes are written in pieces of PIPE_BUF when
+  //poll says there is room, so they never block. Sockets
+  //are sent with MSG_DONTWAIT right away.
+  int socket;
+  //Requests in the current batch
+  size_t pending;
+  //No more requests are read. The slot is freed once
+  //the pending requests are answered and sent.
+  int eof;
+  //A write failed so no more replies are queued
+  int broken;
+} ServeClient;
+
+typedef struct {
+  ServeClient *client;
+  size_t first;
+  size_t rows;
+  uint64_t arrivalNs;
+} ServeRequest;
+
+typedef struct {
+  //Shares the parameters of the served network and
+  //has maxBatch rows in each layer
+  NeuralNetwork n;
+  size_t maxBatch;
+  uint64_t deadlineNs;
+
+  int listenFd;
+  //Goes off at the deadline of the batch
+  int timerFd;
+  ServeClient *clients;
+  size_t maxClients;
+
+  //Requests of the current batch. Their inputs are
+  //already in the input layer.
+  ServeRequest *batch;
+  size_t batchCount;
+  size_t batchRows;
+
+  //Reply of one request
+  float *reply;
+
+  uint64_t startNs;
+  uint64_t requests;
+  uint64_t rows;
+  uint64_t batches;
+  uint64_t latencies[SERVE_LATENCY_SAMPLES];
+  uint64_t maxNs;
+  int stop;
+  //When a SERVE_SHUTDOWN stops waiting for replies to be
+  //taken
+  uint64_t drainNs;
+} Server;
+
+/*
+  Params:
+  n = network to serve. Only its parameters are used and
+  they must outlive the server.
+  maxBatch = most rows in one forward pass
+  deadlineNs = longest time a request waits for its batch
+  to fill up. 0 activates every read as soon as it's read.
+  maxClients = most connections at once, including the
+  ones of serverAddClient
+*/
+Server *createServer(NeuralNetwork n, size_t maxBatch, uint64_t deadlineNs, size_t maxClients);
+void destroyServer(Server *s);
+
+//Listens on a new socket at 'path'. A socket already at
+//'path' is replaced. Returns 0 on success and -1 if the
+//socket can't be made or 'path' is something else.
+int serverListen(Server *s, const char *path);
+//Serves requests read from 'inFd' with the replies written
+//to 'outFd', for example 0 and 1 for stdin and stdout.
+//Returns -1 if every client slot is taken.
+int serverAddClient(Server *s, int inFd, int outFd);
+
+/*
+  Serves until a SERVE_SHUTDOWN request or, when the server
+  doesn't listen on a socket, until every client has
+  closed. After a SERVE_SHUTDOWN the replies that are left
+  get up to SERVE_DRAIN_NS to be sent. Returns 0, or -1 if
+  poll fails.
+*/
+int serverRun(Server *s);
+ServeStats serverStats(Server *s);
+
+#endif
+
+#ifdef SERVER_IMPL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+static uint64_t serverNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//Size of the biggest request, which is the size of the
+//read buffer of every client
+static size_t serverMaxRequest(Server *s) {
+  return sizeof(ServeHeader) + sizeof(float) * s->maxBatch * INPUT_LAYER_NN(s->n).cols;
+}
+
+Server *createServer(NeuralNetwork n, size_t maxBatch, uint64_t deadlineNs, size_t maxClients) {
+  ASSERT_NN(maxBatch > 0 && maxBatch <= UINT32_MAX);
+  ASSERT_NN(maxClients > 0);
+
+  Server *s = NN_MALLOC(sizeof(*s));
+  ASSERT_NN(s != NULL);
+  memset(s, 0, sizeof(*s));
+
+  s->n = createSharedNetwork(n, maxBatch);
+  s->maxBatch = maxBatch;
+  s->deadlineNs = deadlineNs;
+  s->listenFd = -1;
+  s->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  ASSERT_NN(s->timerFd >= 0);
+  s->maxClients = maxClients;
+
+  s->clients = NN_MALLOC(sizeof(*s->clients) * maxClients);
+  ASSERT_NN(s->clients != NULL);
+  for(size_t i = 0; i < maxClients; i++) {
+    s->clients[i].inFd = -1;
+    s->clients[i].buf = NULL;
+    s->clients[i].out = NULL;
+  }
+
+  //Every request has at least one row
+  s->batch = NN_MALLOC(sizeof(*s->batch) * maxBatch);
+  ASSERT_NN(s->batch != NULL);
+  s->reply = NN_MALLOC(
+    sizeof(ServeHeader) + sizeof(float) * maxBatch * OUTPUT_LAYER_NN(s->n).cols
+  );
+  ASSERT_NN(s->reply != NULL);
+
+  s->startNs = serverNow();
+  return s;
+}
+
+static void serverCloseClient(ServeClient *c) {
+  //A pipe client may share one fd for both sides
+  if(c->outFd != c->inFd) close(c->outFd);
+  close(c->inFd);
+  NN_FREE(c->buf);
+  NN_FREE(c->out);
+  c->buf = NULL;
+  c->out = NULL;
+  c->inFd = -1;
+}
+
+void destroyServer(Server *s) {
+  for(size_t i = 0; i < s->maxClients; i++) {
+    if(s->clients[i].inFd >= 0) serverCloseClient(&s->clients[i]);
+  }
+  if(s->listenFd >= 0) close(s->listenFd);
+  close(s->timerFd);
+  destroyNetwork(s->n);
+  NN_FREE(s->clients);
+  NN_FREE(s->batch);
+  NN_FREE(s->reply);
+  NN_FREE(s);
+}
+
+int serverListen(Server *s, const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+
+  //A socket file left by a server that didn't exit cleanly
+  //would make bind fail. Anything else at the path is not
+  //ours to remove.
+  struct stat st;
+  if(lstat(path, &st) == 0) {
+    if(!S_ISSOCK(st.st_mode)) return -1;
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) return -1;
+  if(
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+    listen(fd, (int)s->maxClients) < 0
+  ) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  if(s->listenFd >= 0) close(s->listenFd);
+  s->listenFd = fd;
+  return 0;
+}
+
+int serverAddClient(Server *s, int inFd, int outFd) {
+  for(size_t i = 0; i < s->maxClients; i++) {
+    ServeClient *c = &s->clients[i];
+    if(c->inFd >= 0) continue;
+
+    c->buf = NN_MALLOC(serverMaxRequest(s));
+    ASSERT_NN(c->buf != NULL);
+    c->outSize = serverMaxRequest(s);
+    c->out = NN_MALLOC(c->outSize);
+    ASSERT_NN(c->out != NULL);
+    c->sent = 0;
+    c->queued = 0;
+    struct stat st;
+    c->socket = fstat(outFd, &st) == 0 && S_ISSOCK(st.st_mode);
+    c->inFd = inFd;
+    c->outFd = outFd;
+    c->used = 0;
+    c->pending = 0;
+    c->eof = 0;
+    c->broken = 0;
+    return 0;
+  }
+  return -1;
+}
+
+//A client that can't take replies anymore gets no more
+//requests either
+static void serverBroken(ServeClient *c) {
+  c->broken = 1;
+  c->eof = 1;
+  c->sent = 0;
+  c->queued = 0;
+}
+
+//Sends what the client can take without waiting
+static void serverSend(ServeClient *c) {
+  while(c->sent < c->queued) {
+    size_t size = c->queued - c->sent;
+    ssize_t n;
+    if(c->socket) {
+      n = send(c->outFd, c->out + c->sent, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    else {
+      n = write(c->outFd, c->out + c->sent, size < PIPE_BUF ? size : PIPE_BUF);
+    }
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK) serverBroken(c);
+      return;
+    }
+    c->sent += (size_t)n;
+    //Only one piece per poll for pipes
+    if(!c->socket) break;
+  }
+  if(c->sent == c->queued) {
+    c->sent = 0;
+    c->queued = 0;
+  }
+}
+
+//Queues a reply. Sockets are sent to right away.
+static void serverWrite(ServeClient *c, const void *data, size_t size) {
+  if(c->broken) return;
+
+  if(c->queued + size > c->outSize) {
+    //Room at the front first, then a bigger buffer
+    memmove(c->out, c->out + c->sent, c->queued - c->sent);
+    c->queued -= c->sent;
+    c->sent = 0;
+  }
+  if(c->queued + size > c->outSize) {
+    size_t outSize = c->outSize;
+    while(c->queued + size > outSize) outSize *= 2;
+    uint8_t *out = NN_MALLOC(outSize);
+    ASSERT_NN(out != NULL);
+    memcpy(out, c->out, c->queued);
+    NN_FREE(c->out);
+    c->out = out;
+    c->outSize = outSize;
+  }
+  memcpy(c->out + c->queued, data, size);
+  c->queued += size;
+
+  if(c->socket) serverSend(c);
+}
+
+//The client's replies wait for it to read them
+static int serverBacklogged(ServeClient *c) {
+  return c->queued - c->sent > SERVE_MAX_BACKLOG;
+}
+
+static void serverReplyHeader(ServeClient *c, uint32_t type) {
+  ServeHeader h = {.type = type, .rows = 0};
+  serverWrite(c, &h, sizeof(h));
+}
+
+//Activates the current batch and answers its requests
+static void serverFlush(Server *s) {
+  if(s->batchCount == 0) return;
+
+  forwardBatch(s->n, s->batchRows);
+  Matrix out = OUTPUT_LAYER_NN(s->n);
+
+  for(size_t i = 0; i < s->batchCount; i++) {
+    ServeRequest *r = &s->batch[i];
+
+    ServeHeader *h = (ServeHeader *)s->reply;
+    h->type = SERVE_FORWARD;
+    h->rows = (uint32_t)r->rows;
+    float *values = (float *)(h + 1);
+    for(size_t j = 0; j < r->rows; j++) {
+      loadFloats(
+        &values[j * out.cols],
+        &out.start[getCell(out, r->first + j, 0)],
+        out.cols
+      );
+    }
+    serverWrite(
+      r->client, s->reply,
+      sizeof(ServeHeader) + sizeof(float) * r->rows * out.cols
+    );
+    r->client->pending--;
+
+    uint64_t latency = serverNow() - r->arrivalNs;
+    s->latencies[s->requests % SERVE_LATENCY_SAMPLES] = latency;
+    if(latency > s->maxNs) s->maxNs = latency;
+    s->requests++;
+    s->rows += r->rows;
+  }
+
+  s->batches++;
+  s->batchCount = 0;
+  s->batchRows = 0;
+}
+
+/*
+  Handles the request at the start of 'data', which has
+  'size' bytes read from 'c'. Returns the bytes it used, or
+  0 if the request isn't complete.
+*/
+static size_t serverHandle(
+  Server *s, ServeClient *c, const uint8_t *data, size_t size, uint64_t now
+) {
+  if(size < sizeof(ServeHeader)) return 0;
+  ServeHeader h;
+  memcpy(&h, data, sizeof(h));
+
+  Matrix in = INPUT_LAYER_NN(s->n);
+  switch(h.type) {
+    case SERVE_FORWARD: {
+      if(h.rows == 0 || h.rows > s->maxBatch) break;
+      size_t needed = sizeof(ServeHeader) + sizeof(float) * h.rows * in.cols;
+      if(size < needed) return 0;
+
+      if(s->batchRows + h.rows > s->maxBatch) serverFlush(s);
+
+      //The inputs go straight into the input layer. The
+      //buffer is only byte aligned so they're copied to a
+      //float row first.
+      float row[in.cols];
+      const uint8_t *values = data + sizeof(ServeHeader);
+      for(size_t j = 0; j < h.rows; j++) {
+        memcpy(row, values + sizeof(float) * j * in.cols, sizeof(row));
+        storeFloats(&in.start[getCell(in, s->batchRows + j, 0)], row, in.cols);
+      }
+      s->batch[s->batchCount++] = (ServeRequest){
+        .client = c,
+        .first = s->batchRows,
+        .rows = h.rows,
+        .arrivalNs = now
+      };
+      s->batchRows += h.rows;
+      c->pending++;
+
+      if(s->batchRows == s->maxBatch) serverFlush(s);
+      return needed;
+    }
+    case SERVE_STATS: {
+      if(h.rows != 0) break;
+      //Earlier requests of this client are answered first
+      serverFlush(s);
+      ServeStats stats = serverStats(s);
+      serverReplyHeader(c, SERVE_STATS);
+      serverWrite(c, &stats, sizeof(stats));
+      return sizeof(ServeHeader);
+    }
+    case SERVE_SHUTDOWN: {
+      if(h.rows != 0) break;
+      serverFlush(s);
+      serverReplyHeader(c, SERVE_SHUTDOWN);
+      s->stop = 1;
+      return sizeof(ServeHeader);
+    }
+  }
+
+  //The rest of the stream can't be trusted
+  serverReplyHeader(c, SERVE_ERROR);
+  c->eof = 1;
+  return size;
+}
+
+//Handles the complete requests in the buffer of 'c' until
+//its replies back up
+static void serverParse(Server *s, ServeClient *c, uint64_t now) {
+  size_t offset = 0;
+  while(!c->eof && !s->stop && !serverBacklogged(c)) {
+    size_t done = serverHandle(s, c, c->buf + offset, c->used - offset, now);
+    if(done == 0) break;
+    offset += done;
+  }
+  //The start of an incomplete request is kept
+  c->used -= offset;
+  memmove(c->buf, c->buf + offset, c->used);
+}
+
+static void serverRead(Server *s, ServeClient *c) {
+  size_t cap = serverMaxRequest(s);
+  ssize_t n = read(c->inFd, c->buf + c->used, cap - c->used);
+  if(n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if(n <= 0) {
+    c->eof = 1;
+    return;
+  }
+  c->used += (size_t)n;
+  serverParse(s, c, serverNow());
+}
+
+static void serverAccept(Server *s) {
+  for(;;) {
+    int fd = accept(s->listenFd, NULL, NULL);
+    if(fd < 0) return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(serverAddClient(s, fd, fd) != 0) close(fd);
+  }
+}
+
+int serverRun(Server *s) {
+  //Slot 0 is the deadline timer, slot 1 the socket, slot
+  //2i + 2 the input of client i and slot 2i + 3 its output.
+  //poll skips the slots with a negative fd.
+  size_t count = 2 * s->maxClients + 2;
+  struct pollfd fds[count];
+  fds[0] = (struct pollfd){.fd = s->timerFd, .events = POLLIN};
+
+  for(;;) {
+    if(s->stop) {
+      serverFlush(s);
+      if(s->drainNs == 0) s->drainNs = serverNow() + SERVE_DRAIN_NS;
+    }
+
+    fds[1] = (struct pollfd){.fd = s->stop ? -1 : s->listenFd, .events = POLLIN};
+    size_t clients = 0;
+    size_t unsent = 0;
+    for(size_t i = 0; i < s->maxClients; i++) {
+      ServeClient *c = &s->clients[i];
+      int waiting = c->inFd >= 0 && c->sent < c->queued;
+      if(c->inFd >= 0 && c->eof && c->pending == 0 && !waiting) serverCloseClient(c);
+      if(c->inFd >= 0) clients++;
+      unsent += waiting;
+
+      int reading = c->inFd >= 0 && !c->eof && !s->stop && !serverBacklogged(c);
+      fds[2*i + 2] = (struct pollfd){.fd = reading ? c->inFd : -1, .events = POLLIN};
+      fds[2*i + 3] = (struct pollfd){.fd = waiting ? c->outFd : -1, .events = POLLOUT};
+    }
+    if(s->stop && (unsent == 0 || serverNow() >= s->drainNs)) break;
+    if(!s->stop && s->listenFd < 0 && clients == 0) break;
+
+    //The timer goes off when the oldest request of the
+    //batch is due, or when the time to send the last
+    //replies is over. poll only takes milliseconds, which
+    //is longer than a typical deadline.
+    uint64_t due = 0;
+    if(s->stop) due = s->drainNs;
+    else if(s->batchCount > 0) due = s->batch[0].arrivalNs + s->deadlineNs;
+    if(due != 0) {
+      if(!s->stop && due <= serverNow()) {
+        serverFlush(s);
+        continue;
+      }
+      struct itimerspec t = {
+        .it_value = {.tv_sec = due / 1000000000ull, .tv_nsec = due % 1000000000ull}
+      };
+      timerfd_settime(s->timerFd, TFD_TIMER_ABSTIME, &t, NULL);
+    }
+
+    if(poll(fds, count, -1) < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+
+    //Only clears the timer. The batch is checked at the
+    //top of the loop.
+    if(fds[0].revents & POLLIN) {
+      uint64_t expirations;
+      read(s->timerFd, &expirations, sizeof(expirations));
+    }
+    if(fds[1].revents & POLLIN) serverAccept(s);
+    uint64_t now = serverNow();
+    for(size_t i = 0; i < s->maxClients; i++) {
+      ServeClient *c = &s->clients[i];
+      if(fds[2*i + 3].revents) {
+        if(fds[2*i + 3].revents & (POLLERR | POLLHUP)) serverBroken(c);
+        else serverSend(c);
+        //Requests that were left when the replies backed up
+        if(!serverBacklogged(c)) serverParse(s, c, now);
+      }
+      if(fds[2*i + 2].revents && !s->stop) serverRead(s, c);
+    }
+  }
+
+  return 0;
+}
+
+static int compareLatency(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+ServeStats serverStats(Server *s) {
+  double seconds = (serverNow() - s->startNs) / 1e9;
+  ServeStats stats = {
+    .requests = s->requests,
+    .rows = s->rows,
+    .batches = s->batches,
+    .maxNs = s->maxNs,
+    .requestsPerSecond = seconds > 0 ? s->requests / seconds : 0,
+    .rowsPerSecond = seconds > 0 ? s->rows / seconds : 0,
+    .meanBatch = s->batches ? (double)s->rows / s->batches : 0
+  };
+
+  size_t count = s->requests < SERVE_LATENCY_SAMPLES ? s->requests : SERVE_LATENCY_SAMPLES;
+  if(count > 0) {
+    uint64_t *sorted = NN_MALLOC(sizeof(*sorted) * count);
+    ASSERT_NN(sorted != NULL);
+    memcpy(sorted, s->latencies, sizeof(*sorted) * count);
+    qsort(sorted, count, sizeof(*sorted), compareLatency);
+    //nearest rank like bench.c
+    size_t p99 = (size_t)(0.99 * count + 0.999999);
+    stats.p50Ns = sorted[count / 2];
+    stats.p99Ns = sorted[p99 - 1];
+    NN_FREE(sorted);
+  }
+  return stats;
+}
+
+#endif
@@ -0,0 +1,982 @@
+#include <stddef.h>
+
+#ifndef SIMD_H
+#define SIMD_H
+
+//SIMD kernels are only compiled with gcc/clang on x86.
+//Every other target uses the scalar loops in matrix.h
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+//Instruction sets ordered from the slowest to the fastest.
+//The order is used when a requested set is clamped to
+//what the CPU supports.
+typedef enum {
+  SIMD_SCALAR = 0,
+  SIMD_SSE,
+  SIMD_AVX2,
+  SIMD_AVX512
+} SimdIsa;
+
+//Best instruction set of the running CPU. It's detected
+//on the first call and remembered after that.
+SimdIsa simdIsa();
+//Force an instruction set. Sets that aren't supported by
+//the CPU are lowered to the best supported one. Returns
+//the instruction set that is used.
+SimdIsa simdSetIsa(SimdIsa isa);
+const char *simdIsaName(SimdIsa isa);
+
+/*
+  How the sigmoid is computed. The errors are the largest
+  absolute difference from the sigmoid computed in double,
+  measured over every float in [-100, 100]:
+
+  SIGMOID_EXACT = expf from libm. Same values as sigmoid()
+  in matrix.h. Not vectorized. Max error 8.9e-8, which is
+  float rounding.
+  SIGMOID_FAST = exp is a degree 5 polynomial after the
+  input is reduced to [-ln2/2, ln2/2]. Max error 9.0e-8.
+  SIGMOID_TABLE = linear interpolation between 4097 points
+  of the sigmoid on [-16, 16]. Inputs outside the range
+  use the end points. Max error 9.6e-7.
+*/
+typedef enum {
+  SIGMOID_EXACT = 0,
+  SIGMOID_FAST,
+  SIGMOID_TABLE
+} SigmoidMode;
+
+float simdSigmoidOne(float x, SigmoidMode mode);
+//Sigmoid of 'count' floats in place
+void simdSigmoid(float *x, size_t count, SigmoidMode mode);
+
+/*
+  c = a * b
+
+  Params:
+  m, n, k = c is m x n, a is m x k and b is k x n
+  lda, ldb, ldc = strides of a, b and c in floats
+
+  Returns 0 if there is no SIMD kernel for the current
+  instruction set. The caller uses its scalar loop then.
+*/
+int simdGemm(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  float *c, size_t ldc
+);
+
+/*
+  c = sigmoid(a * b + bias)
+
+  Same as simdGemm but the bias row is added and the
+  sigmoid is applied to each tile before it leaves the
+  kernel. 'bias' has n elements and is added to every
+  row of c. With SIGMOID_FAST and SIGMOID_TABLE the
+  sigmoid is done on the registers of the tile.
+*/
+int simdDense(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  const float *bias,
+  float *c, size_t ldc,
+  SigmoidMode mode
+);
+
+//c = a * b + bias, simdDense without the sigmoid
+int simdGemmBias(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  const float *bias,
+  float *c, size_t ldc
+);
+
+/*
+  Samples in one group of simdDenseLanes. One vector of
+  the current instruction set holds one neuron of every
+  sample of the group.
+*/
+size_t simdLanes();
+//Most samples simdLanes() can give on any instruction set
+#define SIMD_MAX_LANES 16
+
+/*
+  One layer for a group of simdLanes() samples stored as
+  structure of arrays: element p*lanes + s of 'in' is input
+  p of sample s, and 'out' is stored the same way.
+
+  out = sigmoid(in^T * w + bias)
+
+  Params:
+  n, k = 'w' is k x n, 'in' has k rows and 'out' has n rows
+  ldw = stride of 'w' in floats
+
+  Returns 0 if there is no vector kernel for the current
+  instruction set.
+*/
+int simdDenseLanes(
+  size_t n, size_t k,
+  const float *in,
+  const float *w, size_t ldw,
+  const float *bias,
+  float *out,
+  SigmoidMode mode
+);
+
+//_Float16 is only defined by compilers and targets that have it
+#ifdef __FLT16_MAX__
+//Converting load and store between half floats and floats.
+//They let the float kernels above run on half float matrices.
+void simdHalfToFloat(const _Float16 *src, float *dst, size_t count);
+void simdFloatToHalf(const float *src, _Float16 *dst, size_t count);
+
+/*
+  simdDense on half float matrices. Each column tile of b
+  and each row tile of a is converted to float right before
+  the tile kernel uses it and each tile of c is rounded to
+  half float when it's stored, so the whole matrices are
+  never copied. If 'bias' is NULL there is no bias and no
+  sigmoid, like simdGemm.
+
+  'scratch' has simdHalfScratch(k) floats. It's 0 if there
+  is no SIMD kernel for the current instruction set, and
+  simdDenseHalf returns 0 then.
+*/
+size_t simdHalfScratch(size_t k);
+int simdDenseHalf(
+  size_t m, size_t n, size_t k,
+  const _Float16 *a, size_t lda,
+  const _Float16 *b, size_t ldb,
+  const _Float16 *bias,
+  _Float16 *c, size_t ldc,
+  SigmoidMode mode, float *scratch
+);
+#endif
+
+#endif
+
+#ifdef SIMD_IMPL
+
+#include <math.h>
+
+//-1 means the instruction set is not detected yet
+static int simdCurrentIsa = -1;
+
+static SimdIsa simdDetect() {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return SIMD_AVX2;
+  }
+  if(__builtin_cpu_supports("sse2")) return SIMD_SSE;
+#endif
+  return SIMD_SCALAR;
+}
+
+SimdIsa simdIsa() {
+  if(simdCurrentIsa < 0) {
+    simdCurrentIsa = simdDetect();
+  }
+  return (SimdIsa)simdCurrentIsa;
+}
+
+SimdIsa simdSetIsa(SimdIsa isa) {
+  SimdIsa best = simdDetect();
+  simdCurrentIsa = isa > best ? best : isa;
+  return (SimdIsa)simdCurrentIsa;
+}
+
+const char *simdIsaName(SimdIsa isa) {
+  switch(isa) {
+    case SIMD_SSE: return "sse";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_AVX512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+/*
+  Constants of the polynomial exp. It's the expf of the
+  Cephes library: x = n*ln2 + r, exp(x) = 2^n * p(r).
+  ln2 is split in two parts so n*ln2 is exact enough.
+  Inputs are clamped to +-87 so 2^n stays a normal float.
+*/
+#define SIMD_EXP_MAX 87.0f
+#define SIMD_LOG2E 1.44269504088896341f
+#define SIMD_LN2_HI 0.693359375f
+#define SIMD_LN2_LO -2.12194440e-4f
+#define SIMD_EXP_P0 1.9875691500e-4f
+#define SIMD_EXP_P1 1.3981999507e-3f
+#define SIMD_EXP_P2 8.3334519073e-3f
+#define SIMD_EXP_P3 4.1665795894e-2f
+#define SIMD_EXP_P4 1.6666665459e-1f
+#define SIMD_EXP_P5 5.0000001201e-1f
+
+//The table has SIMD_TABLE_STEPS + 1 points from
+//-SIMD_TABLE_RANGE to SIMD_TABLE_RANGE
+#define SIMD_TABLE_RANGE 16.0f
+#define SIMD_TABLE_STEPS 4096
+#define SIMD_TABLE_SCALE (SIMD_TABLE_STEPS / (2*SIMD_TABLE_RANGE))
+
+static float simdSigmoidTable[SIMD_TABLE_STEPS + 1];
+//0 = not filled, 1 = being filled, 2 = ready
+static int simdTableState = 0;
+
+//Fills the table once. Other threads that need it at the
+//same time wait until it's ready.
+static void simdTableInit() {
+  if(__atomic_load_n(&simdTableState, __ATOMIC_ACQUIRE) == 2) return;
+
+  int expected = 0;
+  if(__atomic_compare_exchange_n(
+    &simdTableState, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+  )) {
+    for(size_t i = 0; i <= SIMD_TABLE_STEPS; i++) {
+      float x = (float)i / SIMD_TABLE_SCALE - SIMD_TABLE_RANGE;
+      simdSigmoidTable[i] = 1.0f/(1.0f + expf(-x));
+    }
+    __atomic_store_n(&simdTableState, 2, __ATOMIC_RELEASE);
+    return;
+  }
+
+  while(__atomic_load_n(&simdTableState, __ATOMIC_ACQUIRE) != 2) {
+  }
+}
+
+static float simdExpFast(float x) {
+  x = x > SIMD_EXP_MAX ? SIMD_EXP_MAX : x;
+  x = x < -SIMD_EXP_MAX ? -SIMD_EXP_MAX : x;
+
+  float fx = rintf(x * SIMD_LOG2E);
+  float r = x - fx*SIMD_LN2_HI - fx*SIMD_LN2_LO;
+
+  float y = SIMD_EXP_P0;
+  y = y*r + SIMD_EXP_P1;
+  y = y*r + SIMD_EXP_P2;
+  y = y*r + SIMD_EXP_P3;
+  y = y*r + SIMD_EXP_P4;
+  y = y*r + SIMD_EXP_P5;
+  y = y*r*r + r + 1.0f;
+
+  //2^fx is built directly in the exponent bits
+  union { int i; float f; } pow2n;
+  pow2n.i = ((int)fx + 127) << 23;
+  return y * pow2n.f;
+}
+
+static float simdTableLookup(float x) {
+  x = x > SIMD_TABLE_RANGE ? SIMD_TABLE_RANGE : x;
+  x = x < -SIMD_TABLE_RANGE ? -SIMD_TABLE_RANGE : x;
+
+  float t = (x + SIMD_TABLE_RANGE) * SIMD_TABLE_SCALE;
+  int i = (int)t;
+  if(i > SIMD_TABLE_STEPS - 1) i = SIMD_TABLE_STEPS - 1;
+  float frac = t - (float)i;
+  return simdSigmoidTable[i] + frac*(simdSigmoidTable[i+1] - simdSigmoidTable[i]);
+}
+
+float simdSigmoidOne(float x, SigmoidMode mode) {
+  switch(mode) {
+    case SIGMOID_FAST: return 1.0f/(1.0f + simdExpFast(-x));
+    case SIGMOID_TABLE:
+      simdTableInit();
+      return simdTableLookup(x);
+    default: return 1.0f/(1.0f + expf(-x));
+  }
+}
+
+#ifdef SIMD_X86
+
+/*
+  The kernels below split c into tiles of SIMD_MR rows and
+  two vectors of columns. A tile is kept in registers while
+  'kc' rows of b are streamed through it. Each row of b is
+  loaded once per tile and every element of a is broadcast
+  once per tile, so b is walked along its rows instead of
+  down its columns.
+
+  k is cut into blocks of SIMD_KC. The block of b that belongs
+  to a column tile (SIMD_KC x 2 vectors) stays in L1 while
+  every row tile of c is computed.
+
+  'bias' is only passed with the last block of k. It is added
+  to the accumulators before they are stored. NULL means
+  there is no bias. 'act' is the sigmoid that the AVX2 and
+  AVX-512 tiles apply to the accumulators after the bias.
+  NULL means no sigmoid.
+*/
+#define SIMD_MR 4
+#define SIMD_KC 256
+
+//The vector versions below do the same steps as
+//simdExpFast and simdTableLookup on every lane.
+__attribute__((target("avx2,fma")))
+static __m256 simdSigmoidFastAvx2(__m256 x) {
+  //exp(-x)
+  x = _mm256_sub_ps(_mm256_setzero_ps(), x);
+  x = _mm256_min_ps(x, _mm256_set1_ps(SIMD_EXP_MAX));
+  x = _mm256_max_ps(x, _mm256_set1_ps(-SIMD_EXP_MAX));
+
+  __m256 fx = _mm256_round_ps(
+    _mm256_mul_ps(x, _mm256_set1_ps(SIMD_LOG2E)),
+    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC
+  );
+  __m256 r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(SIMD_LN2_HI), x);
+  r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(SIMD_LN2_LO), r);
+
+  __m256 y = _mm256_set1_ps(SIMD_EXP_P0);
+  y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(SIMD_EXP_P1));
+  y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(SIMD_EXP_P2));
+  y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(SIMD_EXP_P3));
+  y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(SIMD_EXP_P4));
+  y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(SIMD_EXP_P5));
+  y = _mm256_fmadd_ps(y, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+  __m256i n = _mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127));
+  __m256 pow2n = _mm256_castsi256_ps(_mm256_slli_epi32(n, 23));
+  __m256 e = _mm256_mul_ps(y, pow2n);
+
+  __m256 one = _mm256_set1_ps(1.0f);
+  return _mm256_div_ps(one, _mm256_add_ps(one, e));
+}
+
+__attribute__((target("avx2,fma")))
+static __m256 simdSigmoidTableAvx2(__m256 x) {
+  x = _mm256_min_ps(x, _mm256_set1_ps(SIMD_TABLE_RANGE));
+  x = _mm256_max_ps(x, _mm256_set1_ps(-SIMD_TABLE_RANGE));
+
+  __m256 t = _mm256_mul_ps(
+    _mm256_add_ps(x, _mm256_set1_ps(SIMD_TABLE_RANGE)),
+    _mm256_set1_ps(SIMD_TABLE_SCALE)
+  );
+  __m256i i = _mm256_min_epi32(
+    _mm256_cvttps_epi32(t), _mm256_set1_epi32(SIMD_TABLE_STEPS - 1)
+  );
+  __m256 frac = _mm256_sub_ps(t, _mm256_cvtepi32_ps(i));
+
+  __m256 lo = _mm256_i32gather_ps(simdSigmoidTable, i, 4);
+  __m256 hi = _mm256_i32gather_ps(simdSigmoidTable + 1, i, 4);
+  return _mm256_fmadd_ps(frac, _mm256_sub_ps(hi, lo), lo);
+}
+
+__attribute__((target("avx2,fma")))
+static __m256 simdSigmoidAvx2(__m256 x, SigmoidMode mode) {
+  return mode == SIGMOID_TABLE ? simdSigmoidTableAvx2(x) : simdSigmoidFastAvx2(x);
+}
+
+__attribute__((target("avx512f")))
+static __m512 simdSigmoidFastAvx512(__m512 x) {
+  //exp(-x)
+  x = _mm512_sub_ps(_mm512_setzero_ps(), x);
+  x = _mm512_min_ps(x, _mm512_set1_ps(SIMD_EXP_MAX));
+  x = _mm512_max_ps(x, _mm512_set1_ps(-SIMD_EXP_MAX));
+
+  __m512 fx = _mm512_roundscale_ps(
+    _mm512_mul_ps(x, _mm512_set1_ps(SIMD_LOG2E)),
+    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC
+  );
+  __m512 r = _mm512_fnmadd_ps(fx, _mm512_set1_ps(SIMD_LN2_HI), x);
+  r = _mm512_fnmadd_ps(fx, _mm512_set1_ps(SIMD_LN2_LO), r);
+
+  __m512 y = _mm512_set1_ps(SIMD_EXP_P0);
+  y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(SIMD_EXP_P1));
+  y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(SIMD_EXP_P2));
+  y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(SIMD_EXP_P3));
+  y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(SIMD_EXP_P4));
+  y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(SIMD_EXP_P5));
+  y = _mm512_fmadd_ps(y, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+  __m512i n = _mm512_add_epi32(_mm512_cvtps_epi32(fx), _mm512_set1_epi32(127));
+  __m512 pow2n = _mm512_castsi512_ps(_mm512_slli_epi32(n, 23));
+  __m512 e = _mm512_mul_ps(y, pow2n);
+
+  __m512 one = _mm512_set1_ps(1.0f);
+  return _mm512_div_ps(one, _mm512_add_ps(one, e));
+}
+
+__attribute__((target("avx512f")))
+static __m512 simdSigmoidTableAvx512(__m512 x) {
+  x = _mm512_min_ps(x, _mm512_set1_ps(SIMD_TABLE_RANGE));
+  x = _mm512_max_ps(x, _mm512_set1_ps(-SIMD_TABLE_RANGE));
+
+  __m512 t = _mm512_mul_ps(
+    _mm512_add_ps(x, _mm512_set1_ps(SIMD_TABLE_RANGE)),
+    _mm512_set1_ps(SIMD_TABLE_SCALE)
+  );
+  __m512i i = _mm512_min_epi32(
+    _mm512_cvttps_epi32(t), _mm512_set1_epi32(SIMD_TABLE_STEPS - 1)
+  );
+  __m512 frac = _mm512_sub_ps(t, _mm512_cvtepi32_ps(i));
+
+  __m512 lo = _mm512_i32gather_ps(i, simdSigmoidTable, 4);
+  __m512 hi = _mm512_i32gather_ps(i, simdSigmoidTable + 1, 4);
+  return _mm512_fmadd_ps(frac, _mm512_sub_ps(hi, lo), lo);
+}
+
+__attribute__((target("avx512f")))
+static __m512 simdSigmoidAvx512(__m512 x, SigmoidMode mode) {
+  return mode == SIGMOID_TABLE ? simdSigmoidTableAvx512(x) : simdSigmoidFastAvx512(x);
+}
+
+//Scalar tile used by the SSE kernel for columns that
+//don't fill a vector
+static void simdTileScalar(
+  size_t mr, size_t nr, size_t kc,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  float *c, size_t ldc, int accumulate, const float *bias
+) {
+  for(size_t i = 0; i < mr; i++) {
+    for(size_t j = 0; j < nr; j++) {
+      float sum = accumulate ? c[i*ldc + j] : 0;
+      for(size_t p = 0; p < kc; p++) {
+        sum += a[i*lda + p] * b[p*ldb + j];
+      }
+      if(bias != NULL) sum += bias[j];
+      c[i*ldc + j] = sum;
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void simdTileSse(
+  size_t mr, size_t kc,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  float *c, size_t ldc, int accumulate, const float *bias
+) {
+  __m128 acc[SIMD_MR][2];
+
+  for(size_t i = 0; i < SIMD_MR; i++) {
+    if(i < mr && accumulate) {
+      acc[i][0] = _mm_loadu_ps(&c[i*ldc]);
+      acc[i][1] = _mm_loadu_ps(&c[i*ldc + 4]);
+    } else {
+      acc[i][0] = _mm_setzero_ps();
+      acc[i][1] = _mm_setzero_ps();
+    }
+  }
+
+  for(size_t p = 0; p < kc; p++) {
+    __m128 b0 = _mm_loadu_ps(&b[p*ldb]);
+    __m128 b1 = _mm_loadu_ps(&b[p*ldb + 4]);
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      if(i < mr) {
+        __m128 av = _mm_set1_ps(a[i*lda + p]);
+        acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(av, b0));
+        acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(av, b1));
+      }
+    }
+  }
+
+  if(bias != NULL) {
+    __m128 bias0 = _mm_loadu_ps(&bias[0]);
+    __m128 bias1 = _mm_loadu_ps(&bias[4]);
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      acc[i][0] = _mm_add_ps(acc[i][0], bias0);
+      acc[i][1] = _mm_add_ps(acc[i][1], bias1);
+    }
+  }
+
+  for(size_t i = 0; i < mr; i++) {
+    _mm_storeu_ps(&c[i*ldc], acc[i][0]);
+    _mm_storeu_ps(&c[i*ldc + 4], acc[i][1]);
+  }
+}
+
+//Lane mask of the first 'count' lanes of an AVX2 vector
+__attribute__((target("avx2")))
+static __m256i simdMaskAvx2(size_t count) {
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)count), lanes);
+}
+
+//'nr' can be smaller than two vectors. Masked loads and
+//stores are used for the columns past 'nr'.
+__attribute__((target("avx2,fma")))
+static void simdTileAvx2(
+  size_t mr, size_t nr, size_t kc,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  float *c, size_t ldc, int accumulate, const float *bias,
+  const SigmoidMode *act
+) {
+  __m256i m0 = simdMaskAvx2(nr);
+  __m256i m1 = simdMaskAvx2(nr > 8 ? nr - 8 : 0);
+  __m256 acc[SIMD_MR][2];
+
+  for(size_t i = 0; i < SIMD_MR; i++) {
+    if(i < mr && accumulate) {
+      acc[i][0] = _mm256_maskload_ps(&c[i*ldc], m0);
+      acc[i][1] = _mm256_maskload_ps(&c[i*ldc + 8], m1);
+    } else {
+      acc[i][0] = _mm256_setzero_ps();
+      acc[i][1] = _mm256_setzero_ps();
+    }
+  }
+
+  for(size_t p = 0; p < kc; p++) {
+    __m256 b0 = _mm256_maskload_ps(&b[p*ldb], m0);
+    __m256 b1 = _mm256_maskload_ps(&b[p*ldb + 8], m1);
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      if(i < mr) {
+        __m256 av = _mm256_broadcast_ss(&a[i*lda + p]);
+        acc[i][0] = _mm256_fmadd_ps(av, b0, acc[i][0]);
+        acc[i][1] = _mm256_fmadd_ps(av, b1, acc[i][1]);
+      }
+    }
+  }
+
+  if(bias != NULL) {
+    __m256 bias0 = _mm256_maskload_ps(&bias[0], m0);
+    __m256 bias1 = _mm256_maskload_ps(&bias[8], m1);
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      acc[i][0] = _mm256_add_ps(acc[i][0], bias0);
+      acc[i][1] = _mm256_add_ps(acc[i][1], bias1);
+    }
+  }
+
+  if(act != NULL) {
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      acc[i][0] = simdSigmoidAvx2(acc[i][0], *act);
+      acc[i][1] = simdSigmoidAvx2(acc[i][1], *act);
+    }
+  }
+
+  for(size_t i = 0; i < mr; i++) {
+    _mm256_maskstore_ps(&c[i*ldc], m0, acc[i][0]);
+    _mm256_maskstore_ps(&c[i*ldc + 8], m1, acc[i][1]);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void simdTileAvx512(
+  size_t mr, size_t nr, size_t kc,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  float *c, size_t ldc, int accumulate, const float *bias,
+  const SigmoidMode *act
+) {
+  __mmask16 m0 = nr >= 16 ? 0xFFFF : (__mmask16)((1u << nr) - 1);
+  __mmask16 m1 = nr >= 32 ? 0xFFFF :
+    nr > 16 ? (__mmask16)((1u << (nr - 16)) - 1) : 0;
+  __m512 acc[SIMD_MR][2];
+
+  for(size_t i = 0; i < SIMD_MR; i++) {
+    if(i < mr && accumulate) {
+      acc[i][0] = _mm512_maskz_loadu_ps(m0, &c[i*ldc]);
+      acc[i][1] = _mm512_maskz_loadu_ps(m1, &c[i*ldc + 16]);
+    } else {
+      acc[i][0] = _mm512_setzero_ps();
+      acc[i][1] = _mm512_setzero_ps();
+    }
+  }
+
+  for(size_t p = 0; p < kc; p++) {
+    __m512 b0 = _mm512_maskz_loadu_ps(m0, &b[p*ldb]);
+    __m512 b1 = _mm512_maskz_loadu_ps(m1, &b[p*ldb + 16]);
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      if(i < mr) {
+        __m512 av = _mm512_set1_ps(a[i*lda + p]);
+        acc[i][0] = _mm512_fmadd_ps(av, b0, acc[i][0]);
+        acc[i][1] = _mm512_fmadd_ps(av, b1, acc[i][1]);
+      }
+    }
+  }
+
+  if(bias != NULL) {
+    __m512 bias0 = _mm512_maskz_loadu_ps(m0, &bias[0]);
+    __m512 bias1 = _mm512_maskz_loadu_ps(m1, &bias[16]);
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      acc[i][0] = _mm512_add_ps(acc[i][0], bias0);
+      acc[i][1] = _mm512_add_ps(acc[i][1], bias1);
+    }
+  }
+
+  if(act != NULL) {
+    for(size_t i = 0; i < SIMD_MR; i++) {
+      acc[i][0] = simdSigmoidAvx512(acc[i][0], *act);
+      acc[i][1] = simdSigmoidAvx512(acc[i][1], *act);
+    }
+  }
+
+  for(size_t i = 0; i < mr; i++) {
+    _mm512_mask_storeu_ps(&c[i*ldc], m0, acc[i][0]);
+    _mm512_mask_storeu_ps(&c[i*ldc + 16], m1, acc[i][1]);
+  }
+}
+
+/*
+  Every input of the layer is already a vector of all the
+  samples, so a neuron is one multiply-add per input with
+  the weight broadcast. Nothing is shuffled between lanes.
+*/
+__attribute__((target("avx2,fma")))
+static void simdDenseLanesAvx2(
+  size_t n, size_t k,
+  const float *in,
+  const float *w, size_t ldw,
+  const float *bias,
+  float *out,
+  SigmoidMode mode
+) {
+  for(size_t j = 0; j < n; j++) {
+    __m256 acc = _mm256_set1_ps(bias[j]);
+    for(size_t p = 0; p < k; p++) {
+      acc = _mm256_fmadd_ps(
+        _mm256_load_ps(&in[p*8]), _mm256_set1_ps(w[p*ldw + j]), acc
+      );
+    }
+    if(mode != SIGMOID_EXACT) acc = simdSigmoidAvx2(acc, mode);
+    _mm256_store_ps(&out[j*8], acc);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void simdDenseLanesAvx512(
+  size_t n, size_t k,
+  const float *in,
+  const float *w, size_t ldw,
+  const float *bias,
+  float *out,
+  SigmoidMode mode
+) {
+  for(size_t j = 0; j < n; j++) {
+    __m512 acc = _mm512_set1_ps(bias[j]);
+    for(size_t p = 0; p < k; p++) {
+      acc = _mm512_fmadd_ps(
+        _mm512_load_ps(&in[p*16]), _mm512_set1_ps(w[p*ldw + j]), acc
+      );
+    }
+    if(mode != SIGMOID_EXACT) acc = simdSigmoidAvx512(acc, mode);
+    _mm512_store_ps(&out[j*16], acc);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void simdSigmoidRunAvx2(float *x, size_t count, SigmoidMode mode) {
+  for(size_t i = 0; i < count; i += 8) {
+    __m256i mask = simdMaskAvx2(count - i < 8 ? count - i : 8);
+    __m256 v = _mm256_maskload_ps(&x[i], mask);
+    _mm256_maskstore_ps(&x[i], mask, simdSigmoidAvx2(v, mode));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void simdSigmoidRunAvx512(float *x, size_t count, SigmoidMode mode) {
+  for(size_t i = 0; i < count; i += 16) {
+    size_t left = count - i;
+    __mmask16 mask = left >= 16 ? 0xFFFF : (__mmask16)((1u << left) - 1);
+    __m512 v = _mm512_maskz_loadu_ps(mask, &x[i]);
+    _mm512_mask_storeu_ps(&x[i], mask, simdSigmoidAvx512(v, mode));
+  }
+}
+
+#endif
+
+//Sigmoid of a finished tile when the tile kernel can't do
+//it in registers. The tile was just stored so it's still in L1.
+static void simdTileSigmoid(size_t mr, size_t nr, float *c, size_t ldc, SigmoidMode mode) {
+  for(size_t i = 0; i < mr; i++) {
+    simdSigmoid(&c[i*ldc], nr, mode);
+  }
+}
+
+static int simdGemmTiles(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  const float *bias, int activate, SigmoidMode mode,
+  float *c, size_t ldc
+) {
+#ifdef SIMD_X86
+  SimdIsa isa = simdIsa();
+  if(isa == SIMD_SCALAR) return 0;
+
+  //expf has no vector version so SIGMOID_EXACT is always
+  //done after the tile is stored
+  const SigmoidMode *act = 
+    activate && mode != SIGMOID_EXACT && isa >= SIMD_AVX2 ? &mode : NULL;
+  if(act != NULL && mode == SIGMOID_TABLE) simdTableInit();
+
+  //columns of one tile. A tile is two vectors wide.
+  size_t nr = isa == SIMD_AVX512 ? 32 : isa == SIMD_AVX2 ? 16 : 8;
+
+  //Nothing to accumulate. The result only has the bias.
+  if(k == 0) {
+    for(size_t i = 0; i < m; i++) {
+      for(size_t j = 0; j < n; j++) {
+        c[i*ldc + j] = bias != NULL ? bias[j] : 0;
+      }
+    }
+    if(activate) simdTileSigmoid(m, n, c, ldc, mode);
+    return 1;
+  }
+
+  for(size_t pc = 0; pc < k; pc += SIMD_KC) {
+    size_t kc = k - pc < SIMD_KC ? k - pc : SIMD_KC;
+    //The first block of k overwrites c. The next
+    //blocks add to it. The last block adds the bias
+    //and applies the activation.
+    int accumulate = pc > 0;
+    int last = pc + kc == k;
+
+    for(size_t jc = 0; jc < n; jc += nr) {
+      size_t nc = n - jc < nr ? n - jc : nr;
+      const float *bt = &b[pc*ldb + jc];
+      const float *biast = last && bias != NULL ? &bias[jc] : NULL;
+
+      for(size_t ic = 0; ic < m; ic += SIMD_MR) {
+        size_t mc = m - ic < SIMD_MR ? m - ic : SIMD_MR;
+        const float *at = &a[ic*lda + pc];
+        float *ct = &c[ic*ldc + jc];
+
+        if(isa == SIMD_AVX512) {
+          simdTileAvx512(
+            mc, nc, kc, at, lda, bt, ldb, ct, ldc, accumulate, biast, last ? act : NULL
+          );
+        } else if(isa == SIMD_AVX2) {
+          simdTileAvx2(
+            mc, nc, kc, at, lda, bt, ldb, ct, ldc, accumulate, biast, last ? act : NULL
+          );
+        } else if(nc == nr) {
+          simdTileSse(mc, kc, at, lda, bt, ldb, ct, ldc, accumulate, biast);
+        } else {
+          simdTileScalar(mc, nc, kc, at, lda, bt, ldb, ct, ldc, accumulate, biast);
+        }
+
+        if(last && activate && act == NULL) simdTileSigmoid(mc, nc, ct, ldc, mode);
+      }
+    }
+  }
+  return 1;
+#else
+  (void)m; (void)n; (void)k; (void)a; (void)lda; (void)b;
+  (void)ldb; (void)bias; (void)activate; (void)mode; (void)c; (void)ldc;
+  return 0;
+#endif
+}
+
+int simdGemm(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  float *c, size_t ldc
+) {
+  return simdGemmTiles(m, n, k, a, lda, b, ldb, NULL, 0, SIGMOID_EXACT, c, ldc);
+}
+
+int simdDense(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  const float *bias,
+  float *c, size_t ldc,
+  SigmoidMode mode
+) {
+  return simdGemmTiles(m, n, k, a, lda, b, ldb, bias, 1, mode, c, ldc);
+}
+
+int simdGemmBias(
+  size_t m, size_t n, size_t k,
+  const float *a, size_t lda,
+  const float *b, size_t ldb,
+  const float *bias,
+  float *c, size_t ldc
+) {
+  return simdGemmTiles(m, n, k, a, lda, b, ldb, bias, 0, SIGMOID_EXACT, c, ldc);
+}
+
+#ifdef __FLT16_MAX__
+
+#ifdef SIMD_X86
+//Every CPU with AVX2 also has F16C, which converts 8 half
+//floats at once. Stores round to the nearest half float.
+__attribute__((target("avx2,f16c")))
+static size_t simdHalfToFloatAvx2(const _Float16 *src, float *dst, size_t count) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m128i h = _mm_loadu_si128((const __m128i *)&src[i]);
+    _mm256_storeu_ps(&dst[i], _mm256_cvtph_ps(h));
+  }
+  return i;
+}
+
+__attribute__((target("avx2,f16c")))
+static size_t simdFloatToHalfAvx2(const float *src, _Float16 *dst, size_t count) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(&src[i]), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i *)&dst[i], h);
+  }
+  return i;
+}
+#endif
+
+void simdHalfToFloat(const _Float16 *src, float *dst, size_t count) {
+  size_t i = 0;
+#ifdef SIMD_X86
+  if(simdIsa() >= SIMD_AVX2) i = simdHalfToFloatAvx2(src, dst, count);
+#endif
+  for(; i < count; i++) {
+    dst[i] = (float)src[i];
+  }
+}
+
+void simdFloatToHalf(const float *src, _Float16 *dst, size_t count) {
+  size_t i = 0;
+#ifdef SIMD_X86
+  if(simdIsa() >= SIMD_AVX2) i = simdFloatToHalfAvx2(src, dst, count);
+#endif
+  for(; i < count; i++) {
+    dst[i] = (_Float16)src[i];
+  }
+}
+
+//Widest tile of any instruction set
+#define SIMD_NR_MAX 32
+
+size_t simdHalfScratch(size_t k) {
+#ifdef SIMD_X86
+  if(simdIsa() == SIMD_SCALAR) return 0;
+  //Column tile of b, row tile of a, tile of c and bias
+  return (SIMD_NR_MAX + SIMD_MR) * k + SIMD_MR * SIMD_NR_MAX + SIMD_NR_MAX;
+#else
+  (void)k;
+  return 0;
+#endif
+}
+
+/*
+  Loops like simdGemmTiles but the tile kernels get float
+  tiles made from the half float matrices. A column tile of
+  b is converted once and used by every row tile of a. Its
+  columns past 'n' are 0 so every tile is full width.
+*/
+int simdDenseHalf(
+  size_t m, size_t n, size_t k,
+  const _Float16 *a, size_t lda,
+  const _Float16 *b, size_t ldb,
+  const _Float16 *bias,
+  _Float16 *c, size_t ldc,
+  SigmoidMode mode, float *scratch
+) {
+#ifdef SIMD_X86
+  SimdIsa isa = simdIsa();
+  if(isa == SIMD_SCALAR) return 0;
+
+  int activate = bias != NULL;
+  const SigmoidMode *act =
+    activate && mode != SIGMOID_EXACT && isa >= SIMD_AVX2 ? &mode : NULL;
+  if(act != NULL && mode == SIGMOID_TABLE) simdTableInit();
+
+  size_t nr = isa == SIMD_AVX512 ? 32 : isa == SIMD_AVX2 ? 16 : 8;
+  float *bt = scratch;
+  float *at = bt + k * nr;
+  float *ct = at + SIMD_MR * k;
+  float *biast = ct + SIMD_MR * nr;
+
+  for(size_t jc = 0; jc < n; jc += nr) {
+    size_t nc = n - jc < nr ? n - jc : nr;
+    for(size_t p = 0; p < k; p++) {
+      simdHalfToFloat(&b[p*ldb + jc], &bt[p*nr], nc);
+      for(size_t j = nc; j < nr; j++) bt[p*nr + j] = 0;
+    }
+    if(bias != NULL) {
+      simdHalfToFloat(&bias[jc], biast, nc);
+      for(size_t j = nc; j < nr; j++) biast[j] = 0;
+    }
+
+    for(size_t ic = 0; ic < m; ic += SIMD_MR) {
+      size_t mc = m - ic < SIMD_MR ? m - ic : SIMD_MR;
+      for(size_t i = 0; i < mc; i++) {
+        simdHalfToFloat(&a[(ic + i)*lda], &at[i*k], k);
+      }
+
+      const float *tileBias = bias != NULL ? biast : NULL;
+      if(isa == SIMD_AVX512) {
+        simdTileAvx512(mc, nr, k, at, k, bt, nr, ct, nr, 0, tileBias, act);
+      } else if(isa == SIMD_AVX2) {
+        simdTileAvx2(mc, nr, k, at, k, bt, nr, ct, nr, 0, tileBias, act);
+      } else {
+        simdTileSse(mc, k, at, k, bt, nr, ct, nr, 0, tileBias);
+      }
+      if(activate && act == NULL) simdTileSigmoid(mc, nc, ct, nr, mode);
+
+      for(size_t i = 0; i < mc; i++) {
+        simdFloatToHalf(&ct[i*nr], &c[(ic + i)*ldc + jc], nc);
+      }
+    }
+  }
+  return 1;
+#else
+  (void)m; (void)n; (void)k; (void)a; (void)lda; (void)b; (void)ldb;
+  (void)bias; (void)c; (void)ldc; (void)mode; (void)scratch;
+  return 0;
+#endif
+}
+
+#endif
+
+size_t simdLanes() {
+#ifdef SIMD_X86
+  if(simdIsa() == SIMD_AVX512) return 16;
+#endif
+  return 8;
+}
+
+int simdDenseLanes(
+  size_t n, size_t k,
+  const float *in,
+  const float *w, size_t ldw,
+  const float *bias,
+  float *out,
+  SigmoidMode mode
+) {
+#ifdef SIMD_X86
+  SimdIsa isa = simdIsa();
+  if(isa < SIMD_AVX2) return 0;
+  if(mode == SIGMOID_TABLE) simdTableInit();
+
+  if(isa == SIMD_AVX512) {
+    simdDenseLanesAvx512(n, k, in, w, ldw, bias, out, mode);
+  } else {
+    simdDenseLanesAvx2(n, k, in, w, ldw, bias, out, mode);
+  }
+  //The layer is contiguous so expf runs over all of it at once
+  if(mode == SIGMOID_EXACT) simdSigmoid(out, n*simdLanes(), mode);
+  return 1;
+#else
+  (void)n; (void)k; (void)in; (void)w; (void)ldw; (void)bias; (void)out; (void)mode;
+  return 0;
+#endif
+}
+
+void simdSigmoid(float *x, size_t count, SigmoidMode mode) {
+  if(mode == SIGMOID_TABLE) simdTableInit();
+
+#ifdef SIMD_X86
+  SimdIsa isa = simdIsa();
+  if(mode != SIGMOID_EXACT && isa == SIMD_AVX512) {
+    simdSigmoidRunAvx512(x, count, mode);
+    return;
+  }
+  if(mode != SIGMOID_EXACT && isa == SIMD_AVX2) {
+    simdSigmoidRunAvx2(x, count, mode);
+    return;
+  }
+#endif
+
+  for(size_t i = 0; i < count; i++) {
+    x[i] = simdSigmoidOne(x[i], mode);
+  }
+}
+
+#endif
@@ -0,0 +1,368 @@
+#include <stdint.h>
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+/*
+  Magnitude pruning and an inference copy of a network
+  that only keeps the weights that are left.
+
+  pruneNetwork sets every weight whose absolute value is
+  below a threshold to 0 and gives back a mask of them.
+  The biases are never pruned. The network can then be
+  trained some more to win back the accuracy, with the
+  mask applied after every update so the pruned weights
+  stay 0.
+
+  sparseNetwork stores the weights that are not 0 in
+  compressed sparse rows (CSR): the weights into neuron j
+  of a layer are values[rowStart[j]] to
+  values[rowStart[j+1] - 1] and colIndex holds the neuron
+  of the layer before each of them comes from. So the
+  forward pass only does work for the weights that are
+  left. The rows of the input are activated in blocks of
+  SPARSE_LANES rows stored lane by lane like forwardLanes,
+  so every weight is multiplied with a whole vector of
+  activations.
+*/
+
+//Rows of the input activated at once by forwardSparse
+#define SPARSE_LANES 16
+
+typedef struct {
+  //bit k of 'bits' is set if params[k] is pruned
+  uint64_t *bits;
+  size_t paramCount;
+  //number of pruned weights
+  size_t pruned;
+} PruneMask;
+
+typedef struct {
+  size_t inputs;
+  size_t outputs;
+  size_t nonZeros;
+  //outputs + 1 entries
+  uint32_t *rowStart;
+  uint32_t *colIndex;
+  nnfloat *values;
+  nnfloat *biases;
+  ActivationType activation;
+} SparseLayer;
+
+typedef struct {
+  //number of SparseLayer, same as NeuralNetwork.count
+  size_t count;
+  SparseLayer *layers;
+  SigmoidMode sigmoidMode;
+  //weights that are left and weights of the dense network
+  size_t nonZeros;
+  size_t weightCount;
+  //activations of one block of rows for the layer that is
+  //computed and the one before it. They have room for the
+  //widest layer.
+  nnacc *bufA;
+  nnacc *bufB;
+
+  void *arena;
+  size_t arenaBytes;
+} SparseNetwork;
+
+/*
+  Sets the weights of 'n' with |w| < threshold to 0.
+*/
+PruneMask pruneNetwork(NeuralNetwork n, float threshold);
+//Threshold that prunes 'fraction' (0 to 1) of the weights
+float pruneThreshold(NeuralNetwork n, float fraction);
+void destroyPruneMask(PruneMask m);
+//Sets the pruned weights of 'n' back to 0. Call it after
+//every trainNetwork or optimizerStep while fine-tuning.
+void applyPruneMask(PruneMask m, NeuralNetwork n);
+//trainStep that keeps the pruned weights at 0. Returns
+//the cost before the step.
+float trainPruned(
+  NeuralNetwork n, NeuralNetwork g, PruneMask m,
+  Matrix ti, Matrix to, float rate
+);
+
+SparseNetwork sparseNetwork(NeuralNetwork n);
+void destroySparseNetwork(SparseNetwork s);
+//Bytes allocated for the sparse network
+size_t sparseNetworkBytes(SparseNetwork s);
+
+/*
+  Activates every row of 'input' and writes the outputs
+  to the rows of 'output'. The buffers of 's' are used, so
+  a network must only be used by one thread at a time.
+*/
+void forwardSparse(SparseNetwork s, Matrix input, Matrix output);
+
+#endif
+
+#ifdef SPARSE_IMPL
+
+#include <string.h>
+
+PruneMask pruneNetwork(NeuralNetwork n, float threshold) {
+  PruneMask m;
+  m.paramCount = n.paramCount;
+  m.pruned = 0;
+  m.bits = NN_MALLOC(sizeof(uint64_t) * ((n.paramCount + 63) / 64));
+  ASSERT_NN(m.bits != NULL);
+  memset(m.bits, 0, sizeof(uint64_t) * ((n.paramCount + 63) / 64));
+
+  for(size_t i = 0; i < n.count; i++) {
+    Matrix w = n.weights[i];
+    size_t offset = (size_t)(w.start - n.params);
+    for(size_t r = 0; r < w.rows; r++) {
+      for(size_t c = 0; c < w.cols; c++) {
+        size_t k = getCell(w, r, c);
+        nnacc v = w.start[k];
+        if(v < threshold && v > -threshold) {
+          w.start[k] = 0;
+          m.bits[(offset + k) / 64] |= (uint64_t)1 << ((offset + k) % 64);
+          m.pruned++;
+        }
+      }
+    }
+  }
+  return m;
+}
+
+static int compareMagnitude(const void *a, const void *b) {
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+float pruneThreshold(NeuralNetwork n, float fraction) {
+  size_t count = 0;
+  for(size_t i = 0; i < n.count; i++) count += n.weights[i].rows * n.weights[i].cols;
+  if(count == 0 || fraction <= 0) return 0;
+
+  float *mags = NN_MALLOC(sizeof(float) * count);
+  ASSERT_NN(mags != NULL);
+  size_t k = 0;
+  for(size_t i = 0; i < n.count; i++) {
+    Matrix w = n.weights[i];
+    for(size_t r = 0; r < w.rows; r++) {
+      for(size_t c = 0; c < w.cols; c++) {
+        mags[k++] = fabsf((float)w.start[getCell(w, r, c)]);
+      }
+    }
+  }
+  qsort(mags, count, sizeof(float), compareMagnitude);
+
+  //Everything below the magnitude at 'keep' is pruned.
+  //Past the largest weight everything goes.
+  size_t keep = (size_t)(fraction * (float)count);
+  float threshold = keep < count ? mags[keep] : INFINITY;
+  NN_FREE(mags);
+  return threshold;
+}
+
+void destroyPruneMask(PruneMask m) {
+  NN_FREE(m.bits);
+}
+
+void applyPruneMask(PruneMask m, NeuralNetwork n) {
+  ASSERT_NN(n.paramCount == m.paramCount);
+  for(size_t word = 0; word < (m.paramCount + 63) / 64; word++) {
+    uint64_t bits = m.bits[word];
+    //Only the set bits are visited, so a network with few
+    //pruned weights costs almost nothing
+    while(bits != 0) {
+      n.params[word*64 + (size_t)__builtin_ctzll(bits)] = 0;
+      bits &= bits - 1;
+    }
+  }
+}
+
+float trainPruned(
+  NeuralNetwork n, NeuralNetwork g, PruneMask m,
+  Matrix ti, Matrix to, float rate
+) {
+  float cost = trainStep(n, g, ti, to, rate);
+  applyPruneMask(m, n);
+  return cost;
+}
+
+static size_t sparseAlign(size_t bytes) {
+  return (bytes + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+}
+
+SparseNetwork sparseNetwork(NeuralNetwork n) {
+  SparseNetwork s;
+  s.count = n.count;
+  s.sigmoidMode = n.sigmoidMode;
+  s.nonZeros = 0;
+  s.weightCount = 0;
+
+  size_t width = 0;
+  size_t rowBytes = 0;
+  size_t biasBytes = 0;
+  for(size_t i = 0; i <= n.count; i++) {
+    if(n.layers[i].cols > width) width = n.layers[i].cols;
+  }
+  for(size_t i = 0; i < n.count; i++) {
+    Matrix w = n.weights[i];
+    s.weightCount += w.rows * w.cols;
+    for(size_t r = 0; r < w.rows; r++) {
+      for(size_t c = 0; c < w.cols; c++) {
+        if(w.start[getCell(w, r, c)] != 0) s.nonZeros++;
+      }
+    }
+    rowBytes += sizeof(uint32_t) * (w.cols + 1);
+    biasBytes += sizeof(nnfloat) * w.cols;
+  }
+  ASSERT_NN(s.nonZeros <= UINT32_MAX);
+
+  //One allocation like the arena of a network: the
+  //layers, the row starts, the column indexes, the values,
+  //the biases and the two buffers
+  size_t layerBytes = sparseAlign(sizeof(SparseLayer) * n.count);
+  rowBytes = sparseAlign(rowBytes);
+  size_t indexBytes = sparseAlign(sizeof(uint32_t) * s.nonZeros);
+  size_t valueBytes = sparseAlign(sizeof(nnfloat) * s.nonZeros);
+  biasBytes = sparseAlign(biasBytes);
+  size_t bufBytes = sparseAlign(sizeof(nnacc) * width * SPARSE_LANES);
+
+  s.arenaBytes = layerBytes + rowBytes + indexBytes + valueBytes + biasBytes + bufBytes * 2;
+  s.arena = NN_MALLOC(s.arenaBytes + NN_ALIGN - 1);
+  ASSERT_NN(s.arena != NULL);
+
+  char *base = (char *)sparseAlign((size_t)s.arena);
+  s.layers = (SparseLayer *)base;
+  uint32_t *rowCursor = (uint32_t *)(base + layerBytes);
+  uint32_t *indexCursor = (uint32_t *)(base + layerBytes + rowBytes);
+  nnfloat *valueCursor = (nnfloat *)(base + layerBytes + rowBytes + indexBytes);
+  nnfloat *biasCursor = (nnfloat *)(base + layerBytes + rowBytes + indexBytes + valueBytes);
+  s.bufA = (nnacc *)((char *)biasCursor + biasBytes);
+  s.bufB = (nnacc *)((char *)s.bufA + bufBytes);
+
+  for(size_t i = 0; i < n.count; i++) {
+    Matrix w = n.weights[i];
+    SparseLayer *l = &s.layers[i];
+    l->inputs = w.rows;
+    l->outputs = w.cols;
+    l->rowStart = rowCursor;
+    l->colIndex = indexCursor;
+    l->values = valueCursor;
+    l->biases = biasCursor;
+    l->activation = n.activations[i];
+
+    //Neuron j is column j of the weights, so the CSR rows
+    //are the columns of the dense matrix
+    uint32_t k = 0;
+    for(size_t j = 0; j < w.cols; j++) {
+      l->rowStart[j] = k;
+      for(size_t r = 0; r < w.rows; r++) {
+        nnfloat v = w.start[getCell(w, r, j)];
+        if(v == 0) continue;
+        l->colIndex[k] = (uint32_t)r;
+        l->values[k] = v;
+        k++;
+      }
+      l->biases[j] = n.biases[i].start[getCell(n.biases[i], 0, j)];
+    }
+    l->rowStart[w.cols] = k;
+    l->nonZeros = k;
+
+    rowCursor += w.cols + 1;
+    indexCursor += k;
+    valueCursor += k;
+    biasCursor += w.cols;
+  }
+
+  return s;
+}
+
+void destroySparseNetwork(SparseNetwork s) {
+  NN_FREE(s.arena);
+}
+
+size_t sparseNetworkBytes(SparseNetwork s) {
+  return s.arenaBytes;
+}
+
+//One layer for a block of rows. 'in' and 'out' hold
+//SPARSE_LANES activations per neuron.
+static void sparseDense(const SparseLayer *l, const nnacc *in, nnacc *out, SigmoidMode mode) {
+  for(size_t j = 0; j < l->outputs; j++) {
+    //The lane loops have a fixed count and 'sum' can't
+    //overlap 'in', so the compiler turns them into vector
+    //instructions without checks
+    nnacc sum[SPARSE_LANES];
+    for(size_t s = 0; s < SPARSE_LANES; s++) sum[s] = l->biases[j];
+
+    for(uint32_t k = l->rowStart[j]; k < l->rowStart[j+1]; k++) {
+      const nnacc *x = &in[(size_t)l->colIndex[k]*SPARSE_LANES];
+      nnacc w = l->values[k];
+      for(size_t s = 0; s < SPARSE_LANES; s++) sum[s] += w*x[s];
+    }
+    memcpy(&out[j*SPARSE_LANES], sum, sizeof(sum));
+  }
+  getActivation(l->activation)->forward(out, l->outputs*SPARSE_LANES, mode);
+}
+
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+
+//sparseDense with the 16 lanes of a neuron in two
+//registers. The buffers are aligned and every neuron
+//starts 64 bytes after the one before it.
+__attribute__((target("avx2,fma")))
+static void sparseDenseAvx2(const SparseLayer *l, const float *in, float *out, SigmoidMode mode) {
+  for(size_t j = 0; j < l->outputs; j++) {
+    __m256 lo = _mm256_set1_ps(l->biases[j]);
+    __m256 hi = lo;
+    for(uint32_t k = l->rowStart[j]; k < l->rowStart[j+1]; k++) {
+      const float *x = &in[(size_t)l->colIndex[k]*SPARSE_LANES];
+      __m256 w = _mm256_set1_ps(l->values[k]);
+      lo = _mm256_fmadd_ps(w, _mm256_load_ps(x), lo);
+      hi = _mm256_fmadd_ps(w, _mm256_load_ps(x + 8), hi);
+    }
+    _mm256_store_ps(&out[j*SPARSE_LANES], lo);
+    _mm256_store_ps(&out[j*SPARSE_LANES + 8], hi);
+  }
+  getActivation(l->activation)->forward(out, l->outputs*SPARSE_LANES, mode);
+}
+
+#endif
+
+void forwardSparse(SparseNetwork s, Matrix input, Matrix output) {
+  ASSERT_NN(s.count > 0);
+  ASSERT_NN(input.rows == output.rows);
+  ASSERT_NN(input.cols == s.layers[0].inputs);
+  ASSERT_NN(output.cols == s.layers[s.count-1].outputs);
+
+  for(size_t first = 0; first < input.rows; first += SPARSE_LANES) {
+    size_t rows = input.rows - first < SPARSE_LANES ? input.rows - first : SPARSE_LANES;
+    nnacc *in = s.bufA;
+    nnacc *out = s.bufB;
+
+    //Lanes past the last row are 0 and thrown away
+    for(size_t p = 0; p < input.cols; p++) {
+      for(size_t r = 0; r < SPARSE_LANES; r++) {
+        in[p*SPARSE_LANES + r] = r < rows ? input.start[getCell(input, first + r, p)] : 0;
+      }
+    }
+
+    for(size_t i = 0; i < s.count; i++) {
+#if defined(SIMD_X86) && defined(NN_FLOAT32)
+      if(simdIsa() >= SIMD_AVX2) sparseDenseAvx2(&s.layers[i], in, out, s.sigmoidMode);
+      else
+#endif
+      sparseDense(&s.layers[i], in, out, s.sigmoidMode);
+      nnacc *tmp = in;
+      in = out;
+      out = tmp;
+    }
+
+    for(size_t r = 0; r < rows; r++) {
+      for(size_t j = 0; j < output.cols; j++) {
+        output.start[getCell(output, first + r, j)] = in[j*SPARSE_LANES + r];
+      }
+    }
+  }
+}
+
+#endif